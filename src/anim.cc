@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <algorithm>
 #include <climits>
+#include <math.h>
 #include "anim.h"
 
 using namespace henge;
@@ -8,17 +9,33 @@ using namespace std;
 
 #define INVAL_TIME		UINT_MAX
 
+static unsigned int hier_version;
+
+static Matrix4x4 inverse_xform(const Matrix4x4 &mat);
+
 XFormNode::XFormNode()
 {
 	parent = 0;
 	name = 0;
+	posed = false;
+
+	version = 1;
+	cache_version = 0;
 	cache_time = INVAL_TIME;
+	cache_static = false;
+	cache_parent_stamp = world_stamp = 0;
+	cache_local = 0;
+	cache_inv = 0;
+	cache_prs = 0;
 
 	reset_xform();
 }
 
 XFormNode::XFormNode(const XFormNode &node)
 {
+	cache_local = 0;
+	cache_inv = 0;
+	cache_prs = 0;
 	*this = node;
 }
 
@@ -42,9 +59,26 @@ XFormNode &XFormNode::operator =(const XFormNode &node)
 	rtrack = node.rtrack;
 	pivot = node.pivot;
 
+	posed = node.posed;
+	pose_pos = node.pose_pos;
+	pose_rot = node.pose_rot;
+	pose_scale = node.pose_scale;
+
+	// caches are checked against the version, so they can be copied as they are
+	version = node.version;
 	cache_matrix = node.cache_matrix;
-	cache_inv_matrix = node.cache_inv_matrix;
 	cache_time = node.cache_time;
+	cache_version = node.cache_version;
+	cache_parent_stamp = node.cache_parent_stamp;
+	cache_static = node.cache_static;
+	world_stamp = node.world_stamp;
+
+	delete cache_local;
+	delete cache_inv;
+	delete cache_prs;
+	cache_local = node.cache_local ? new LocalCache(*node.cache_local) : 0;
+	cache_inv = node.cache_inv ? new InvCache(*node.cache_inv) : 0;
+	cache_prs = node.cache_prs ? new PRSCache(*node.cache_prs) : 0;
 
 	return *this;
 }
@@ -52,11 +86,14 @@ XFormNode &XFormNode::operator =(const XFormNode &node)
 XFormNode::~XFormNode()
 {
 	delete [] name;
+	delete cache_local;
+	delete cache_inv;
+	delete cache_prs;
 }
 
 void XFormNode::invalidate_matrix_cache()
 {
-	cache_time = INVAL_TIME;
+	version++;
 }
 
 XFormNode *XFormNode::clone() const
@@ -102,9 +139,13 @@ const char *XFormNode::get_name() const
 void XFormNode::add_child(XFormNode *child)
 {
 	if(find(children.begin(), children.end(), child) == children.end()) {
+		if(child->parent) {
+			child->parent->remove_child(child);
+		}
 		child->parent = this;
 		child->invalidate_matrix_cache();
 		children.push_back(child);
+		hier_version++;
 	}
 }
 
@@ -113,8 +154,10 @@ void XFormNode::remove_child(XFormNode *child)
 	vector<XFormNode*>::iterator iter;
 	iter = find(children.begin(), children.end(), child);
 	if(iter != children.end()) {
+		(*iter)->parent = 0;
 		(*iter)->invalidate_matrix_cache();
 		children.erase(iter);
+		hier_version++;
 	}
 }
 
@@ -128,6 +171,16 @@ int XFormNode::get_children_count() const
 	return (int)children.size();
 }
 
+XFormNode *XFormNode::get_parent() const
+{
+	return parent;
+}
+
+unsigned int XFormNode::get_hierarchy_version()
+{
+	return hier_version;
+}
+
 void XFormNode::set_pivot(const Vector3 &p)
 {
 	pivot = p;
@@ -173,9 +226,7 @@ void XFormNode::set_position(const Vector3 &pos, int time)
 		ptrack.add_key(TrackKey<Vector3>(pos, time));
 	}
 
-	if(time == cache_time) {
-		invalidate_matrix_cache();
-	}
+	invalidate_matrix_cache();
 }
 
 static void set_rotation_quat(Track<Quaternion> *track, const Quaternion &rot, int time)
@@ -192,9 +243,7 @@ void XFormNode::set_rotation(const Quaternion &rot, int time)
 {
 	set_rotation_quat(&rtrack, rot, time);
 
-	if(time == cache_time) {
-		invalidate_matrix_cache();
-	}
+	invalidate_matrix_cache();
 }
 
 void XFormNode::set_rotation(const Vector3 &euler, int time)
@@ -205,18 +254,14 @@ void XFormNode::set_rotation(const Vector3 &euler, int time)
 	zrot.set_rotation(Vector3(0, 0, 1), euler.z);
 	set_rotation_quat(&rtrack, xrot * yrot * zrot, time);
 
-	if(time == cache_time) {
-		invalidate_matrix_cache();
-	}
+	invalidate_matrix_cache();
 }
 
 void XFormNode::set_rotation(double angle, const Vector3 &axis, int time)
 {
 	set_rotation_quat(&rtrack, Quaternion(axis, angle), time);
 
-	if(time == cache_time) {
-		invalidate_matrix_cache();
-	}
+	invalidate_matrix_cache();
 }
 
 void XFormNode::set_scaling(const Vector3 &s, int time)
@@ -228,9 +273,7 @@ void XFormNode::set_scaling(const Vector3 &s, int time)
 		strack.add_key(TrackKey<Vector3>(s, time));
 	}
 
-	if(time == cache_time) {
-		invalidate_matrix_cache();
-	}
+	invalidate_matrix_cache();
 }
 
 void XFormNode::translate(const Vector3 &pos, int time)
@@ -242,9 +285,7 @@ void XFormNode::translate(const Vector3 &pos, int time)
 		ptrack.add_key(TrackKey<Vector3>(pos, time));
 	}
 
-	if(time == cache_time) {
-		invalidate_matrix_cache();
-	}
+	invalidate_matrix_cache();
 }
 
 void XFormNode::rotate(const Quaternion &rot, int time)
@@ -256,9 +297,7 @@ void XFormNode::rotate(const Quaternion &rot, int time)
 		rtrack.add_key(TrackKey<Quaternion>(rot, time));
 	}
 
-	if(time == cache_time) {
-		invalidate_matrix_cache();
-	}
+	invalidate_matrix_cache();
 }
 
 void XFormNode::rotate(const Vector3 &euler, int time)
@@ -284,89 +323,228 @@ void XFormNode::scale(const Vector3 &s, int time)
 		strack.add_key(TrackKey<Vector3>(s, time));
 	}
 
-	if(time == cache_time) {
+	invalidate_matrix_cache();
+}
+
+void XFormNode::begin_edit()
+{
+	ptrack.begin_edit();
+	rtrack.begin_edit();
+	strack.begin_edit();
+}
+
+void XFormNode::end_edit()
+{
+	ptrack.end_edit();
+	rtrack.end_edit();
+	strack.end_edit();
+	invalidate_matrix_cache();
+}
+
+void XFormNode::set_pose(const Vector3 &pos, const Quaternion &rot, const Vector3 &scale)
+{
+	posed = true;
+	pose_pos = pos;
+	pose_rot = rot;
+	pose_scale = scale;
+	invalidate_matrix_cache();
+}
+
+void XFormNode::clear_pose()
+{
+	if(posed) {
+		posed = false;
 		invalidate_matrix_cache();
 	}
 }
 
+bool XFormNode::is_posed() const
+{
+	return posed;
+}
+
+// the position relative to the parent, through the parent's world matrix
 Vector3 XFormNode::get_position(int time) const
 {
-	Vector3 pos = ptrack(time);
+	Vector3 pos = get_local_position(time);
 	if(parent) {
-		Vector3 parpos = parent->get_position(time);
-		Quaternion parrot = get_rotation(time);
-
-		pos -= parpos;
-		pos.transform(parrot.conjugate());
-		pos += parpos + parpos.transformed(parrot.conjugate());
-		pos *= parent->get_scaling(time);
+		pos.transform(parent->eval_world(time));
 	}
 	return pos;
 }
 
 Vector3 XFormNode::get_local_position(int time) const
 {
-	return ptrack(time);
+	return posed ? pose_pos : ptrack(time);
 }
 
 Quaternion XFormNode::get_local_rotation(int time) const
 {
-	return rtrack(time);
+	return posed ? pose_rot : rtrack(time);
 }
 
 Vector3 XFormNode::get_local_scaling(int time) const
 {
-	return strack(time);
+	return posed ? pose_scale : strack(time);
 }
 
 Quaternion XFormNode::get_rotation(int time) const
 {
 	if(parent) {
-		return parent->get_rotation(time) * rtrack(time);
+		eval_world(time);
+		update_world_prs(time);
+		return cache_prs->rot;
 	}
-	return rtrack(time);
+	return get_local_rotation(time);
 }
 
 Vector3 XFormNode::get_scaling(int time) const
 {
 	if(parent) {
-		return strack(time) * parent->get_scaling(time);
+		eval_world(time);
+		update_world_prs(time);
+		return cache_prs->scale;
 	}
-	return strack(time);
+	return get_local_scaling(time);
+}
+
+int XFormNode::reduce_keys(float pos_err, float rot_err, float scale_err)
+{
+	int num_removed = ptrack.reduce(pos_err) + rtrack.reduce(rot_err) + strack.reduce(scale_err);
+	if(num_removed) {
+		invalidate_matrix_cache();
+	}
+	return num_removed;
+}
+
+bool XFormNode::compress_keys()
+{
+	bool res = ptrack.compress();
+	res = rtrack.compress() && res;
+	res = strack.compress() && res;
+	invalidate_matrix_cache();
+	return res;
+}
+
+/* pivot * translation * rotation * scaling * -pivot, put together directly
+ * instead of multiplying five matrices.
+ */
+Matrix4x4 XFormNode::get_local_xform_matrix(int time) const
+{
+	Vector3 pos = get_local_position(time);
+	Matrix3x3 rot_mat = get_local_rotation(time).get_rotation_matrix();
+	Vector3 scale = get_local_scaling(time);
+
+	Matrix4x4 mat;
+	for(int i=0; i<3; i++) {
+		scalar_t tx = pivot[i] + pos[i];
+		for(int j=0; j<3; j++) {
+			mat[i][j] = rot_mat[i][j] * scale[j];
+			tx -= mat[i][j] * pivot[j];
+		}
+		mat[i][3] = tx;
+		mat[3][i] = 0.0;
+	}
+	mat[3][3] = 1.0;
+	return mat;
 }
 
 Matrix4x4 XFormNode::get_xform_matrix(int time) const
 {
-	if(cache_time != time) {
-		Matrix4x4 trans_mat, rot_mat, scale_mat, pivot_mat, neg_pivot_mat;
+	return eval_world(time);
+}
+
+const Matrix4x4 &XFormNode::eval_local(int time) const
+{
+	if(!cache_local) {
+		cache_local = new LocalCache;
+		cache_local->version = 0;
+	}
 
-		Vector3 pos = ptrack(time);
-		Quaternion rot = rtrack(time);
-		Vector3 scale = strack(time);
+	LocalCache *c = cache_local;
+	if(c->version != version || (c->time != time && !c->is_static)) {
+		c->matrix = get_local_xform_matrix(time);
+		c->time = time;
+		c->version = version;
+		c->is_static = posed ||
+			(!ptrack.is_animated() && !rtrack.is_animated() && !strack.is_animated());
+	}
+	return c->matrix;
+}
 
-		pivot_mat.set_translation(pivot);
-		neg_pivot_mat.set_translation(-pivot);
+// brings the world matrices of all the ancestors up to date first
+const Matrix4x4 &XFormNode::eval_world(int time) const
+{
+	if(parent) {
+		parent->eval_world(time);
+	}
+	return update_world(time);
+}
 
-		trans_mat.set_translation(pos);
-		rot_mat = (Matrix4x4)rot.get_rotation_matrix();
-		scale_mat.set_scaling(scale);
+// expects the world matrix of the parent to be up to date
+const Matrix4x4 &XFormNode::update_world(int time) const
+{
+	bool valid = cache_version == version && (cache_time == time || cache_static);
+	if(valid && parent) {
+		valid = cache_parent_stamp == parent->world_stamp;
+	}
 
-		cache_matrix = pivot_mat * trans_mat * rot_mat * scale_mat * neg_pivot_mat;
+	if(!valid) {
+		cache_matrix = eval_local(time);
+		cache_static = cache_local->is_static;
 		if(parent) {
-			cache_matrix = parent->get_xform_matrix(time) * cache_matrix;// * parent->get_xform_matrix(time);
+			cache_matrix = parent->cache_matrix * cache_matrix;
+			cache_parent_stamp = parent->world_stamp;
+			cache_static = cache_static && parent->cache_static;
 		}
 
-		// XXX probably won't need this bit (uncomment if it becomes useful)
-		//cache_inv_matrix = cache_matrix.inverse();
 		cache_time = time;
+		cache_version = version;
+		world_stamp++;
 	}
 	return cache_matrix;
 }
 
+/* expects the world matrices up to date, and brings the world rotation and
+ * scaling of the node and its ancestors in line with them, so each node only
+ * evaluates its own tracks when its world matrix has changed.
+ */
+void XFormNode::update_world_prs(int time) const
+{
+	if(!cache_prs) {
+		cache_prs = new PRSCache;
+	} else if(cache_prs->stamp == world_stamp) {
+		return;
+	}
+
+	PRSCache *c = cache_prs;
+	c->rot = get_local_rotation(time);
+	c->scale = get_local_scaling(time);
+	if(parent) {
+		parent->update_world_prs(time);
+		c->rot = parent->cache_prs->rot * c->rot;
+		c->scale = c->scale * parent->cache_prs->scale;
+	}
+	c->stamp = world_stamp;
+}
+
 Matrix4x4 XFormNode::get_inv_xform_matrix(int time) const
 {
-	get_xform_matrix(time);	// calculate invxform if needed
-	return cache_matrix.inverse();//cache_inv_matrix;
+	const Matrix4x4 &mat = eval_world(time);
+	if(!cache_inv) {
+		cache_inv = new InvCache;
+	} else if(cache_inv->stamp == world_stamp) {
+		return cache_inv->matrix;
+	}
+	cache_inv->matrix = inverse_xform(mat);
+	cache_inv->stamp = world_stamp;
+	return cache_inv->matrix;
+}
+
+unsigned int XFormNode::get_xform_stamp(int time) const
+{
+	eval_world(time);
+	return world_stamp;
 }
 
 Matrix3x3 XFormNode::get_rot_matrix(int time) const
@@ -374,3 +552,44 @@ Matrix3x3 XFormNode::get_rot_matrix(int time) const
 	Quaternion rot = get_rotation(time);
 	return rot.get_rotation_matrix();
 }
+
+/* node transformations are normally affine (the bottom row is 0 0 0 1), in
+ * which case the inverse is the inverse of the upper 3x3 part, which may
+ * include non-uniform scaling, and the translation taken back through it.
+ * Anything else goes through the general 4x4 inverse.
+ */
+static Matrix4x4 inverse_xform(const Matrix4x4 &mat)
+{
+	if(mat[3][0] != 0.0 || mat[3][1] != 0.0 || mat[3][2] != 0.0 || mat[3][3] != 1.0) {
+		return mat.inverse();
+	}
+
+	// cofactors of the 3x3 part
+	scalar_t cof[3][3];
+	for(int i=0; i<3; i++) {
+		int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+		for(int j=0; j<3; j++) {
+			int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+			cof[i][j] = mat[i1][j1] * mat[i2][j2] - mat[i1][j2] * mat[i2][j1];
+		}
+	}
+
+	scalar_t det = mat[0][0] * cof[0][0] + mat[0][1] * cof[0][1] + mat[0][2] * cof[0][2];
+	if(fabs(det) < XSMALL_NUMBER) {
+		return mat.inverse();
+	}
+	scalar_t inv_det = 1.0 / det;
+
+	Matrix4x4 inv;
+	for(int i=0; i<3; i++) {
+		scalar_t tx = 0.0;
+		for(int j=0; j<3; j++) {
+			inv[i][j] = cof[j][i] * inv_det;
+			tx -= inv[i][j] * mat[j][3];
+		}
+		inv[i][3] = tx;
+		inv[3][i] = 0.0;
+	}
+	inv[3][3] = 1.0;
+	return inv;
+}
@@ -4,6 +4,7 @@
 #include <vector>
 #include <algorithm>
 #include "vmath.h"
+#include "int_types.h"
 
 namespace henge {
 
@@ -32,6 +33,23 @@ struct TrackKey {
 	bool operator <(const TrackKey &k) const;
 };
 
+/* quantization of key values for compressed tracks (see Track::compress),
+ * each value is packed into 3 16bit words, with the help of a few
+ * per-track range values computed by init. Only Vector3 and Quaternion
+ * tracks can be compressed, init fails for anything else.
+ */
+#define KEY_CODEC_RANGE_SIZE	6
+
+template <typename T>
+struct KeyCodec {
+	static bool init(const TrackKey<T> *keys, int count, float *range);
+	static void encode(const T &val, const float *range, uint16_t *dest);
+	static T decode(const uint16_t *src, const float *range);
+};
+
+// compressed key times are stored relative to the first key of each block
+#define TRACK_KEY_BLOCK		16
+
 // track containing a number of keys
 template <typename T>
 class Track {
@@ -41,13 +59,41 @@ private:
 	Interpolator interp;
 	Extrapolator extrap;
 
+	struct PackedKeys {
+		std::vector<int> time_base;		// time of every TRACK_KEY_BLOCK'th key
+		std::vector<uint16_t> time_offs;	// time of each key from its block base
+		std::vector<uint16_t> val;			// quantized values (see KeyCodec)
+		float range[KEY_CODEC_RANGE_SIZE];
+	};
+	// compressed keys, used instead of the keys array if not null
+	PackedKeys *packed;
+
+	/* index of the key starting the last interval we looked up. Time tends
+	 * to move forward in small steps, so the next lookup usually lands in
+	 * the same or the next interval, and doesn't need a binary search.
+	 * It's only a hint, and is checked against the keys before use.
+	 */
+	mutable int cursor;
+
+	bool editing;	// between begin_edit and end_edit, keys are unsorted
+
 	TrackKey<T> *get_nearest_key(int time);
 	TrackKey<T> *get_nearest_key(int start, int end, int time);
-	void get_key_interval(int time, const TrackKey<T> **start, const TrackKey<T> **end) const;
+	int find_interval(int time) const;
+	void get_key_interval(int time, int *start, int *end) const;
+
+	int num_keys() const;
+	int key_time(int idx) const;
+	T key_value(int idx) const;
+
+	void sort_keys();
 
 public:
 
 	Track();
+	Track(const Track &track);
+	Track &operator =(const Track &track);
+	~Track();
 
 	void reset(const T &val);
 
@@ -57,12 +103,43 @@ public:
 	void set_extrapolator(Extrapolator extrap);
 	Extrapolator get_extrapolator() const;
 
+	// true if there's more than one key, i.e. the value changes over time
+	bool is_animated() const;
+
 	void add_key(const TrackKey<T> &key);
 	TrackKey<T> *get_key(int time);
 	void delete_key(int time);
 
+	/* bulk loading: between begin_edit and end_edit, add_key just appends
+	 * the keys, which are sorted once at the end. Keys with the same time
+	 * replace the ones added before them. get_key only finds the last key
+	 * added, and the track must not be evaluated, until end_edit.
+	 */
+	void begin_edit();
+	void end_edit();
+	bool is_editing() const;
+
+	// replaces all keys with count keys in any order, as above
+	void set_keys(const TrackKey<T> *keys, int count);
+
 	int get_key_count() const;
-	const TrackKey<T> &get_key_at(int idx) const;
+	TrackKey<T> get_key_at(int idx) const;
+
+	/* removes the keys which can be reproduced, within max_err, by
+	 * interpolating between the keys around them. See key_error for what
+	 * the error means for each type. Returns the number of keys removed.
+	 */
+	int reduce(float max_err);
+
+	/* switches to a compact form of the keys, decoded during evaluation:
+	 * quantized values (see KeyCodec), and 16bit key times relative to
+	 * every TRACK_KEY_BLOCK'th key. Returns false if the track can't be
+	 * compressed, in which case it's left as it is. Any modification of
+	 * the keys decompresses it.
+	 */
+	bool compress();
+	void decompress();
+	bool is_compressed() const;
 
 	T operator()(int time) const;
 	T operator()(float t) const;
@@ -77,14 +154,63 @@ private:
 
 	Vector3 pivot;
 
+	// local transformation overriding the tracks, see set_pose
+	bool posed;
+	Vector3 pose_pos, pose_scale;
+	Quaternion pose_rot;
+
 	XFormNode *parent;
 	std::vector<XFormNode*> children;
 
-	mutable Matrix4x4 cache_matrix, cache_inv_matrix;
+	/* the matrix caches are validated lazily against version numbers:
+	 * version changes with every modification of the node (tracks, pivot,
+	 * parent), and world_stamp every time the world matrix is recomputed,
+	 * so a child can tell if its parent's matrix has changed since it last
+	 * used it. A node which isn't animated, under parents which aren't
+	 * either, keeps its matrices regardless of the time.
+	 */
+	unsigned int version;
+
+	mutable Matrix4x4 cache_matrix;
 	mutable int cache_time;
+	mutable unsigned int cache_version, cache_parent_stamp;
+	mutable bool cache_static;
+	mutable unsigned int world_stamp;
+
+	/* the rest of the caches are only needed by some nodes, so they're
+	 * allocated the first time they're used: the local matrix by nodes whose
+	 * world matrix is evaluated, the inverse and the world rotation and
+	 * scaling by nodes asked for them (and their ancestors). Particles never
+	 * ask, and don't pay for any of them.
+	 */
+	struct LocalCache {
+		Matrix4x4 matrix;
+		int time;
+		unsigned int version;
+		bool is_static;
+	};
+	struct InvCache {
+		Matrix4x4 matrix;
+		unsigned int stamp;		// world_stamp the inverse was computed for
+	};
+	struct PRSCache {
+		Quaternion rot;
+		Vector3 scale;
+		unsigned int stamp;
+	};
+	mutable LocalCache *cache_local;
+	mutable InvCache *cache_inv;
+	mutable PRSCache *cache_prs;
 
 	void invalidate_matrix_cache();
 
+	const Matrix4x4 &eval_local(int time) const;
+	const Matrix4x4 &eval_world(int time) const;
+	const Matrix4x4 &update_world(int time) const;
+	void update_world_prs(int time) const;
+
+	friend class XFormGraph;
+
 public:
 	XFormNode();
 	XFormNode(const XFormNode &node);
@@ -104,6 +230,13 @@ public:
 
 	virtual XFormNode **get_children();
 	virtual int get_children_count() const;
+	virtual XFormNode *get_parent() const;
+
+	/* incremented every time a node is attached to or detached from a
+	 * parent anywhere, so that anything laying out hierarchies (see
+	 * XFormGraph) knows when to do it again.
+	 */
+	static unsigned int get_hierarchy_version();
 
 	virtual void set_pivot(const Vector3 &p);
 	virtual const Vector3 &get_pivot() const;
@@ -125,6 +258,22 @@ public:
 	virtual void rotate(double angle, const Vector3 &axis, int time = 0);
 	virtual void scale(const Vector3 &s, int time = 0);
 
+	/* bulk keyframe loading for all tracks (see Track::begin_edit): keys
+	 * set in between are sorted once by end_edit, instead of one at a time.
+	 * The relative modifications (translate, rotate, scale) only combine
+	 * with the last key set in the meantime.
+	 */
+	virtual void begin_edit();
+	virtual void end_edit();
+
+	/* sets a local transformation which overrides the keyframe tracks, for
+	 * nodes driven by animation clips and pose buffers (see animclip.h),
+	 * until clear_pose is called.
+	 */
+	virtual void set_pose(const Vector3 &pos, const Quaternion &rot, const Vector3 &scale);
+	virtual void clear_pose();
+	virtual bool is_posed() const;
+
 	virtual Vector3 get_position(int time = 0) const;
 	virtual Quaternion get_rotation(int time = 0) const;
 	virtual Vector3 get_scaling(int time = 0) const;
@@ -133,8 +282,26 @@ public:
 	virtual Quaternion get_local_rotation(int time = 0) const;
 	virtual Vector3 get_local_scaling(int time = 0) const;
 
+	/* keyframe reduction (see Track::reduce), with a separate maximum
+	 * error for positions, rotations (radians) and scaling. Returns the
+	 * number of keys removed.
+	 */
+	virtual int reduce_keys(float pos_err, float rot_err, float scale_err);
+
+	// compresses the keys of all tracks (see Track::compress)
+	virtual bool compress_keys();
+
+	// transformation relative to the parent
+	virtual Matrix4x4 get_local_xform_matrix(int time = 0) const;
 	virtual Matrix4x4 get_xform_matrix(int time = 0) const;
+	// cached with the world matrix, and cheaper for affine transformations
 	virtual Matrix4x4 get_inv_xform_matrix(int time = 0) const;
+
+	/* number identifying the world matrix at the given time, which changes
+	 * whenever it has to be recomputed, so that anything derived from it
+	 * can tell when to do the same.
+	 */
+	virtual unsigned int get_xform_stamp(int time = 0) const;
 	virtual Matrix3x3 get_rot_matrix(int time = 0) const;
 };
 
@@ -5,6 +5,125 @@ inline Quaternion catmull_rom_spline(const Quaternion &q1, const Quaternion &q2,
 	return slerp(q2, q3, t);
 }
 
+// error metrics for keyframe reduction: distance, and angle for rotations
+inline float key_error(const Vector3 &a, const Vector3 &b)
+{
+	return (a - b).length();
+}
+
+inline float key_error(const Quaternion &a, const Quaternion &b)
+{
+	float d = fabs(a.s * b.s + dot_product(a.v, b.v)) / (a.length() * b.length());
+	return d >= 1.0 ? 0.0 : 2.0 * acos(d);
+}
+
+
+template <typename T>
+bool KeyCodec<T>::init(const TrackKey<T> *keys, int count, float *range)
+{
+	return false;
+}
+
+template <typename T>
+void KeyCodec<T>::encode(const T &val, const float *range, uint16_t *dest) {}
+
+template <typename T>
+T KeyCodec<T>::decode(const uint16_t *src, const float *range)
+{
+	return T();
+}
+
+/* vectors are quantized to 16 bits per component, in the range of the
+ * values of the track: range[0-2] is the minimum, range[3-5] the step.
+ */
+template <>
+inline bool KeyCodec<Vector3>::init(const TrackKey<Vector3> *keys, int count, float *range)
+{
+	Vector3 vmin = keys[0].val, vmax = keys[0].val;
+	for(int i=1; i<count; i++) {
+		for(int j=0; j<3; j++) {
+			if(keys[i].val[j] < vmin[j]) vmin[j] = keys[i].val[j];
+			if(keys[i].val[j] > vmax[j]) vmax[j] = keys[i].val[j];
+		}
+	}
+
+	for(int i=0; i<3; i++) {
+		range[i] = vmin[i];
+		range[i + 3] = (vmax[i] - vmin[i]) / 65535.0;
+	}
+	return true;
+}
+
+template <>
+inline void KeyCodec<Vector3>::encode(const Vector3 &val, const float *range, uint16_t *dest)
+{
+	for(int i=0; i<3; i++) {
+		float q = range[i + 3] > 0.0 ? (val[i] - range[i]) / range[i + 3] + 0.5 : 0.0;
+		dest[i] = (uint16_t)(q < 0.0 ? 0.0 : (q > 65535.0 ? 65535.0 : q));
+	}
+}
+
+template <>
+inline Vector3 KeyCodec<Vector3>::decode(const uint16_t *src, const float *range)
+{
+	return Vector3(range[0] + src[0] * range[3], range[1] + src[1] * range[4],
+			range[2] + src[2] * range[5]);
+}
+
+/* "smallest three" quaternions: the largest component (made positive, which
+ * doesn't change the rotation) is dropped and recovered from the others,
+ * which are then within +/- 1/sqrt(2) and quantized to 15 bits each. The
+ * index of the dropped component goes in the top bits of the first two.
+ */
+#define QUAT_CODEC_LIMIT	0.70710678
+
+template <>
+inline bool KeyCodec<Quaternion>::init(const TrackKey<Quaternion> *keys, int count, float *range)
+{
+	return true;
+}
+
+template <>
+inline void KeyCodec<Quaternion>::encode(const Quaternion &val, const float *range, uint16_t *dest)
+{
+	Quaternion q = val.normalized();
+	float c[4] = {(float)q.v.x, (float)q.v.y, (float)q.v.z, (float)q.s};
+
+	int largest = 0;
+	for(int i=1; i<4; i++) {
+		if(fabs(c[i]) > fabs(c[largest])) {
+			largest = i;
+		}
+	}
+	float sign = c[largest] < 0.0 ? -1.0 : 1.0;
+
+	for(int i=0, j=0; i<4; i++) {
+		if(i == largest) continue;
+
+		float x = (sign * c[i] + QUAT_CODEC_LIMIT) / (2.0 * QUAT_CODEC_LIMIT) * 32767.0 + 0.5;
+		dest[j++] = (uint16_t)(x < 0.0 ? 0.0 : (x > 32767.0 ? 32767.0 : x));
+	}
+	dest[0] |= (largest & 1) << 15;
+	dest[1] |= (largest >> 1) << 15;
+}
+
+template <>
+inline Quaternion KeyCodec<Quaternion>::decode(const uint16_t *src, const float *range)
+{
+	int largest = (src[0] >> 15) | ((src[1] >> 15) << 1);
+
+	float c[4], sum_sq = 0.0;
+	for(int i=0, j=0; i<4; i++) {
+		if(i == largest) continue;
+
+		c[i] = (src[j++] & 0x7fff) / 32767.0 * (2.0 * QUAT_CODEC_LIMIT) - QUAT_CODEC_LIMIT;
+		sum_sq += c[i] * c[i];
+	}
+	c[largest] = sum_sq < 1.0 ? sqrt(1.0 - sum_sq) : 0.0;
+
+	return Quaternion(c[3], c[0], c[1], c[2]);
+}
+
 template <typename T>
 TrackKey<T>::TrackKey() : time(0) {}
 
@@ -41,6 +160,41 @@ Track<T>::Track()
 {
 	interp = INTERP_LINEAR;
 	extrap = EXTRAP_CLAMP;
+	cursor = 0;
+	packed = 0;
+	editing = false;
+}
+
+template <typename T>
+Track<T>::Track(const Track<T> &track)
+{
+	packed = 0;
+	*this = track;
+}
+
+template <typename T>
+Track<T> &Track<T>::operator =(const Track<T> &track)
+{
+	if(this == &track) {
+		return *this;
+	}
+
+	def_val = track.def_val;
+	keys = track.keys;
+	interp = track.interp;
+	extrap = track.extrap;
+	cursor = track.cursor;
+	editing = track.editing;
+
+	delete packed;
+	packed = track.packed ? new PackedKeys(*track.packed) : 0;
+	return *this;
+}
+
+template <typename T>
+Track<T>::~Track()
+{
+	delete packed;
 }
 
 template <typename T>
@@ -66,34 +220,95 @@ TrackKey<T> *Track<T>::get_nearest_key(int start, int end, int time)
 	return &keys[mid];
 }
 
-/* returns (through parameters) pointers to the 2 keys that bound the interval
- * containing the specified time value.
+/* returns the index of the last key at or before the specified time, which
+ * must be within the range of the keys, trying the cached interval and the
+ * one after it before resorting to binary search.
  */
 template <typename T>
-void Track<T>::get_key_interval(int time, const TrackKey<T> **start, const TrackKey<T> **end) const
+int Track<T>::find_interval(int time) const
 {
-	const TrackKey<T> *nearest = ((Track<T>*)this)->get_nearest_key(time);
-	if(!nearest) {
-		*start = *end = 0;
+	int last = num_keys() - 1;
+	int idx = cursor;
+
+	if(idx >= 0 && idx < last && key_time(idx) <= time) {
+		if(time < key_time(idx + 1)) {
+			return idx;
+		}
+		if(idx + 1 < last && time < key_time(idx + 2)) {
+			return cursor = idx + 1;
+		}
+	}
+
+	int start = 0, end = last;
+	while(start < end) {
+		int mid = (start + end + 1) / 2;
+		if(key_time(mid) <= time) {
+			start = mid;
+		} else {
+			end = mid - 1;
+		}
+	}
+	return cursor = start;
+}
+
+/* returns (through parameters) the indices of the 2 keys that bound the
+ * interval containing the specified time value. If the time is exactly on a
+ * key, or outside the range of the keys, end is -1 and start is the key to
+ * use. Both are -1 if there are no keys.
+ */
+template <typename T>
+void Track<T>::get_key_interval(int time, int *start, int *end) const
+{
+	int nkeys = num_keys();
+	*start = *end = -1;
+	if(!nkeys) return;
+
+	if(time <= key_time(0)) {
+		*start = 0;
+		return;
+	}
+	if(time >= key_time(nkeys - 1)) {
+		*start = nkeys - 1;
 		return;
 	}
 
-	*start = nearest;
-	*end = 0;
+	int idx = find_interval(time);
+	*start = idx;
+	if(key_time(idx) != time) {
+		*end = idx + 1;
+	}
+}
+
+template <typename T>
+int Track<T>::num_keys() const
+{
+	return packed ? (int)packed->time_offs.size() : (int)keys.size();
+}
 
-	if(time < nearest->time && nearest->time != keys[0].time) {
-		*start = nearest - 1;
-		*end = nearest;
-	} else if(time > nearest->time && nearest->time != keys[keys.size() - 1].time) {
-		*start = nearest;
-		*end = nearest + 1;
+template <typename T>
+int Track<T>::key_time(int idx) const
+{
+	if(packed) {
+		return packed->time_base[idx / TRACK_KEY_BLOCK] + packed->time_offs[idx];
+	}
+	return keys[idx].time;
+}
+
+template <typename T>
+T Track<T>::key_value(int idx) const
+{
+	if(packed) {
+		return KeyCodec<T>::decode(&packed->val[idx * 3], packed->range);
 	}
+	return keys[idx].val;
 }
 
 template <typename T>
 void Track<T>::reset(const T &val)
 {
 	keys.clear();
+	delete packed;
+	packed = 0;
 	interp = INTERP_LINEAR;
 	extrap = EXTRAP_CLAMP;
 	def_val = val;
@@ -124,24 +339,57 @@ Extrapolator Track<T>::get_extrapolator() const
 }
 
 template <typename T>
-void Track<T>::add_key(const TrackKey<T> &key)
+bool Track<T>::is_animated() const
+{
+	return num_keys() > 1;
+}
+
+// sorts the keys by time, keeping only the last one added for each time
+template <typename T>
+void Track<T>::sort_keys()
 {
-	if(!keys.empty()) {
-		TrackKey<T> *nearest = get_nearest_key(key.time);
-		if(nearest->time == key.time) {
-			nearest->val = key.val;
+	std::stable_sort(keys.begin(), keys.end());
+
+	size_t nkeys = 0;
+	for(size_t i=0; i<keys.size(); i++) {
+		if(nkeys && keys[nkeys - 1].time == keys[i].time) {
+			keys[nkeys - 1] = keys[i];
 		} else {
-			keys.push_back(key);
-			sort(keys.begin(), keys.end());
+			keys[nkeys++] = keys[i];
 		}
-	} else {
+	}
+	keys.resize(nkeys);
+	cursor = 0;
+}
+
+template <typename T>
+void Track<T>::add_key(const TrackKey<T> &key)
+{
+	decompress();
+
+	if(editing || keys.empty() || keys.back().time < key.time) {
 		keys.push_back(key);
+		return;
+	}
+
+	typename std::vector<TrackKey<T> >::iterator iter;
+	iter = std::lower_bound(keys.begin(), keys.end(), key);
+	if(iter->time == key.time) {
+		iter->val = key.val;
+	} else {
+		keys.insert(iter, key);
 	}
 }
 
 template <typename T>
 TrackKey<T> *Track<T>::get_key(int time)
 {
+	decompress();
+
+	if(editing) {
+		return keys.empty() || keys.back().time != time ? 0 : &keys.back();
+	}
+
 	TrackKey<T> *key = get_nearest_key(time);
 	if(!key) return 0;
 	return (key->time == time) ? key : 0;
@@ -150,6 +398,8 @@ TrackKey<T> *Track<T>::get_key(int time)
 template <typename T>
 void Track<T>::delete_key(int time)
 {
+	decompress();
+
 	TrackKey<T> key;
 	key.time = time;
 	typename std::vector<TrackKey<T> >::iterator iter = find(keys.begin(), keys.end(), key);
@@ -158,31 +408,169 @@ void Track<T>::delete_key(int time)
 	}
 }
 
+template <typename T>
+void Track<T>::begin_edit()
+{
+	decompress();
+	editing = true;
+}
+
+template <typename T>
+void Track<T>::end_edit()
+{
+	if(editing) {
+		sort_keys();
+		editing = false;
+	}
+}
+
+template <typename T>
+bool Track<T>::is_editing() const
+{
+	return editing;
+}
+
+template <typename T>
+void Track<T>::set_keys(const TrackKey<T> *keys, int count)
+{
+	decompress();
+	this->keys.assign(keys, keys + count);
+	sort_keys();
+}
+
 template <typename T>
 int Track<T>::get_key_count() const
 {
-	return (int)keys.size();
+	return num_keys();
+}
+
+template <typename T>
+TrackKey<T> Track<T>::get_key_at(int idx) const
+{
+	return TrackKey<T>(key_value(idx), key_time(idx));
 }
 
+/* greedy reduction: starting from the last key kept, keep extending the
+ * span over the following keys for as long as interpolating across it
+ * reproduces all the keys in it. Spans are limited to TRACK_MAX_REDUCE_SPAN
+ * keys, to keep the cost linear.
+ */
+#define TRACK_MAX_REDUCE_SPAN	256
+
 template <typename T>
-const TrackKey<T> &Track<T>::get_key_at(int idx) const
+int Track<T>::reduce(float max_err)
 {
-	return keys[idx];
+	if(editing) return 0;
+	decompress();
+
+	int nkeys = (int)keys.size();
+	if(nkeys < 3) return 0;
+
+	std::vector<TrackKey<T> > res;
+	res.push_back(keys[0]);
+
+	int prev = 0;
+	for(int i=1; i<nkeys - 1; i++) {
+		const TrackKey<T> &k0 = keys[prev];
+		const TrackKey<T> &k1 = keys[i + 1];
+
+		// can all the keys in (prev, i] be dropped?
+		bool drop = i - prev < TRACK_MAX_REDUCE_SPAN;
+		for(int j=prev + 1; drop && j<=i; j++) {
+			T val = k0.val;
+			if(interp != INTERP_STEP) {
+				float t = (float)(keys[j].time - k0.time) / (float)(k1.time - k0.time);
+				val = lerp(k0.val, k1.val, t);
+			}
+			drop = key_error(val, keys[j].val) <= max_err;
+		}
+
+		if(!drop) {
+			res.push_back(keys[i]);
+			prev = i;
+		}
+	}
+	res.push_back(keys[nkeys - 1]);
+
+	int num_removed = nkeys - (int)res.size();
+	keys.swap(res);
+	return num_removed;
+}
+
+template <typename T>
+bool Track<T>::compress()
+{
+	if(packed) return true;
+	if(editing) return false;
+
+	int nkeys = (int)keys.size();
+	if(!nkeys) return false;
+
+	PackedKeys *pk = new PackedKeys;
+	if(!KeyCodec<T>::init(&keys[0], nkeys, pk->range)) {
+		delete pk;
+		return false;
+	}
+
+	pk->time_base.resize((nkeys + TRACK_KEY_BLOCK - 1) / TRACK_KEY_BLOCK);
+	pk->time_offs.resize(nkeys);
+	pk->val.resize(nkeys * 3);
+
+	for(int i=0; i<nkeys; i++) {
+		int base = keys[i - i % TRACK_KEY_BLOCK].time;
+		int offs = keys[i].time - base;
+		if(offs > 0xffff) {
+			// keys too far apart for 16bit offsets
+			delete pk;
+			return false;
+		}
+		pk->time_base[i / TRACK_KEY_BLOCK] = base;
+		pk->time_offs[i] = (uint16_t)offs;
+
+		KeyCodec<T>::encode(keys[i].val, pk->range, &pk->val[i * 3]);
+	}
+
+	std::vector<TrackKey<T> >().swap(keys);
+	packed = pk;
+	return true;
+}
+
+template <typename T>
+void Track<T>::decompress()
+{
+	if(!packed) return;
+
+	int nkeys = num_keys();
+	keys.resize(nkeys);
+	for(int i=0; i<nkeys; i++) {
+		keys[i].time = key_time(i);
+		keys[i].val = key_value(i);
+	}
+
+	delete packed;
+	packed = 0;
+}
+
+template <typename T>
+bool Track<T>::is_compressed() const
+{
+	return packed != 0;
 }
 
 template <typename T>
 T Track<T>::operator()(int time) const
 {
-	if(keys.empty()) {
+	int nkeys = num_keys();
+	if(!nkeys) {
 		return def_val;
 	}
 
 	/* if we're outside of our defined track range, use the designated
 	 * extrapolator to modify the time
 	 */
-	if(keys.size() > 1) {
-		int first = keys.begin()->time;
-		int last = (keys.end() - 1)->time;
+	if(nkeys > 1) {
+		int first = key_time(0);
+		int last = key_time(nkeys - 1);
 
 		if(first != last && (time < first || time > last)) {
 			switch(extrap) {
@@ -201,47 +589,46 @@ T Track<T>::operator()(int time) const
 		}
 	}
 
-	const TrackKey<T> *start, *end;
-	((Track<T>*)this)->get_key_interval(time, &start, &end);
-	if(!start && !end) {
+	int start, end;
+	get_key_interval(time, &start, &end);
+	if(start == -1) {
 		return def_val;
 	}
 
 	switch(interp) {
 	case INTERP_STEP:
-		return start->val;
+		return key_value(start);
 
 	case INTERP_LINEAR:
-		if(end) {
+		if(end != -1) {
 			// find the parametric location of the given keyframe in the range we have
-			float t = (float)(time - start->time) / (float)(end->time - start->time);
+			int t0 = key_time(start);
+			float t = (float)(time - t0) / (float)(key_time(end) - t0);
 
-			return lerp(start->val, end->val, t);
+			return lerp(key_value(start), key_value(end), t);
 		} else {
-			return start->val;
+			return key_value(start);
 		}
 
 	case INTERP_CUBIC:
-		if(end) {
-			float t = (float)(time - start->time) / (float)(end->time - start->time);
-
-			int sidx = start - &keys[0];
-			int eidx = end - &keys[0];
+		if(end != -1) {
+			int t0 = key_time(start);
+			float t = (float)(time - t0) / (float)(key_time(end) - t0);
 
-			T v0 = (sidx > 0  ? start - 1 : start)->val;
-			T v1 = start->val;
-			T v2 = end->val;
-			T v3 = (eidx < (int)keys.size() - 1 ? end + 1 : end)->val;
+			T v0 = key_value(start > 0 ? start - 1 : start);
+			T v1 = key_value(start);
+			T v2 = key_value(end);
+			T v3 = key_value(end < nkeys - 1 ? end + 1 : end);
 
 			return catmull_rom_spline(v0, v1, v2, v3, t);
 
 		} else {
-			return start->val;
+			return key_value(start);
 		}
 
 
 	default:
-		return start->val;
+		return key_value(start);
 	}
 }
 
@@ -0,0 +1,684 @@
+#include <string.h>
+#include <math.h>
+#include "animclip.h"
+#include "simd.h"
+#include "errlog.h"
+
+using namespace std;
+using namespace henge;
+
+static float *alloc_aligned(int count, float **mem);
+static void init_identity(float *data, int stride, int first, int last);
+static void lerp_channel(float *dest, const float *a, const float *b, float t, int count);
+static void nlerp_rot(float * const *dest, const float * const *a, const float * const *b, float t, int count);
+static void blend_kernel(float *dest, const float *a, const float *b, const float *w, int stride);
+static void add_kernel(float *dest, const float *base, const float *delta, const float *w, int stride);
+static void delta_kernel(float *dest, const float *pose, const float *ref, int stride);
+static void calc_weights(std::vector<float> *res, float t, const float *weights, int count, int stride);
+
+
+AnimPose::AnimPose(int num_nodes)
+{
+	this->num_nodes = stride = 0;
+	data = mem = 0;
+	resize(num_nodes);
+}
+
+AnimPose::AnimPose(const AnimPose &pose)
+{
+	num_nodes = stride = 0;
+	data = mem = 0;
+	*this = pose;
+}
+
+AnimPose &AnimPose::operator =(const AnimPose &pose)
+{
+	if(this != &pose) {
+		resize(pose.num_nodes);
+		if(stride) {
+			memcpy(data, pose.data, stride * POSE_NUM_CHANNELS * sizeof *data);
+		}
+	}
+	return *this;
+}
+
+AnimPose::~AnimPose()
+{
+	delete [] mem;
+}
+
+void AnimPose::resize(int num_nodes)
+{
+	int new_stride = (num_nodes + 3) & ~3;
+	if(new_stride != stride) {
+		delete [] mem;
+		data = new_stride ? alloc_aligned(new_stride * POSE_NUM_CHANNELS, &mem) : (mem = 0);
+		stride = new_stride;
+	}
+	this->num_nodes = num_nodes;
+	init_identity(data, stride, 0, stride);
+}
+
+int AnimPose::get_node_count() const
+{
+	return num_nodes;
+}
+
+int AnimPose::get_stride() const
+{
+	return stride;
+}
+
+float *AnimPose::get_channel(int chan)
+{
+	return data + chan * stride;
+}
+
+const float *AnimPose::get_channel(int chan) const
+{
+	return data + chan * stride;
+}
+
+void AnimPose::set_node(int idx, const Vector3 &pos, const Quaternion &rot, const Vector3 &scale)
+{
+	float *ptr = data + idx;
+	ptr[POSE_POS_X * stride] = pos.x;
+	ptr[POSE_POS_Y * stride] = pos.y;
+	ptr[POSE_POS_Z * stride] = pos.z;
+	ptr[POSE_ROT_X * stride] = rot.v.x;
+	ptr[POSE_ROT_Y * stride] = rot.v.y;
+	ptr[POSE_ROT_Z * stride] = rot.v.z;
+	ptr[POSE_ROT_W * stride] = rot.s;
+	ptr[POSE_SCALE_X * stride] = scale.x;
+	ptr[POSE_SCALE_Y * stride] = scale.y;
+	ptr[POSE_SCALE_Z * stride] = scale.z;
+}
+
+void AnimPose::get_node(int idx, Vector3 *pos, Quaternion *rot, Vector3 *scale) const
+{
+	const float *ptr = data + idx;
+	if(pos) {
+		*pos = Vector3(ptr[POSE_POS_X * stride], ptr[POSE_POS_Y * stride], ptr[POSE_POS_Z * stride]);
+	}
+	if(rot) {
+		*rot = Quaternion(ptr[POSE_ROT_W * stride], ptr[POSE_ROT_X * stride],
+				ptr[POSE_ROT_Y * stride], ptr[POSE_ROT_Z * stride]);
+	}
+	if(scale) {
+		*scale = Vector3(ptr[POSE_SCALE_X * stride], ptr[POSE_SCALE_Y * stride], ptr[POSE_SCALE_Z * stride]);
+	}
+}
+
+void AnimPose::apply(XFormNode * const *nodes, int count) const
+{
+	if(count > num_nodes) {
+		count = num_nodes;
+	}
+
+	for(int i=0; i<count; i++) {
+		Vector3 pos, scale;
+		Quaternion rot;
+		get_node(i, &pos, &rot, &scale);
+		nodes[i]->set_pose(pos, rot, scale);
+	}
+}
+
+void henge::blend_poses(AnimPose *dest, const AnimPose &a, const AnimPose &b, float t, const float *weights)
+{
+	int count = a.get_node_count();
+	if(b.get_node_count() != count) {
+		error("blend_poses: node count mismatch (%d, %d)\n", count, b.get_node_count());
+		return;
+	}
+	if(dest->get_node_count() != count) {
+		dest->resize(count);
+	}
+
+	vector<float> w;
+	calc_weights(&w, t, weights, count, a.get_stride());
+	blend_kernel(dest->get_channel(0), a.get_channel(0), b.get_channel(0), &w[0], a.get_stride());
+}
+
+void henge::calc_delta_pose(AnimPose *dest, const AnimPose &pose, const AnimPose &ref)
+{
+	int count = pose.get_node_count();
+	if(ref.get_node_count() != count) {
+		error("calc_delta_pose: node count mismatch (%d, %d)\n", count, ref.get_node_count());
+		return;
+	}
+	if(dest->get_node_count() != count) {
+		dest->resize(count);
+	}
+
+	delta_kernel(dest->get_channel(0), pose.get_channel(0), ref.get_channel(0), pose.get_stride());
+}
+
+void henge::add_pose(AnimPose *dest, const AnimPose &base, const AnimPose &delta, float weight, const float *weights)
+{
+	int count = base.get_node_count();
+	if(delta.get_node_count() != count) {
+		error("add_pose: node count mismatch (%d, %d)\n", count, delta.get_node_count());
+		return;
+	}
+	if(dest->get_node_count() != count) {
+		dest->resize(count);
+	}
+
+	vector<float> w;
+	calc_weights(&w, weight, weights, count, base.get_stride());
+	add_kernel(dest->get_channel(0), base.get_channel(0), delta.get_channel(0), &w[0], base.get_stride());
+}
+
+
+AnimClip::AnimClip()
+{
+	num_nodes = stride = 0;
+	num_frames = 0;
+	start_time = end_time = 0;
+	interval = 1;
+	frames = mem = 0;
+}
+
+AnimClip::~AnimClip()
+{
+	delete [] mem;
+}
+
+bool AnimClip::bake(XFormNode * const *nodes, int count, int start, int end, int interval)
+{
+	if(count <= 0 || interval <= 0 || end < start) {
+		error("AnimClip::bake: invalid arguments\n");
+		return false;
+	}
+
+	delete [] mem;
+
+	num_nodes = count;
+	stride = (count + 3) & ~3;
+	num_frames = (end - start + interval - 1) / interval + 1;
+	start_time = start;
+	end_time = end;
+	this->interval = interval;
+
+	int frame_size = stride * POSE_NUM_CHANNELS;
+	frames = alloc_aligned(frame_size * num_frames, &mem);
+
+	for(int i=0; i<num_frames; i++) {
+		float *frm = frames + i * frame_size;
+		int time = i < num_frames - 1 ? start + i * interval : end;
+
+		init_identity(frm, stride, count, stride);
+
+		for(int j=0; j<count; j++) {
+			Vector3 pos = nodes[j]->get_local_position(time);
+			Quaternion rot = nodes[j]->get_local_rotation(time);
+			Vector3 scale = nodes[j]->get_local_scaling(time);
+
+			/* keep consecutive rotations in the same hemisphere, so that
+			 * interpolating between frames always takes the short way.
+			 */
+			if(i > 0) {
+				const float *prev = frm - frame_size + j;
+				float dot = rot.v.x * prev[POSE_ROT_X * stride] + rot.v.y * prev[POSE_ROT_Y * stride] +
+					rot.v.z * prev[POSE_ROT_Z * stride] + rot.s * prev[POSE_ROT_W * stride];
+				if(dot < 0.0) {
+					rot = -rot;
+				}
+			}
+
+			float *ptr = frm + j;
+			ptr[POSE_POS_X * stride] = pos.x;
+			ptr[POSE_POS_Y * stride] = pos.y;
+			ptr[POSE_POS_Z * stride] = pos.z;
+			ptr[POSE_ROT_X * stride] = rot.v.x;
+			ptr[POSE_ROT_Y * stride] = rot.v.y;
+			ptr[POSE_ROT_Z * stride] = rot.v.z;
+			ptr[POSE_ROT_W * stride] = rot.s;
+			ptr[POSE_SCALE_X * stride] = scale.x;
+			ptr[POSE_SCALE_Y * stride] = scale.y;
+			ptr[POSE_SCALE_Z * stride] = scale.z;
+		}
+	}
+	return true;
+}
+
+bool AnimClip::make_additive(const AnimPose &ref)
+{
+	if(ref.get_node_count() != num_nodes) {
+		error("AnimClip::make_additive: node count mismatch (%d, %d)\n", num_nodes, ref.get_node_count());
+		return false;
+	}
+
+	int frame_size = stride * POSE_NUM_CHANNELS;
+	for(int i=0; i<num_frames; i++) {
+		float *frm = frames + i * frame_size;
+		delta_kernel(frm, frm, ref.get_channel(0), stride);
+
+		// the differences may have ended up in opposite hemispheres again
+		if(i > 0) {
+			float *prev = frm - frame_size;
+			for(int j=0; j<num_nodes; j++) {
+				float dot = 0.0;
+				for(int k=0; k<4; k++) {
+					dot += frm[(POSE_ROT_X + k) * stride + j] * prev[(POSE_ROT_X + k) * stride + j];
+				}
+				if(dot < 0.0) {
+					for(int k=0; k<4; k++) {
+						frm[(POSE_ROT_X + k) * stride + j] = -frm[(POSE_ROT_X + k) * stride + j];
+					}
+				}
+			}
+		}
+	}
+	return true;
+}
+
+int AnimClip::get_node_count() const
+{
+	return num_nodes;
+}
+
+int AnimClip::get_start_time() const
+{
+	return start_time;
+}
+
+int AnimClip::get_end_time() const
+{
+	return end_time;
+}
+
+void AnimClip::sample(int time, AnimPose *pose, bool loop) const
+{
+	if(!num_frames) return;
+
+	if(pose->get_node_count() < num_nodes) {
+		pose->resize(num_nodes);
+	}
+
+	int dur = end_time - start_time;
+	int t = time - start_time;
+	if(loop && dur > 0) {
+		t %= dur;
+		if(t < 0) {
+			t += dur;
+		}
+	} else {
+		t = t < 0 ? 0 : (t > dur ? dur : t);
+	}
+
+	int frm0 = t / interval;
+	int frm1 = frm0 < num_frames - 1 ? frm0 + 1 : frm0;
+
+	// the last interval may be shorter, see bake
+	int span = frm1 < num_frames - 1 ? interval : dur - frm0 * interval;
+	float tfrac = span > 0 ? (float)(t - frm0 * interval) / (float)span : 0.0f;
+
+	int frame_size = stride * POSE_NUM_CHANNELS;
+	const float *f0 = frames + frm0 * frame_size;
+	const float *f1 = frames + frm1 * frame_size;
+
+	// the pose may have more nodes, and a larger stride than the clip
+	int pstride = pose->get_stride();
+	float *dest = pose->get_channel(0);
+
+	for(int i=0; i<3; i++) {
+		lerp_channel(dest + (POSE_POS_X + i) * pstride, f0 + (POSE_POS_X + i) * stride,
+				f1 + (POSE_POS_X + i) * stride, tfrac, stride);
+		lerp_channel(dest + (POSE_SCALE_X + i) * pstride, f0 + (POSE_SCALE_X + i) * stride,
+				f1 + (POSE_SCALE_X + i) * stride, tfrac, stride);
+	}
+
+	float *rdest[4];
+	const float *ra[4], *rb[4];
+	for(int i=0; i<4; i++) {
+		rdest[i] = dest + (POSE_ROT_X + i) * pstride;
+		ra[i] = f0 + (POSE_ROT_X + i) * stride;
+		rb[i] = f1 + (POSE_ROT_X + i) * stride;
+	}
+	nlerp_rot(rdest, ra, rb, tfrac, stride);
+}
+
+
+AnimMixer::AnimMixer(int num_nodes)
+{
+	set_node_count(num_nodes);
+}
+
+void AnimMixer::set_node_count(int num_nodes)
+{
+	this->num_nodes = num_nodes;
+	pose.resize(num_nodes);
+	layer_pose.resize(num_nodes);
+	fade_pose.resize(num_nodes);
+
+	for(size_t i=0; i<layers.size(); i++) {
+		layers[i].mask.clear();
+	}
+}
+
+int AnimMixer::get_node_count() const
+{
+	return num_nodes;
+}
+
+int AnimMixer::add_layer(bool additive)
+{
+	Layer layer;
+	layer.additive = additive;
+	layer.weight = 1.0;
+	layer.clip = layer.prev_clip = 0;
+	layer.clip_start = layer.prev_start = 0;
+	layer.loop = layer.prev_loop = false;
+	layer.fade_start = layer.fade_dur = 0;
+
+	layers.push_back(layer);
+	return (int)layers.size() - 1;
+}
+
+int AnimMixer::get_layer_count() const
+{
+	return (int)layers.size();
+}
+
+void AnimMixer::set_layer_weight(int idx, float weight)
+{
+	layers[idx].weight = weight;
+}
+
+float AnimMixer::get_layer_weight(int idx) const
+{
+	return layers[idx].weight;
+}
+
+void AnimMixer::set_layer_mask(int idx, const float *weights)
+{
+	if(weights) {
+		layers[idx].mask.assign(weights, weights + num_nodes);
+	} else {
+		layers[idx].mask.clear();
+	}
+}
+
+void AnimMixer::play(int idx, const AnimClip *clip, int time, bool loop, int fade_dur)
+{
+	Layer *layer = &layers[idx];
+
+	if(fade_dur > 0 && layer->clip) {
+		layer->prev_clip = layer->clip;
+		layer->prev_start = layer->clip_start;
+		layer->prev_loop = layer->loop;
+		layer->fade_start = time;
+		layer->fade_dur = fade_dur;
+	} else {
+		layer->prev_clip = 0;
+	}
+
+	layer->clip = clip;
+	layer->clip_start = time;
+	layer->loop = loop;
+}
+
+/* evaluates a layer into res, and its weight, which drops while fading out
+ * to nothing. Returns false if the layer doesn't contribute anything.
+ */
+bool AnimMixer::eval_layer(const Layer &layer, int time, AnimPose *res, float *weight)
+{
+	*weight = layer.weight;
+
+	float fade = 1.0;
+	if(layer.prev_clip && time < layer.fade_start + layer.fade_dur) {
+		fade = (float)(time - layer.fade_start) / (float)layer.fade_dur;
+		if(fade < 0.0) fade = 0.0;
+	}
+
+	if(fade < 1.0) {
+		const AnimClip *prev = layer.prev_clip;
+		prev->sample(prev->get_start_time() + time - layer.prev_start, &fade_pose, layer.prev_loop);
+
+		if(!layer.clip) {
+			*res = fade_pose;
+			*weight *= 1.0 - fade;
+			return true;
+		}
+	}
+
+	if(!layer.clip) {
+		return false;
+	}
+
+	const AnimClip *clip = layer.clip;
+	clip->sample(clip->get_start_time() + time - layer.clip_start, res, layer.loop);
+
+	if(fade < 1.0) {
+		blend_poses(res, fade_pose, *res, fade);
+	}
+	return true;
+}
+
+void AnimMixer::update(int time)
+{
+	if(layers.empty()) return;
+
+	float weight;
+	if(!eval_layer(layers[0], time, &pose, &weight)) {
+		pose.resize(num_nodes);
+	}
+
+	for(size_t i=1; i<layers.size(); i++) {
+		const Layer &layer = layers[i];
+		if(!eval_layer(layer, time, &layer_pose, &weight) || weight <= 0.0) {
+			continue;
+		}
+
+		const float *mask = layer.mask.empty() ? 0 : &layer.mask[0];
+		if(layer.additive) {
+			add_pose(&pose, pose, layer_pose, weight, mask);
+		} else {
+			blend_poses(&pose, pose, layer_pose, weight, mask);
+		}
+	}
+}
+
+const AnimPose &AnimMixer::get_pose() const
+{
+	return pose;
+}
+
+void AnimMixer::apply(XFormNode * const *nodes, int count) const
+{
+	pose.apply(nodes, count);
+}
+
+
+// 16 byte aligned array of count floats, mem receives the pointer to delete
+static float *alloc_aligned(int count, float **mem)
+{
+	*mem = new float[count + 3];
+	return (float*)(((size_t)*mem + 15) & ~(size_t)15);
+}
+
+// sets nodes [first, last) to the identity transformation
+static void init_identity(float *data, int stride, int first, int last)
+{
+	for(int i=0; i<POSE_NUM_CHANNELS; i++) {
+		float val = (i == POSE_ROT_W || i >= POSE_SCALE_X) ? 1.0 : 0.0;
+		float *ptr = data + i * stride;
+		for(int j=first; j<last; j++) {
+			ptr[j] = val;
+		}
+	}
+}
+
+// normalizes 4 quaternions, given as 4 vectors of components
+static inline void v4_quat_normalize(v4f *q)
+{
+	v4f len_sq = v4_mul(q[0], q[0]);
+	for(int i=1; i<4; i++) {
+		len_sq = v4_add(len_sq, v4_mul(q[i], q[i]));
+	}
+	v4f inv_len = v4_rsqrt(len_sq);
+	for(int i=0; i<4; i++) {
+		q[i] = v4_mul(q[i], inv_len);
+	}
+}
+
+// quaternion product a * b, for 4 quaternions at a time (x, y, z, w)
+static inline void v4_quat_mul(v4f *res, const v4f *a, const v4f *b)
+{
+	res[0] = v4_sub(v4_add(v4_add(v4_mul(a[3], b[0]), v4_mul(a[0], b[3])), v4_mul(a[1], b[2])), v4_mul(a[2], b[1]));
+	res[1] = v4_add(v4_add(v4_sub(v4_mul(a[3], b[1]), v4_mul(a[0], b[2])), v4_mul(a[1], b[3])), v4_mul(a[2], b[0]));
+	res[2] = v4_add(v4_sub(v4_add(v4_mul(a[3], b[2]), v4_mul(a[0], b[1])), v4_mul(a[1], b[0])), v4_mul(a[2], b[3]));
+	res[3] = v4_sub(v4_sub(v4_sub(v4_mul(a[3], b[3]), v4_mul(a[0], b[0])), v4_mul(a[1], b[1])), v4_mul(a[2], b[2]));
+}
+
+// count must be a multiple of 4
+static void lerp_channel(float *dest, const float *a, const float *b, float t, int count)
+{
+	v4f vt = v4_set(t);
+	for(int i=0; i<count; i+=4) {
+		v4f va = v4_load(a + i);
+		v4_store(dest + i, v4_add(va, v4_mul(v4_sub(v4_load(b + i), va), vt)));
+	}
+}
+
+/* normalized lerp of quaternions given as 4 channels (x, y, z, w) each.
+ * Clip frames are baked in the same hemisphere, so there's no need to
+ * check for the shorter path here.
+ */
+static void nlerp_rot(float * const *dest, const float * const *a, const float * const *b, float t, int count)
+{
+	v4f vt = v4_set(t);
+	for(int i=0; i<count; i+=4) {
+		v4f q[4];
+		for(int j=0; j<4; j++) {
+			v4f va = v4_load(a[j] + i);
+			q[j] = v4_add(va, v4_mul(v4_sub(v4_load(b[j] + i), va), vt));
+		}
+		v4_quat_normalize(q);
+		for(int j=0; j<4; j++) {
+			v4_store(dest[j] + i, q[j]);
+		}
+	}
+}
+
+/* the following work on whole pose buffers (or clip frames) with the same
+ * stride, w holds a weight for each node, including the padding.
+ */
+
+// lerp/nlerp from a to b, taking the short way for rotations
+static void blend_kernel(float *dest, const float *a, const float *b, const float *w, int stride)
+{
+	for(int i=0; i<stride; i+=4) {
+		v4f vw = v4_loadu(w + i);
+
+		for(int j=0; j<3; j++) {
+			int pc = (POSE_POS_X + j) * stride + i;
+			int sc = (POSE_SCALE_X + j) * stride + i;
+			v4f pa = v4_load(a + pc), sa = v4_load(a + sc);
+			v4_store(dest + pc, v4_add(pa, v4_mul(v4_sub(v4_load(b + pc), pa), vw)));
+			v4_store(dest + sc, v4_add(sa, v4_mul(v4_sub(v4_load(b + sc), sa), vw)));
+		}
+
+		v4f qa[4], qb[4], dot = v4_set(0.0);
+		for(int j=0; j<4; j++) {
+			int rc = (POSE_ROT_X + j) * stride + i;
+			qa[j] = v4_load(a + rc);
+			qb[j] = v4_load(b + rc);
+			dot = v4_add(dot, v4_mul(qa[j], qb[j]));
+		}
+		v4f sign = v4_sign(dot);
+
+		v4f q[4];
+		for(int j=0; j<4; j++) {
+			q[j] = v4_add(qa[j], v4_mul(v4_sub(v4_mul(qb[j], sign), qa[j]), vw));
+		}
+		v4_quat_normalize(q);
+		for(int j=0; j<4; j++) {
+			v4_store(dest + (POSE_ROT_X + j) * stride + i, q[j]);
+		}
+	}
+}
+
+/* applies a fraction w of a delta pose (see delta_kernel) over base:
+ * positions are offset, scaling multiplied, and rotations pre-multiplied
+ * with the delta rotation, nlerped from the identity.
+ */
+static void add_kernel(float *dest, const float *base, const float *delta, const float *w, int stride)
+{
+	v4f one = v4_set(1.0);
+
+	for(int i=0; i<stride; i+=4) {
+		v4f vw = v4_loadu(w + i);
+
+		for(int j=0; j<3; j++) {
+			int pc = (POSE_POS_X + j) * stride + i;
+			int sc = (POSE_SCALE_X + j) * stride + i;
+			v4f ds = v4_add(one, v4_mul(v4_sub(v4_load(delta + sc), one), vw));
+			v4_store(dest + pc, v4_add(v4_load(base + pc), v4_mul(v4_load(delta + pc), vw)));
+			v4_store(dest + sc, v4_mul(v4_load(base + sc), ds));
+		}
+
+		v4f qd[4], qb[4];
+		for(int j=0; j<4; j++) {
+			int rc = (POSE_ROT_X + j) * stride + i;
+			qd[j] = v4_load(delta + rc);
+			qb[j] = v4_load(base + rc);
+		}
+
+		// nlerp from the identity, through the short way
+		v4f sign = v4_sign(qd[3]);
+		for(int j=0; j<3; j++) {
+			qd[j] = v4_mul(v4_mul(qd[j], sign), vw);
+		}
+		qd[3] = v4_add(one, v4_mul(v4_sub(v4_mul(qd[3], sign), one), vw));
+		v4_quat_normalize(qd);
+
+		v4f q[4];
+		v4_quat_mul(q, qd, qb);
+		v4_quat_normalize(q);
+		for(int j=0; j<4; j++) {
+			v4_store(dest + (POSE_ROT_X + j) * stride + i, q[j]);
+		}
+	}
+}
+
+// difference of pose from ref, such that adding it to ref gives pose
+static void delta_kernel(float *dest, const float *pose, const float *ref, int stride)
+{
+	for(int i=0; i<stride; i+=4) {
+		for(int j=0; j<3; j++) {
+			int pc = (POSE_POS_X + j) * stride + i;
+			int sc = (POSE_SCALE_X + j) * stride + i;
+			v4_store(dest + pc, v4_sub(v4_load(pose + pc), v4_load(ref + pc)));
+			v4_store(dest + sc, v4_div(v4_load(pose + sc), v4_nonzero(v4_load(ref + sc))));
+		}
+
+		// pose * conjugate(ref)
+		v4f qp[4], qr[4];
+		for(int j=0; j<4; j++) {
+			int rc = (POSE_ROT_X + j) * stride + i;
+			qp[j] = v4_load(pose + rc);
+			qr[j] = v4_load(ref + rc);
+		}
+		v4f neg = v4_set(-1.0);
+		for(int j=0; j<3; j++) {
+			qr[j] = v4_mul(qr[j], neg);
+		}
+
+		v4f q[4];
+		v4_quat_mul(q, qp, qr);
+		for(int j=0; j<4; j++) {
+			v4_store(dest + (POSE_ROT_X + j) * stride + i, q[j]);
+		}
+	}
+}
+
+// per-node weights for the kernels: t times the node weights if any
+static void calc_weights(std::vector<float> *res, float t, const float *weights, int count, int stride)
+{
+	res->resize(stride);
+	for(int i=0; i<stride; i++) {
+		(*res)[i] = i < count ? (weights ? t * weights[i] : t) : 0.0;
+	}
+}
@@ -0,0 +1,168 @@
+#ifndef HENGE_ANIMCLIP_H_
+#define HENGE_ANIMCLIP_H_
+
+#include <vector>
+#include "anim.h"
+
+namespace henge {
+
+// channels of pose buffers and animation clips
+enum {
+	POSE_POS_X, POSE_POS_Y, POSE_POS_Z,
+	POSE_ROT_X, POSE_ROT_Y, POSE_ROT_Z, POSE_ROT_W,
+	POSE_SCALE_X, POSE_SCALE_Y, POSE_SCALE_Z,
+
+	POSE_NUM_CHANNELS
+};
+
+/* local transformations of a number of nodes, in structure of arrays
+ * layout: each channel is a separate, 16 byte aligned array of floats,
+ * padded to a multiple of 4 nodes, so that they can be processed 4 nodes
+ * at a time with SIMD instructions.
+ */
+class AnimPose {
+private:
+	int num_nodes, stride;
+	float *data, *mem;
+
+public:
+	AnimPose(int num_nodes = 0);
+	AnimPose(const AnimPose &pose);
+	AnimPose &operator =(const AnimPose &pose);
+	~AnimPose();
+
+	// resets all nodes to the identity transformation
+	void resize(int num_nodes);
+
+	int get_node_count() const;
+	int get_stride() const;		// number of floats per channel
+
+	float *get_channel(int chan);
+	const float *get_channel(int chan) const;
+
+	void set_node(int idx, const Vector3 &pos, const Quaternion &rot, const Vector3 &scale);
+	void get_node(int idx, Vector3 *pos, Quaternion *rot, Vector3 *scale) const;
+
+	// sets the pose of each of count nodes (see XFormNode::set_pose)
+	void apply(XFormNode * const *nodes, int count) const;
+};
+
+/* operations on whole pose buffers, which must have the same number of
+ * nodes. dest is resized as needed, and may be one of the inputs. The
+ * weights, if not null, are per-node factors for t or weight, like masks
+ * restricting an operation to some of the nodes.
+ */
+
+// interpolates from a to b (nlerp for rotations)
+void blend_poses(AnimPose *dest, const AnimPose &a, const AnimPose &b, float t, const float *weights = 0);
+
+/* calculates the difference of pose from a reference pose, which gives back
+ * pose when added to the reference with add_pose.
+ */
+void calc_delta_pose(AnimPose *dest, const AnimPose &pose, const AnimPose &ref);
+
+// adds a fraction of a difference pose over base
+void add_pose(AnimPose *dest, const AnimPose &base, const AnimPose &delta, float weight, const float *weights = 0);
+
+/* animation of a set of nodes baked from their keyframe tracks into
+ * samples at a fixed rate, stored frame by frame in the layout of AnimPose.
+ * Sampling a clip interpolates between two frames for all nodes in a
+ * single sweep (linearly, and with normalized lerp for the rotations),
+ * instead of looking up three tracks per node. Clips are read-only once
+ * baked, and can be shared by any number of node hierarchies.
+ */
+class AnimClip {
+private:
+	int num_nodes, stride;
+	int num_frames;
+	int start_time, end_time, interval;
+	float *frames, *mem;
+
+	AnimClip(const AnimClip &clip);				// not implemented
+	AnimClip &operator =(const AnimClip &clip);	// not implemented
+
+public:
+	AnimClip();
+	~AnimClip();
+
+	/* samples the local transformations of count nodes every interval time
+	 * units from start, and at end, in the same time units as the tracks.
+	 * If end isn't a whole number of intervals from start, the last frame
+	 * is closer to the one before it.
+	 */
+	bool bake(XFormNode * const *nodes, int count, int start, int end, int interval);
+
+	/* turns every frame into its difference from a reference pose (see
+	 * calc_delta_pose), for use in additive layers.
+	 */
+	bool make_additive(const AnimPose &ref);
+
+	int get_node_count() const;
+	int get_start_time() const;
+	int get_end_time() const;
+
+	/* samples all nodes of the clip at the given time, into a pose with at
+	 * least as many nodes. Times outside the clip are clamped to its range,
+	 * or wrapped around it if loop is true.
+	 */
+	void sample(int time, AnimPose *pose, bool loop = false) const;
+};
+
+/* layered playback of animation clips over a node hierarchy. Each layer
+ * plays one clip at a time, and crossfades to the next one when told to.
+ * The first layer is the base pose; each of the rest either blends over
+ * the result of the layers below it, or, if additive, adds to it a clip
+ * made with AnimClip::make_additive. Layers above the base have a weight,
+ * and optionally per-node weights (masks). All the clips must have been
+ * baked from the same nodes, in the same order.
+ */
+class AnimMixer {
+private:
+	struct Layer {
+		bool additive;
+		float weight;
+		std::vector<float> mask;
+
+		const AnimClip *clip, *prev_clip;
+		int clip_start, prev_start;
+		bool loop, prev_loop;
+		int fade_start, fade_dur;
+	};
+	std::vector<Layer> layers;
+
+	int num_nodes;
+	AnimPose pose, layer_pose, fade_pose;
+
+	bool eval_layer(const Layer &layer, int time, AnimPose *res, float *weight);
+
+public:
+	AnimMixer(int num_nodes = 0);
+
+	void set_node_count(int num_nodes);
+	int get_node_count() const;
+
+	// returns the index of the new layer
+	int add_layer(bool additive = false);
+	int get_layer_count() const;
+
+	void set_layer_weight(int idx, float weight);
+	float get_layer_weight(int idx) const;
+
+	// one weight per node, or null to clear the mask
+	void set_layer_mask(int idx, const float *weights);
+
+	/* starts playing a clip on a layer at the given time, crossfading from
+	 * the previous one over fade_dur. A null clip fades the layer out.
+	 */
+	void play(int idx, const AnimClip *clip, int time, bool loop = true, int fade_dur = 0);
+
+	// evaluates all the layers at the given time
+	void update(int time);
+
+	const AnimPose &get_pose() const;
+	void apply(XFormNode * const *nodes, int count) const;
+};
+
+}	// namespace henge
+
+#endif	// HENGE_ANIMCLIP_H_
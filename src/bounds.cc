@@ -1,7 +1,12 @@
+#include <string.h>
 #include "bounds.h"
+#include "simd.h"
 
 using namespace henge;
 
+static void load_batch(const float * const *arrays, int num_arrays, int idx, int count, float (*tail)[4], const float **src);
+static int count_bits(int mask);
+
 BVolume::~BVolume() {}
 
 BSphere::BSphere()
@@ -109,3 +114,174 @@ bool AABox::intersect(const Ray &ray) const
 
 	return (tmin < t1) && (tmax > t0);
 }
+
+
+Frustum::Frustum() {}
+
+Frustum::Frustum(const Matrix4x4 &mat)
+{
+	set_matrix(mat);
+}
+
+/* plane extraction from the combined matrix, see:
+ * "Fast Extraction of Viewing Frustum Planes from the World-View-Projection
+ * Matrix", Gil Gribb and Klaus Hartmann, 2001
+ */
+void Frustum::set_matrix(const Matrix4x4 &mat)
+{
+	for(int i=0; i<3; i++) {
+		for(int j=0; j<2; j++) {
+			float sign = j ? -1.0 : 1.0;
+			Vector4 *p = plane + i * 2 + j;
+
+			p->x = mat[3][0] + sign * mat[i][0];
+			p->y = mat[3][1] + sign * mat[i][1];
+			p->z = mat[3][2] + sign * mat[i][2];
+			p->w = mat[3][3] + sign * mat[i][3];
+
+			float len = sqrt(p->x * p->x + p->y * p->y + p->z * p->z);
+			if(len > SMALL_NUMBER) {
+				*p *= 1.0 / len;
+			}
+		}
+	}
+}
+
+bool Frustum::intersect(const BSphere &sph) const
+{
+	for(int i=0; i<6; i++) {
+		const Vector4 &p = plane[i];
+		float dist = p.x * sph.center.x + p.y * sph.center.y + p.z * sph.center.z + p.w;
+		if(dist < -sph.radius) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Frustum::intersect(const AABox &box) const
+{
+	for(int i=0; i<6; i++) {
+		const Vector4 &p = plane[i];
+
+		// corner of the box furthest along the plane normal
+		float x = p.x >= 0.0 ? box.max.x : box.min.x;
+		float y = p.y >= 0.0 ? box.max.y : box.min.y;
+		float z = p.z >= 0.0 ? box.max.z : box.min.z;
+
+		if(p.x * x + p.y * y + p.z * z + p.w < 0.0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int Frustum::cull_spheres(const float * const *sph, int count, uint32_t *vis) const
+{
+	v4f pa[6], pb[6], pc[6], pd[6];
+	for(int i=0; i<6; i++) {
+		pa[i] = v4_set(plane[i].x);
+		pb[i] = v4_set(plane[i].y);
+		pc[i] = v4_set(plane[i].z);
+		pd[i] = v4_set(plane[i].w);
+	}
+	v4f zero = v4_set(0.0);
+
+	memset(vis, 0, (count + 31) / 32 * sizeof *vis);
+	int num_vis = 0;
+
+	for(int i=0; i<count; i+=4) {
+		float tail[4][4];
+		const float *src[4];
+		load_batch(sph, 4, i, count, tail, src);
+
+		v4f x = v4_loadu(src[0]);
+		v4f y = v4_loadu(src[1]);
+		v4f z = v4_loadu(src[2]);
+		v4f neg_rad = v4_sub(zero, v4_loadu(src[3]));
+
+		// outside if the center is further than the radius behind any plane
+		int out = 0;
+		for(int j=0; j<6; j++) {
+			v4f dist = v4_add(v4_add(v4_mul(pa[j], x), v4_mul(pb[j], y)),
+					v4_add(v4_mul(pc[j], z), pd[j]));
+			out |= v4_lt_mask(dist, neg_rad);
+		}
+
+		int in = ~out & (count - i < 4 ? (1 << (count - i)) - 1 : 0xf);
+		vis[i / 32] |= (uint32_t)in << (i % 32);
+		num_vis += count_bits(in);
+	}
+	return num_vis;
+}
+
+int Frustum::cull_boxes(const float * const *box, int count, uint32_t *vis) const
+{
+	/* for each plane, the corner of a box furthest along its normal has the
+	 * max coordinates where the normal is positive, and the min elsewhere,
+	 * which is the same for all the boxes.
+	 */
+	v4f pa[6], pb[6], pc[6], pd[6];
+	int sel[6][3];
+	for(int i=0; i<6; i++) {
+		pa[i] = v4_set(plane[i].x);
+		pb[i] = v4_set(plane[i].y);
+		pc[i] = v4_set(plane[i].z);
+		pd[i] = v4_set(plane[i].w);
+
+		sel[i][0] = plane[i].x >= 0.0 ? 3 : 0;
+		sel[i][1] = plane[i].y >= 0.0 ? 4 : 1;
+		sel[i][2] = plane[i].z >= 0.0 ? 5 : 2;
+	}
+	v4f zero = v4_set(0.0);
+
+	memset(vis, 0, (count + 31) / 32 * sizeof *vis);
+	int num_vis = 0;
+
+	for(int i=0; i<count; i+=4) {
+		float tail[6][4];
+		const float *src[6];
+		load_batch(box, 6, i, count, tail, src);
+
+		v4f bv[6];
+		for(int j=0; j<6; j++) {
+			bv[j] = v4_loadu(src[j]);
+		}
+
+		int out = 0;
+		for(int j=0; j<6; j++) {
+			v4f dist = v4_add(v4_add(v4_mul(pa[j], bv[sel[j][0]]), v4_mul(pb[j], bv[sel[j][1]])),
+					v4_add(v4_mul(pc[j], bv[sel[j][2]]), pd[j]));
+			out |= v4_lt_mask(dist, zero);
+		}
+
+		int in = ~out & (count - i < 4 ? (1 << (count - i)) - 1 : 0xf);
+		vis[i / 32] |= (uint32_t)in << (i % 32);
+		num_vis += count_bits(in);
+	}
+	return num_vis;
+}
+
+/* sets src to the 4 elements starting at idx of each array, or if there are
+ * fewer than 4 left, to copies of them in tail, padded with zeros.
+ */
+static void load_batch(const float * const *arrays, int num_arrays, int idx, int count, float (*tail)[4], const float **src)
+{
+	int left = count - idx;
+	for(int i=0; i<num_arrays; i++) {
+		if(left >= 4) {
+			src[i] = arrays[i] + idx;
+		} else {
+			for(int j=0; j<4; j++) {
+				tail[i][j] = j < left ? arrays[i][idx + j] : 0.0;
+			}
+			src[i] = tail[i];
+		}
+	}
+}
+
+static int count_bits(int mask)
+{
+	static const int nbits[] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+	return nbits[mask & 0xf];
+}
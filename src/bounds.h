@@ -2,6 +2,7 @@
 #define HENGE_AABB_H_
 
 #include "vmath.h"
+#include "int_types.h"
 
 namespace henge {
 
@@ -38,6 +39,33 @@ public:
 	virtual bool intersect(const Ray &ray) const;
 };
 
+/* view frustum, as the 6 planes (a, b, c, d) bounding the volume which is
+ * mapped to the clip space cube by a projection * modelview matrix, with the
+ * normals pointing inwards.
+ */
+class Frustum {
+public:
+	Vector4 plane[6];
+
+	Frustum();
+	Frustum(const Matrix4x4 &mat);
+
+	void set_matrix(const Matrix4x4 &mat);
+
+	// conservative tests, false only if the volume is entirely outside
+	bool intersect(const BSphere &sph) const;
+	bool intersect(const AABox &box) const;
+
+	/* batch tests of count spheres or boxes, given as separate arrays for
+	 * each coordinate: x, y, z and radius for spheres, min x, y, z and max
+	 * x, y, z for boxes. Bit i % 32 of vis[i / 32] is set if item i may be
+	 * in the frustum, and the number of those is returned. The items are
+	 * tested 4 at a time with SIMD instructions, where available.
+	 */
+	int cull_spheres(const float * const *sph, int count, uint32_t *vis) const;
+	int cull_boxes(const float * const *box, int count, uint32_t *vis) const;
+};
+
 }	// namespace henge
 
 #endif	// HENGE_AABB_H_
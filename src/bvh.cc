@@ -0,0 +1,799 @@
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include "bvh.h"
+#include "errlog.h"
+
+using namespace std;
+using namespace henge;
+
+#define DEF_MARGIN	0.1
+// maximum number of triangles in the leaves of mesh hierarchies
+#define TRI_LEAF_SIZE	4
+
+// traversal stack entry, with the distance the ray enters the node
+struct StackEntry {
+	int node;
+	float t;
+};
+
+// orders triangles by their centroids along an axis
+struct CentroidCmp {
+	const Vector3 *cent;
+	int axis;
+
+	bool operator ()(int a, int b) const
+	{
+		return cent[a][axis] < cent[b][axis];
+	}
+};
+
+static void box_union(AABox *res, const AABox &a, const AABox &b);
+static float box_area(const AABox &box);
+static bool box_contains(const AABox &outer, const AABox &inner);
+static bool box_overlap(const AABox &a, const AABox &b);
+static bool box_equal(const AABox &a, const AABox &b);
+static Vector3 calc_inv_dir(const Vector3 &dir);
+static bool ray_box(const Ray &ray, const Vector3 &inv_dir, const AABox &box, float tmax, float *tnear);
+static void push_children(vector<StackEntry> *stack, const Ray &ray, const Vector3 &inv_dir,
+		const AABox &box0, int idx0, const AABox &box1, int idx1, float tmax);
+
+AABBTree::AABBTree()
+{
+	root = free_list = -1;
+	num_leaves = 0;
+	margin = DEF_MARGIN;
+}
+
+void AABBTree::clear()
+{
+	nodes.clear();
+	root = free_list = -1;
+	num_leaves = 0;
+}
+
+void AABBTree::set_margin(float margin)
+{
+	this->margin = margin;
+}
+
+float AABBTree::get_margin() const
+{
+	return margin;
+}
+
+int AABBTree::alloc_node()
+{
+	int idx;
+	if(free_list != -1) {
+		idx = free_list;
+		free_list = nodes[idx].parent;
+	} else {
+		idx = (int)nodes.size();
+		nodes.push_back(Node());
+	}
+
+	Node *node = &nodes[idx];
+	node->data = 0;
+	node->parent = -1;
+	node->child[0] = node->child[1] = -1;
+	node->height = 0;
+	return idx;
+}
+
+void AABBTree::free_node(int idx)
+{
+	nodes[idx].parent = free_list;
+	nodes[idx].height = -1;
+	free_list = idx;
+}
+
+int AABBTree::insert(const AABox &box, void *data)
+{
+	int leaf = alloc_node();
+	Node *node = &nodes[leaf];
+	node->data = data;
+	node->box = box;
+
+	Vector3 ext = (box.max - box.min) * margin;
+	node->fat.min = box.min - ext;
+	node->fat.max = box.max + ext;
+
+	insert_leaf(leaf);
+	num_leaves++;
+	return leaf;
+}
+
+void AABBTree::remove(int proxy)
+{
+	remove_leaf(proxy);
+	free_node(proxy);
+	num_leaves--;
+}
+
+bool AABBTree::move(int proxy, const AABox &box)
+{
+	if(box_contains(nodes[proxy].fat, box)) {
+		nodes[proxy].box = box;
+		refit_boxes(nodes[proxy].parent);
+		return false;
+	}
+
+	remove_leaf(proxy);
+
+	nodes[proxy].box = box;
+	Vector3 ext = (box.max - box.min) * margin;
+	nodes[proxy].fat.min = box.min - ext;
+	nodes[proxy].fat.max = box.max + ext;
+
+	insert_leaf(proxy);
+	return true;
+}
+
+void *AABBTree::get_data(int proxy) const
+{
+	return nodes[proxy].data;
+}
+
+const AABox &AABBTree::get_fat_box(int proxy) const
+{
+	return nodes[proxy].fat;
+}
+
+int AABBTree::get_count() const
+{
+	return num_leaves;
+}
+
+int AABBTree::get_height() const
+{
+	return root == -1 ? 0 : nodes[root].height;
+}
+
+bool AABBTree::get_bounds(AABox *box) const
+{
+	if(root == -1) {
+		return false;
+	}
+	*box = nodes[root].box;
+	return true;
+}
+
+/* descends from the root towards the sibling which would increase the total
+ * area of the tree the least, stopping early when the cost of going further
+ * down exceeds the cost of pairing with the current node.
+ */
+void AABBTree::insert_leaf(int leaf)
+{
+	if(root == -1) {
+		root = leaf;
+		nodes[leaf].parent = -1;
+		return;
+	}
+
+	AABox fat = nodes[leaf].fat;
+	int idx = root;
+
+	while(nodes[idx].height > 0) {
+		const Node &node = nodes[idx];
+
+		AABox comb;
+		box_union(&comb, node.fat, fat);
+		float area = box_area(node.fat);
+		float comb_area = box_area(comb);
+
+		// cost of a new parent for this node and the leaf
+		float cost = 2.0 * comb_area;
+		// minimum cost of pushing the leaf further down
+		float inherit = 2.0 * (comb_area - area);
+
+		float child_cost[2];
+		for(int i=0; i<2; i++) {
+			const Node &child = nodes[node.child[i]];
+			box_union(&comb, child.fat, fat);
+			child_cost[i] = box_area(comb) + inherit;
+			if(child.height > 0) {
+				child_cost[i] -= box_area(child.fat);
+			}
+		}
+
+		if(cost < child_cost[0] && cost < child_cost[1]) {
+			break;
+		}
+		idx = child_cost[0] < child_cost[1] ? node.child[0] : node.child[1];
+	}
+
+	int sibling = idx;
+	int old_parent = nodes[sibling].parent;
+	int new_parent = alloc_node();
+
+	Node *pnode = &nodes[new_parent];
+	pnode->parent = old_parent;
+	pnode->child[0] = sibling;
+	pnode->child[1] = leaf;
+	pnode->height = nodes[sibling].height + 1;
+	box_union(&pnode->fat, nodes[sibling].fat, fat);
+	box_union(&pnode->box, nodes[sibling].box, nodes[leaf].box);
+
+	if(old_parent != -1) {
+		Node *opnode = &nodes[old_parent];
+		opnode->child[opnode->child[0] == sibling ? 0 : 1] = new_parent;
+	} else {
+		root = new_parent;
+	}
+	nodes[sibling].parent = new_parent;
+	nodes[leaf].parent = new_parent;
+
+	refit_up(new_parent);
+}
+
+// the sibling of the leaf takes the place of their parent
+void AABBTree::remove_leaf(int leaf)
+{
+	if(leaf == root) {
+		root = -1;
+		return;
+	}
+
+	int parent = nodes[leaf].parent;
+	int grandparent = nodes[parent].parent;
+	int sibling = nodes[parent].child[nodes[parent].child[0] == leaf ? 1 : 0];
+
+	if(grandparent != -1) {
+		Node *gpnode = &nodes[grandparent];
+		gpnode->child[gpnode->child[0] == parent ? 0 : 1] = sibling;
+		nodes[sibling].parent = grandparent;
+		free_node(parent);
+
+		refit_up(grandparent);
+	} else {
+		root = sibling;
+		nodes[sibling].parent = -1;
+		free_node(parent);
+	}
+}
+
+// rebalances and recomputes the boxes and heights from a node up to the root
+void AABBTree::refit_up(int idx)
+{
+	while(idx != -1) {
+		idx = balance(idx);
+
+		Node *node = &nodes[idx];
+		const Node &c0 = nodes[node->child[0]];
+		const Node &c1 = nodes[node->child[1]];
+
+		node->height = 1 + MAX(c0.height, c1.height);
+		box_union(&node->fat, c0.fat, c1.fat);
+		box_union(&node->box, c0.box, c1.box);
+
+		idx = node->parent;
+	}
+}
+
+// recomputes the exact boxes from a node up to the root
+void AABBTree::refit_boxes(int idx)
+{
+	while(idx != -1) {
+		Node *node = &nodes[idx];
+		box_union(&node->box, nodes[node->child[0]].box, nodes[node->child[1]].box);
+		idx = node->parent;
+	}
+}
+
+// rotates the taller child up, if the heights of the children differ by >1
+int AABBTree::balance(int idx)
+{
+	const Node &node = nodes[idx];
+	if(node.height < 2) {
+		return idx;
+	}
+
+	int diff = nodes[node.child[1]].height - nodes[node.child[0]].height;
+	if(diff > 1) {
+		return rotate(idx, 1);
+	}
+	if(diff < -1) {
+		return rotate(idx, 0);
+	}
+	return idx;
+}
+
+/* the child in the given slot takes the place of the node, which becomes
+ * its child, and gets the shorter of its children in exchange. Returns the
+ * index of the node now at the top.
+ */
+int AABBTree::rotate(int idx, int slot)
+{
+	Node *a = &nodes[idx];
+	int up_idx = a->child[slot];
+	int other_idx = a->child[1 - slot];
+	Node *up = &nodes[up_idx];
+
+	int f = up->child[0];
+	int g = up->child[1];
+
+	up->child[0] = idx;
+	up->parent = a->parent;
+	a->parent = up_idx;
+
+	if(up->parent != -1) {
+		Node *pnode = &nodes[up->parent];
+		pnode->child[pnode->child[0] == idx ? 0 : 1] = up_idx;
+	} else {
+		root = up_idx;
+	}
+
+	int keep = f, give = g;
+	if(nodes[f].height < nodes[g].height) {
+		keep = g;
+		give = f;
+	}
+
+	up->child[1] = keep;
+	a->child[slot] = give;
+	nodes[give].parent = idx;
+
+	const Node &other = nodes[other_idx];
+	box_union(&a->fat, other.fat, nodes[give].fat);
+	box_union(&a->box, other.box, nodes[give].box);
+	a->height = 1 + MAX(other.height, nodes[give].height);
+
+	box_union(&up->fat, a->fat, nodes[keep].fat);
+	box_union(&up->box, a->box, nodes[keep].box);
+	up->height = 1 + MAX(a->height, nodes[keep].height);
+
+	return up_idx;
+}
+
+void AABBTree::collect(int idx, vector<void*> *res) const
+{
+	const Node &node = nodes[idx];
+	if(node.height == 0) {
+		res->push_back(node.data);
+		return;
+	}
+	collect(node.child[0], res);
+	collect(node.child[1], res);
+}
+
+/* each node is only tested against the planes it isn't entirely inside of.
+ * Once it's inside all of them, the whole subtree is in view.
+ */
+void AABBTree::query(const Frustum &frust, vector<void*> *res) const
+{
+	if(root == -1) return;
+
+	// pairs of node index and mask of planes left to test
+	vector<int> stack;
+	stack.push_back(root);
+	stack.push_back(0x3f);
+
+	while(!stack.empty()) {
+		int mask = stack.back();
+		stack.pop_back();
+		int idx = stack.back();
+		stack.pop_back();
+
+		const Node &node = nodes[idx];
+		const AABox &box = node.box;
+
+		bool outside = false;
+		for(int i=0; i<6; i++) {
+			if(!(mask & (1 << i))) continue;
+			const Vector4 &p = frust.plane[i];
+
+			// corners furthest along the plane normal and against it
+			float fx = p.x >= 0.0 ? box.max.x : box.min.x;
+			float fy = p.y >= 0.0 ? box.max.y : box.min.y;
+			float fz = p.z >= 0.0 ? box.max.z : box.min.z;
+			if(p.x * fx + p.y * fy + p.z * fz + p.w < 0.0) {
+				outside = true;
+				break;
+			}
+
+			float nx = p.x >= 0.0 ? box.min.x : box.max.x;
+			float ny = p.y >= 0.0 ? box.min.y : box.max.y;
+			float nz = p.z >= 0.0 ? box.min.z : box.max.z;
+			if(p.x * nx + p.y * ny + p.z * nz + p.w >= 0.0) {
+				mask &= ~(1 << i);
+			}
+		}
+		if(outside) continue;
+
+		if(!mask || node.height == 0) {
+			collect(idx, res);
+			continue;
+		}
+
+		for(int i=0; i<2; i++) {
+			stack.push_back(node.child[i]);
+			stack.push_back(mask);
+		}
+	}
+}
+
+void AABBTree::query(const AABox &box, vector<void*> *res) const
+{
+	if(root == -1) return;
+
+	vector<int> stack;
+	stack.push_back(root);
+
+	while(!stack.empty()) {
+		int idx = stack.back();
+		stack.pop_back();
+
+		const Node &node = nodes[idx];
+		if(!box_overlap(node.box, box)) {
+			continue;
+		}
+
+		if(node.height == 0) {
+			res->push_back(node.data);
+		} else {
+			stack.push_back(node.child[0]);
+			stack.push_back(node.child[1]);
+		}
+	}
+}
+
+void AABBTree::raycast(const Ray &ray, RayQueryFunc func, void *cls) const
+{
+	if(root == -1) return;
+
+	Vector3 inv_dir = calc_inv_dir(ray.dir);
+	float tmax = 1.0;
+
+	vector<StackEntry> stack;
+	StackEntry top;
+	if(!ray_box(ray, inv_dir, nodes[root].box, tmax, &top.t)) {
+		return;
+	}
+	top.node = root;
+	stack.push_back(top);
+
+	while(!stack.empty()) {
+		StackEntry ent = stack.back();
+		stack.pop_back();
+		if(ent.t > tmax) continue;
+
+		const Node &node = nodes[ent.node];
+		if(node.height == 0) {
+			tmax = func(node.data, ray, tmax, cls);
+			continue;
+		}
+
+		const Node &c0 = nodes[node.child[0]];
+		const Node &c1 = nodes[node.child[1]];
+		push_children(&stack, ray, inv_dir, c0.box, node.child[0], c1.box, node.child[1], tmax);
+	}
+}
+
+bool AABBTree::validate() const
+{
+	int num_nodes = 0, num_found = 0;
+	if(root != -1) {
+		if(!validate_node(root, -1, &num_nodes, &num_found)) {
+			return false;
+		}
+	}
+	if(num_found != num_leaves) {
+		error("AABBTree: %d leaves in the tree, %d counted\n", num_found, num_leaves);
+		return false;
+	}
+
+	int num_free = 0;
+	for(int idx = free_list; idx != -1; idx = nodes[idx].parent) {
+		if(idx < 0 || idx >= (int)nodes.size() || nodes[idx].height != -1) {
+			error("AABBTree: bad node %d in the free list\n", idx);
+			return false;
+		}
+		if(++num_free > (int)nodes.size()) {
+			error("AABBTree: loop in the free list\n");
+			return false;
+		}
+	}
+	if(num_nodes + num_free != (int)nodes.size()) {
+		error("AABBTree: %d nodes in the tree and %d free, out of %d\n", num_nodes, num_free,
+				(int)nodes.size());
+		return false;
+	}
+	return true;
+}
+
+bool AABBTree::validate_node(int idx, int parent, int *num_nodes, int *num_found) const
+{
+	if(idx < 0 || idx >= (int)nodes.size()) {
+		error("AABBTree: child %d of node %d out of range\n", idx, parent);
+		return false;
+	}
+	if(++*num_nodes > (int)nodes.size()) {
+		error("AABBTree: loop through node %d\n", idx);
+		return false;
+	}
+
+	const Node &node = nodes[idx];
+	if(node.parent != parent) {
+		error("AABBTree: node %d has parent %d instead of %d\n", idx, node.parent, parent);
+		return false;
+	}
+	if(node.height < 0) {
+		error("AABBTree: free node %d in the tree\n", idx);
+		return false;
+	}
+
+	if(node.height == 0) {
+		if(node.child[0] != -1 || node.child[1] != -1) {
+			error("AABBTree: leaf %d has children\n", idx);
+			return false;
+		}
+		if(!box_contains(node.fat, node.box)) {
+			error("AABBTree: box of leaf %d outside its enlarged box\n", idx);
+			return false;
+		}
+		++*num_found;
+		return true;
+	}
+
+	for(int i=0; i<2; i++) {
+		if(!validate_node(node.child[i], idx, num_nodes, num_found)) {
+			return false;
+		}
+	}
+
+	const Node &c0 = nodes[node.child[0]];
+	const Node &c1 = nodes[node.child[1]];
+	if(node.height != 1 + MAX(c0.height, c1.height)) {
+		error("AABBTree: node %d has height %d, children %d and %d\n", idx, node.height,
+				c0.height, c1.height);
+		return false;
+	}
+
+	AABox fat, box;
+	box_union(&fat, c0.fat, c1.fat);
+	box_union(&box, c0.box, c1.box);
+	if(!box_equal(node.fat, fat) || !box_equal(node.box, box)) {
+		error("AABBTree: boxes of node %d don't match its children\n", idx);
+		return false;
+	}
+	return true;
+}
+
+
+void TriBVH::build(const Vector3 *vert, const unsigned int *index, int num_tris)
+{
+	clear();
+	if(num_tris <= 0) return;
+
+	vector<Tri> src(num_tris);
+	vector<Vector3> cent(num_tris);
+	vector<int> order(num_tris);
+
+	for(int i=0; i<num_tris; i++) {
+		const Vector3 &v0 = vert[index ? index[i * 3] : i * 3];
+		const Vector3 &v1 = vert[index ? index[i * 3 + 1] : i * 3 + 1];
+		const Vector3 &v2 = vert[index ? index[i * 3 + 2] : i * 3 + 2];
+
+		src[i].v0 = v0;
+		src[i].e1 = v1 - v0;
+		src[i].e2 = v2 - v0;
+		src[i].idx = i;
+
+		cent[i] = (v0 + v1 + v2) * (1.0 / 3.0);
+		order[i] = i;
+	}
+
+	nodes.reserve(num_tris / TRI_LEAF_SIZE * 2 + 1);
+	build_node(&order[0], 0, num_tris, &src[0], &cent[0]);
+
+	tris.resize(num_tris);
+	for(int i=0; i<num_tris; i++) {
+		tris[i] = src[order[i]];
+	}
+}
+
+int TriBVH::build_node(int *order, int start, int count, const Tri *src, const Vector3 *cent)
+{
+	int idx = (int)nodes.size();
+	nodes.push_back(Node());
+
+	AABox box(Vector3(FLT_MAX, FLT_MAX, FLT_MAX), Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	AABox cbox = box;
+
+	for(int i=start; i<start + count; i++) {
+		const Tri &tri = src[order[i]];
+		Vector3 v[] = {tri.v0, tri.v0 + tri.e1, tri.v0 + tri.e2};
+
+		for(int j=0; j<3; j++) {
+			for(int k=0; k<3; k++) {
+				box.min[k] = MIN(box.min[k], v[j][k]);
+				box.max[k] = MAX(box.max[k], v[j][k]);
+			}
+		}
+		const Vector3 &c = cent[order[i]];
+		for(int k=0; k<3; k++) {
+			cbox.min[k] = MIN(cbox.min[k], c[k]);
+			cbox.max[k] = MAX(cbox.max[k], c[k]);
+		}
+	}
+	nodes[idx].box = box;
+	nodes[idx].start = start;
+	nodes[idx].count = count;
+	nodes[idx].right = -1;
+
+	Vector3 ext = cbox.max - cbox.min;
+	int axis = 0;
+	if(ext.y > ext[axis]) axis = 1;
+	if(ext.z > ext[axis]) axis = 2;
+
+	// no point in splitting triangles with coincident centroids
+	if(count <= TRI_LEAF_SIZE || ext[axis] <= 0.0) {
+		return idx;
+	}
+
+	int half = count / 2;
+	CentroidCmp cmp;
+	cmp.cent = cent;
+	cmp.axis = axis;
+	nth_element(order + start, order + start + half, order + start + count, cmp);
+
+	nodes[idx].count = 0;
+	build_node(order, start, half, src, cent);
+	int right = build_node(order, start + half, count - half, src, cent);
+	nodes[idx].right = right;
+	return idx;
+}
+
+void TriBVH::clear()
+{
+	nodes.clear();
+	tris.clear();
+}
+
+bool TriBVH::intersect(const Ray &ray, TriHit *hit, float tmax) const
+{
+	if(nodes.empty()) return false;
+
+	Vector3 inv_dir = calc_inv_dir(ray.dir);
+	bool found = false;
+
+	vector<StackEntry> stack;
+	StackEntry top;
+	if(!ray_box(ray, inv_dir, nodes[0].box, tmax, &top.t)) {
+		return false;
+	}
+	top.node = 0;
+	stack.push_back(top);
+
+	while(!stack.empty()) {
+		StackEntry ent = stack.back();
+		stack.pop_back();
+		if(ent.t > tmax) continue;
+
+		const Node &node = nodes[ent.node];
+		if(!node.count) {
+			int left = ent.node + 1;
+			push_children(&stack, ray, inv_dir, nodes[left].box, left, nodes[node.right].box, node.right, tmax);
+			continue;
+		}
+
+		// Möller-Trumbore ray/triangle test, double-sided
+		for(int i=node.start; i<node.start + node.count; i++) {
+			const Tri &tri = tris[i];
+
+			Vector3 pvec = cross_product(ray.dir, tri.e2);
+			double det = dot_product(tri.e1, pvec);
+			if(fabs(det) < XSMALL_NUMBER) continue;
+			double inv_det = 1.0 / det;
+
+			Vector3 tvec = ray.origin - tri.v0;
+			double u = dot_product(tvec, pvec) * inv_det;
+			if(u < 0.0 || u > 1.0) continue;
+
+			Vector3 qvec = cross_product(tvec, tri.e1);
+			double v = dot_product(ray.dir, qvec) * inv_det;
+			if(v < 0.0 || u + v > 1.0) continue;
+
+			double t = dot_product(tri.e2, qvec) * inv_det;
+			if(t < ERROR_MARGIN || t > tmax) continue;
+
+			tmax = t;
+			hit->tri = tri.idx;
+			hit->t = t;
+			hit->u = u;
+			hit->v = v;
+			found = true;
+		}
+	}
+	return found;
+}
+
+
+static void box_union(AABox *res, const AABox &a, const AABox &b)
+{
+	res->min.x = MIN(a.min.x, b.min.x);
+	res->min.y = MIN(a.min.y, b.min.y);
+	res->min.z = MIN(a.min.z, b.min.z);
+	res->max.x = MAX(a.max.x, b.max.x);
+	res->max.y = MAX(a.max.y, b.max.y);
+	res->max.z = MAX(a.max.z, b.max.z);
+}
+
+// half the surface area, which is all the heuristic needs
+static float box_area(const AABox &box)
+{
+	Vector3 sz = box.max - box.min;
+	return sz.x * sz.y + sz.y * sz.z + sz.z * sz.x;
+}
+
+static bool box_contains(const AABox &outer, const AABox &inner)
+{
+	return inner.min.x >= outer.min.x && inner.min.y >= outer.min.y &&
+		inner.min.z >= outer.min.z && inner.max.x <= outer.max.x &&
+		inner.max.y <= outer.max.y && inner.max.z <= outer.max.z;
+}
+
+static bool box_overlap(const AABox &a, const AABox &b)
+{
+	return a.min.x <= b.max.x && a.max.x >= b.min.x &&
+		a.min.y <= b.max.y && a.max.y >= b.min.y &&
+		a.min.z <= b.max.z && a.max.z >= b.min.z;
+}
+
+static bool box_equal(const AABox &a, const AABox &b)
+{
+	return a.min.x == b.min.x && a.min.y == b.min.y && a.min.z == b.min.z &&
+		a.max.x == b.max.x && a.max.y == b.max.y && a.max.z == b.max.z;
+}
+
+static Vector3 calc_inv_dir(const Vector3 &dir)
+{
+	Vector3 inv;
+	for(int i=0; i<3; i++) {
+		inv[i] = fabs(dir[i]) > XSMALL_NUMBER ? 1.0 / dir[i] : (dir[i] < 0.0 ? -FLT_MAX : FLT_MAX);
+	}
+	return inv;
+}
+
+// slab test, returns the distance the ray enters the box in tnear
+static bool ray_box(const Ray &ray, const Vector3 &inv_dir, const AABox &box, float tmax, float *tnear)
+{
+	float t0 = 0.0, t1 = tmax;
+	for(int i=0; i<3; i++) {
+		float ta = (box.min[i] - ray.origin[i]) * inv_dir[i];
+		float tb = (box.max[i] - ray.origin[i]) * inv_dir[i];
+		if(ta > tb) {
+			float tmp = ta;
+			ta = tb;
+			tb = tmp;
+		}
+
+		if(ta > t0) t0 = ta;
+		if(tb < t1) t1 = tb;
+		if(t0 > t1) return false;
+	}
+	*tnear = t0;
+	return true;
+}
+
+// pushes the children the ray enters, the nearest last so that it's popped first
+static void push_children(vector<StackEntry> *stack, const Ray &ray, const Vector3 &inv_dir,
+		const AABox &box0, int idx0, const AABox &box1, int idx1, float tmax)
+{
+	StackEntry ent[2];
+	bool hit0 = ray_box(ray, inv_dir, box0, tmax, &ent[0].t);
+	bool hit1 = ray_box(ray, inv_dir, box1, tmax, &ent[1].t);
+	ent[0].node = idx0;
+	ent[1].node = idx1;
+
+	if(hit0 && hit1) {
+		int first = ent[0].t <= ent[1].t ? 0 : 1;
+		stack->push_back(ent[1 - first]);
+		stack->push_back(ent[first]);
+	} else if(hit0) {
+		stack->push_back(ent[0]);
+	} else if(hit1) {
+		stack->push_back(ent[1]);
+	}
+}
@@ -0,0 +1,144 @@
+#ifndef HENGE_BVH_H_
+#define HENGE_BVH_H_
+
+#include <vector>
+#include "bounds.h"
+
+namespace henge {
+
+/* called by AABBTree::raycast for every item whose box is crossed by the
+ * ray before tmax, returns the new tmax: the same, or the distance of a hit
+ * found in the item, to skip anything further away.
+ */
+typedef float (*RayQueryFunc)(void *data, const Ray &ray, float tmax, void *cls);
+
+/* dynamic bounding volume hierarchy of axis-aligned boxes, for items which
+ * are added, removed and moved around all the time. Each item is a leaf,
+ * identified by the proxy index returned by insert. The structure of the
+ * tree is built on boxes enlarged by a fraction of their size (see
+ * set_margin), so that an item can move a bit before its leaf has to be
+ * reinserted, while the exact boxes are kept up to date all the way up for
+ * the queries. Insertion picks the sibling by the surface area heuristic,
+ * and the tree is kept balanced with rotations on the way back up, like an
+ * AVL tree.
+ */
+class AABBTree {
+private:
+	struct Node {
+		AABox fat, box;		// enlarged and exact bounds of the subtree
+		void *data;
+		int parent;		// next free node, for nodes in the free list
+		int child[2];
+		int height;		// 0 for leaves, -1 for free nodes
+	};
+	std::vector<Node> nodes;
+	int root, free_list;
+	int num_leaves;
+
+	float margin;
+
+	int alloc_node();
+	void free_node(int idx);
+
+	void insert_leaf(int leaf);
+	void remove_leaf(int leaf);
+	void refit_up(int idx);
+	void refit_boxes(int idx);
+	int balance(int idx);
+	int rotate(int idx, int slot);
+
+	void collect(int idx, std::vector<void*> *res) const;
+	bool validate_node(int idx, int parent, int *num_nodes, int *num_found) const;
+
+public:
+	AABBTree();
+
+	void clear();
+
+	/* fraction of the size of each box, added on every side of it when
+	 * inserted in the tree. Larger margins mean fewer reinsertions, and
+	 * looser fitting boxes.
+	 */
+	void set_margin(float margin);
+	float get_margin() const;
+
+	int insert(const AABox &box, void *data);
+	void remove(int proxy);
+
+	/* updates the box of an item, reinserting it only if it's moved out of
+	 * its enlarged box, otherwise just refitting the exact boxes above it.
+	 * Returns true if it was reinserted.
+	 */
+	bool move(int proxy, const AABox &box);
+
+	void *get_data(int proxy) const;
+	const AABox &get_fat_box(int proxy) const;
+
+	int get_count() const;
+	int get_height() const;
+
+	// exact bounds of all the items, returns false if the tree is empty
+	bool get_bounds(AABox *box) const;
+
+	// appends the data of the items whose boxes intersect the volume
+	void query(const Frustum &frust, std::vector<void*> *res) const;
+	void query(const AABox &box, std::vector<void*> *res) const;
+
+	/* visits the items whose boxes are crossed by the ray, taken
+	 * as the segment from origin to origin + dir, nearest subtrees first.
+	 */
+	void raycast(const Ray &ray, RayQueryFunc func, void *cls = 0) const;
+
+	/* checks the structure of the tree: the links between parents and
+	 * children, the heights, that the boxes of every node are the union of
+	 * its children's, and the free list. Reports the first problem found
+	 * and returns false. Walks the whole tree, for testing and debugging.
+	 */
+	bool validate() const;
+};
+
+// intersection of a ray with a triangle mesh
+struct TriHit {
+	int tri;		// index of the triangle
+	float t;		// distance along the ray, in units of its direction vector
+	float u, v;		// barycentric coordinates, the weights of the 2nd and 3rd vertex
+};
+
+/* static bounding volume hierarchy over the triangles of a mesh, for ray
+ * casting. Built top-down, splitting the triangles of each node in half
+ * along the longest axis of their centroids. The triangles are kept in the
+ * order of the leaves, as an origin and two edge vectors.
+ */
+class TriBVH {
+private:
+	struct Node {
+		AABox box;
+		int start, count;	// triangles of leaves, count is 0 for inner nodes
+		int right;			// second child, the first one follows the node
+	};
+	std::vector<Node> nodes;
+
+	struct Tri {
+		Vector3 v0, e1, e2;
+		int idx;
+	};
+	std::vector<Tri> tris;
+
+	int build_node(int *order, int start, int count, const Tri *src, const Vector3 *cent);
+
+public:
+	/* builds the hierarchy of the triangles given by an index array, or by
+	 * consecutive vertices if index is null.
+	 */
+	void build(const Vector3 *vert, const unsigned int *index, int num_tris);
+	void clear();
+
+	/* closest hit of the ray, taken as the segment from origin to
+	 * origin + dir, between a small margin from the origin and tmax.
+	 */
+	bool intersect(const Ray &ray, TriHit *hit, float tmax = 1.0) const;
+};
+
+}	// namespace henge
+
+#endif	// HENGE_BVH_H_
@@ -13,7 +13,7 @@ Camera *Camera::clone() const
 
 Matrix4x4 Camera::get_matrix(unsigned int time) const
 {
-	return get_xform_matrix(time).inverse();
+	return get_inv_xform_matrix(time);
 }
 
 void Camera::bind(unsigned int time) const
@@ -23,6 +23,11 @@ void Camera::bind(unsigned int time) const
 	load_matrix(get_matrix(time));
 }
 
+Frustum Camera::get_frustum(const Matrix4x4 &proj, unsigned int time) const
+{
+	return Frustum(proj * get_matrix(time));
+}
+
 
 TargetCamera::TargetCamera()
 {
@@ -3,6 +3,7 @@
 
 #include "anim.h"
 #include "vmath.h"
+#include "bounds.h"
 
 namespace henge {
 
@@ -14,6 +15,9 @@ public:
 
 	virtual Matrix4x4 get_matrix(unsigned int time = 0) const;
 	void bind(unsigned int time = 0) const;
+
+	// world space view frustum of the camera, with the given projection
+	Frustum get_frustum(const Matrix4x4 &proj, unsigned int time = 0) const;
 };
 
 class TargetCamera : public Camera {
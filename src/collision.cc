@@ -0,0 +1,377 @@
+#include <math.h>
+#include <float.h>
+#include "collision.h"
+
+using namespace std;
+using namespace henge;
+
+/* triangles overlapping more grid cells than this go into a separate list
+ * instead, so that a few large triangles among many small ones (e.g. a floor
+ * under a pile of props) don't blow up the size of the hash.
+ */
+#define MAX_TRI_CELLS	64
+
+static inline int cell_coord(float x, float cell_size);
+static float seg_plane(const Vector3 &p0, const Vector3 &p1, const henge::Plane *plane, Vector3 *norm);
+static float seg_sphere(const Vector3 &p0, const Vector3 &p1, const Sphere *sph, Vector3 *norm);
+
+CollisionSet::CollisionSet()
+{
+	hash_mask = 0;
+	cell_size = user_cell_size = 0.0;
+	valid = true;
+}
+
+void CollisionSet::add_plane(const henge::Plane *plane)
+{
+	planes.push_back(plane);
+}
+
+void CollisionSet::add_sphere(const Sphere *sph)
+{
+	spheres.push_back(sph);
+}
+
+void CollisionSet::add_object(const RObject *obj)
+{
+	objects.push_back(obj);
+	valid = false;
+}
+
+void CollisionSet::clear()
+{
+	planes.clear();
+	spheres.clear();
+	objects.clear();
+	tris.clear();
+	cell_start.clear();
+	cell_tris.clear();
+	big_tris.clear();
+	valid = true;
+}
+
+void CollisionSet::set_cell_size(float sz)
+{
+	user_cell_size = sz;
+	valid = false;
+}
+
+void CollisionSet::build(unsigned int msec)
+{
+	tris.clear();
+	for(size_t i=0; i<objects.size(); i++) {
+		add_triangles(objects[i], msec);
+	}
+	build_hash();
+	valid = true;
+}
+
+bool CollisionSet::is_valid() const
+{
+	return valid;
+}
+
+void CollisionSet::add_triangles(const RObject *obj, unsigned int msec)
+{
+	const TriMesh *mesh = obj->get_mesh();
+	const Vector3 *vert = mesh->get_data_vec3(EL_VERTEX);
+	const unsigned int *index = mesh->get_data_int(EL_INDEX);
+	int nvert = mesh->get_count(EL_VERTEX);
+	int nindex = mesh->get_count(EL_INDEX);
+
+	if(!vert) return;
+
+	Matrix4x4 xform = obj->get_xform_matrix(msec);
+
+	int ntris = index ? nindex / 3 : nvert / 3;
+	for(int i=0; i<ntris; i++) {
+		Vector3 v[3];
+		for(int j=0; j<3; j++) {
+			v[j] = vert[index ? index[i * 3 + j] : i * 3 + j].transformed(xform);
+		}
+
+		CTri tri;
+		tri.v0 = v[0];
+		tri.e1 = v[1] - v[0];
+		tri.e2 = v[2] - v[0];
+
+		Vector3 n = cross_product(tri.e1, tri.e2);
+		if(n.length_sq() < SMALL_NUMBER * SMALL_NUMBER) {
+			continue;	// degenerate
+		}
+		tri.n = n.normalized();
+
+		tris.push_back(tri);
+	}
+}
+
+/* the triangles are inserted in every cell their bounding box overlaps, up to
+ * MAX_TRI_CELLS. The hash table is built in two passes, counting the entries
+ * of each bucket first, so that all of them end up in a single array.
+ */
+void CollisionSet::build_hash()
+{
+	cell_start.clear();
+	cell_tris.clear();
+	big_tris.clear();
+	if(tris.empty()) return;
+
+	// default cell size: the average triangle extent
+	cell_size = user_cell_size;
+	if(cell_size <= 0.0) {
+		float sum = 0.0;
+		for(size_t i=0; i<tris.size(); i++) {
+			const CTri &tri = tris[i];
+			for(int j=0; j<3; j++) {
+				float e1 = fabs(tri.e1[j]), e2 = fabs(tri.e2[j]);
+				float ext = MAX(MAX(e1, e2), fabs(tri.e1[j] - tri.e2[j]));
+				sum += ext / 3.0;
+			}
+		}
+		cell_size = sum / (float)tris.size();
+		if(cell_size < SMALL_NUMBER) {
+			cell_size = 1.0;
+		}
+	}
+
+	int *cmin = new int[tris.size() * 6];
+	int *cmax = cmin + tris.size() * 3;
+	size_t num_entries = 0;
+
+	for(size_t i=0; i<tris.size(); i++) {
+		const CTri &tri = tris[i];
+		Vector3 v1 = tri.v0 + tri.e1;
+		Vector3 v2 = tri.v0 + tri.e2;
+
+		// count the cells in floating point, the extent may not even fit an int
+		float num = 1.0;
+		for(int j=0; j<3; j++) {
+			float lo = floor(MIN(tri.v0[j], MIN(v1[j], v2[j])) / cell_size);
+			float hi = floor(MAX(tri.v0[j], MAX(v1[j], v2[j])) / cell_size);
+			num *= hi - lo + 1.0;
+		}
+
+		if(num > MAX_TRI_CELLS) {
+			big_tris.push_back((int)i);
+			// empty range, so that the passes below skip it
+			cmin[i * 3] = 0;
+			cmax[i * 3] = -1;
+			continue;
+		}
+
+		for(int j=0; j<3; j++) {
+			cmin[i * 3 + j] = cell_coord(MIN(tri.v0[j], MIN(v1[j], v2[j])), cell_size);
+			cmax[i * 3 + j] = cell_coord(MAX(tri.v0[j], MAX(v1[j], v2[j])), cell_size);
+		}
+		num_entries += (size_t)num;
+	}
+
+	size_t size = 64;
+	while(size < num_entries) {
+		size <<= 1;
+	}
+	hash_mask = (unsigned int)size - 1;
+
+	cell_start.resize(size + 1, 0);
+	cell_tris.resize(num_entries);
+
+	for(int pass=0; pass<2; pass++) {
+		for(size_t i=0; i<tris.size(); i++) {
+			const int *lo = cmin + i * 3, *hi = cmax + i * 3;
+
+			for(int z=lo[2]; z<=hi[2]; z++) {
+				for(int y=lo[1]; y<=hi[1]; y++) {
+					for(int x=lo[0]; x<=hi[0]; x++) {
+						unsigned int h = hash(x, y, z);
+						if(pass == 0) {
+							cell_start[h + 1]++;
+						} else {
+							// cell_start[h] is used as the insertion point
+							cell_tris[cell_start[h]++] = (int)i;
+						}
+					}
+				}
+			}
+		}
+
+		if(pass == 0) {
+			for(size_t i=0; i<size; i++) {
+				cell_start[i + 1] += cell_start[i];
+			}
+		}
+	}
+
+	// the insertion points have moved to the start of the next bucket
+	for(size_t i=size; i>0; i--) {
+		cell_start[i] = cell_start[i - 1];
+	}
+	cell_start[0] = 0;
+
+	delete [] cmin;
+}
+
+unsigned int CollisionSet::hash(int x, int y, int z) const
+{
+	return ((unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u ^
+			(unsigned int)z * 83492791u) & hash_mask;
+}
+
+void CollisionSet::collide(const Vector3 *p0, const Vector3 *p1, float *t, Vector3 *norm, int count) const
+{
+	for(int i=0; i<count; i++) {
+		t[i] = FLT_MAX;
+	}
+
+	for(size_t i=0; i<planes.size(); i++) {
+		for(int j=0; j<count; j++) {
+			Vector3 n;
+			float tc = seg_plane(p0[j], p1[j], planes[i], &n);
+			if(tc < t[j]) {
+				t[j] = tc;
+				norm[j] = n;
+			}
+		}
+	}
+
+	for(size_t i=0; i<spheres.size(); i++) {
+		for(int j=0; j<count; j++) {
+			Vector3 n;
+			float tc = seg_sphere(p0[j], p1[j], spheres[i], &n);
+			if(tc < t[j]) {
+				t[j] = tc;
+				norm[j] = n;
+			}
+		}
+	}
+
+	if(tris.empty()) return;
+
+	for(int i=0; i<count; i++) {
+		Vector3 n;
+		float tc = seg_triangles(p0[i], p1[i], &n);
+		if(tc < t[i]) {
+			t[i] = tc;
+			norm[i] = n;
+		}
+	}
+}
+
+// closest hit of a segment with the triangles in the cells it passes through
+float CollisionSet::seg_triangles(const Vector3 &p0, const Vector3 &p1, Vector3 *norm) const
+{
+	int lo[3], hi[3];
+	float ncells = 1.0;
+	for(int i=0; i<3; i++) {
+		lo[i] = cell_coord(MIN(p0[i], p1[i]), cell_size);
+		hi[i] = cell_coord(MAX(p0[i], p1[i]), cell_size);
+		ncells *= (float)(hi[i] - lo[i] + 1);
+	}
+
+	Vector3 dir = p1 - p0;
+	float t0 = FLT_MAX;
+
+	/* Möller-Trumbore segment/triangle test, double-sided. For very long
+	 * segments (e.g. systems catching up after a while) it's cheaper to just
+	 * go through all the triangles.
+	 */
+#define TEST_TRI(idx)	\
+	do { \
+		const CTri &tri = tris[idx]; \
+		Vector3 pvec = cross_product(dir, tri.e2); \
+		float det = dot_product(tri.e1, pvec); \
+		if(fabs(det) < SMALL_NUMBER) break; \
+		float inv_det = 1.0 / det; \
+		Vector3 tvec = p0 - tri.v0; \
+		float u = dot_product(tvec, pvec) * inv_det; \
+		if(u < 0.0 || u > 1.0) break; \
+		Vector3 qvec = cross_product(tvec, tri.e1); \
+		float v = dot_product(dir, qvec) * inv_det; \
+		if(v < 0.0 || u + v > 1.0) break; \
+		float t = dot_product(tri.e2, qvec) * inv_det; \
+		if(t >= 0.0 && t <= 1.0 && t < t0) { \
+			t0 = t; \
+			*norm = dot_product(tri.n, dir) > 0.0 ? -tri.n : tri.n; \
+		} \
+	} while(0)
+
+	if(ncells > (float)tris.size()) {
+		for(size_t i=0; i<tris.size(); i++) {
+			TEST_TRI(i);
+		}
+		return t0;
+	}
+
+	for(size_t i=0; i<big_tris.size(); i++) {
+		TEST_TRI(big_tris[i]);
+	}
+
+	if(cell_tris.empty()) {
+		return t0;
+	}
+
+	for(int z=lo[2]; z<=hi[2]; z++) {
+		for(int y=lo[1]; y<=hi[1]; y++) {
+			for(int x=lo[0]; x<=hi[0]; x++) {
+				unsigned int h = hash(x, y, z);
+				for(int i=cell_start[h]; i<cell_start[h + 1]; i++) {
+					TEST_TRI(cell_tris[i]);
+				}
+			}
+		}
+	}
+
+#undef TEST_TRI
+	return t0;
+}
+
+
+static inline int cell_coord(float x, float cell_size)
+{
+	return (int)floor(x / cell_size);
+}
+
+// planes are one-sided, only segments crossing from the front are stopped
+static float seg_plane(const Vector3 &p0, const Vector3 &p1, const henge::Plane *plane, Vector3 *norm)
+{
+	Vector3 n = plane->get_normal();
+	Vector3 pos = plane->get_position();
+
+	float d0 = dot_product(n, p0 - pos);
+	float d1 = dot_product(n, p1 - pos);
+	if(d0 < 0.0 || d1 >= 0.0) {
+		return FLT_MAX;
+	}
+
+	*norm = n;
+	return d0 / (d0 - d1);
+}
+
+// only segments starting outside the sphere are stopped
+static float seg_sphere(const Vector3 &p0, const Vector3 &p1, const Sphere *sph, Vector3 *norm)
+{
+	Vector3 center = sph->get_position();
+	float rad = sph->get_radius();
+
+	Vector3 dir = p1 - p0;
+	Vector3 offs = p0 - center;
+
+	float a = dot_product(dir, dir);
+	float b = 2.0 * dot_product(offs, dir);
+	float c = dot_product(offs, offs) - rad * rad;
+	if(c < 0.0 || a < SMALL_NUMBER) {
+		return FLT_MAX;
+	}
+
+	float discr = b * b - 4.0 * a * c;
+	if(discr < 0.0) {
+		return FLT_MAX;
+	}
+
+	float t = (-b - sqrt(discr)) / (2.0 * a);
+	if(t < 0.0 || t > 1.0) {
+		return FLT_MAX;
+	}
+
+	*norm = (offs + dir * t) / rad;
+	return t;
+}
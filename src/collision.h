@@ -0,0 +1,71 @@
+#ifndef HENGE_COLLISION_H_
+#define HENGE_COLLISION_H_
+
+#include <vector>
+#include "vmath.h"
+#include "geom.h"
+#include "object.h"
+
+namespace henge {
+
+/* set of static colliders for particle systems: planes, spheres, and the
+ * triangles of scene objects, which are kept in world space in a uniform grid
+ * spatial hash, so that the cost of a query only depends on the geometry near
+ * the query segment. It can be shared between any number of particle systems.
+ */
+class CollisionSet {
+private:
+	std::vector<const henge::Plane*> planes;
+	std::vector<const Sphere*> spheres;
+	std::vector<const RObject*> objects;
+
+	// world space triangles: first vertex, two edges and the normal
+	struct CTri {
+		Vector3 v0, e1, e2, n;
+	};
+	std::vector<CTri> tris;
+
+	// spatial hash, triangles of cell hash h are cell_tris[cell_start[h] ...]
+	std::vector<int> cell_start;
+	std::vector<int> cell_tris;
+	// triangles spanning too many cells, tested against every segment
+	std::vector<int> big_tris;
+	unsigned int hash_mask;
+	float cell_size, user_cell_size;
+
+	bool valid;
+
+	void add_triangles(const RObject *obj, unsigned int msec);
+	void build_hash();
+	unsigned int hash(int x, int y, int z) const;
+	float seg_triangles(const Vector3 &p0, const Vector3 &p1, Vector3 *norm) const;
+
+public:
+	CollisionSet();
+
+	void add_plane(const henge::Plane *plane);
+	void add_sphere(const Sphere *sph);
+	void add_object(const RObject *obj);
+	void clear();
+
+	// size of the spatial hash grid cells, 0 (the default) picks one automatically
+	void set_cell_size(float sz);
+
+	/* builds the spatial hash from the object transformations at the given
+	 * time. Must be called again after moving any of the objects, and it's
+	 * called by update_psys when needed after adding any.
+	 */
+	void build(unsigned int msec = 0);
+	bool is_valid() const;
+
+	/* finds the first hit along each of count line segments from p0[i] to p1[i].
+	 * t[i] receives the parametric distance of the hit along the segment, or
+	 * a value greater than 1 if it doesn't hit anything, and norm[i] the
+	 * surface normal, facing the start of the segment.
+	 */
+	void collide(const Vector3 *p0, const Vector3 *p1, float *t, Vector3 *norm, int count) const;
+};
+
+}	// namespace henge
+
+#endif	// HENGE_COLLISION_H_
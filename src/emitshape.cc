@@ -0,0 +1,185 @@
+#include <math.h>
+#include "emitshape.h"
+#include "mesh.h"
+#include "psys.h"
+
+using namespace std;
+using namespace henge;
+
+static void get_tri(const TriMesh *mesh, int idx, int *vidx);
+
+EmitShape::EmitShape()
+{
+	mesh = 0;
+	radius = 0.0;
+}
+
+EmitShape::EmitShape(const TriMesh *mesh)
+{
+	set_mesh(mesh);
+}
+
+void EmitShape::set_mesh(const TriMesh *mesh)
+{
+	this->mesh = mesh;
+	curve.clear();
+	update();
+}
+
+void EmitShape::set_curve(const Vector3 *pts, int count)
+{
+	mesh = 0;
+	curve.assign(pts, pts + count);
+	update();
+}
+
+void EmitShape::update()
+{
+	vector<float> weight;
+	radius = 0.0;
+
+	if(mesh) {
+		const Vector3 *vert = mesh->get_data_vec3(EL_VERTEX);
+		int nvert = mesh->get_count(EL_VERTEX);
+		for(int i=0; i<nvert; i++) {
+			radius = MAX(radius, vert[i].length());
+		}
+
+		int ntris = mesh->get_data_int(EL_INDEX) ? mesh->get_count(EL_INDEX) / 3 :
+			mesh->get_count(EL_VERTEX) / 3;
+
+		weight.resize(ntris);
+		for(int i=0; i<ntris; i++) {
+			int vidx[3];
+			get_tri(mesh, i, vidx);
+
+			Vector3 v1 = vert[vidx[1]] - vert[vidx[0]];
+			Vector3 v2 = vert[vidx[2]] - vert[vidx[0]];
+			weight[i] = cross_product(v1, v2).length() * 0.5;
+		}
+	} else if(curve.size() > 1) {
+		for(size_t i=0; i<curve.size(); i++) {
+			radius = MAX(radius, curve[i].length());
+		}
+
+		weight.resize(curve.size() - 1);
+		for(size_t i=0; i<weight.size(); i++) {
+			weight[i] = (curve[i + 1] - curve[i]).length();
+		}
+	}
+
+	build_table(weight);
+}
+
+float EmitShape::get_radius() const
+{
+	return radius;
+}
+
+/* Vose's alias method: every entry i is picked with probability prob[i],
+ * or else it's alias[i], so that sampling takes one uniform index and one
+ * comparison.
+ */
+void EmitShape::build_table(const vector<float> &weight)
+{
+	int num = (int)weight.size();
+	prob.resize(num);
+	alias.resize(num);
+	if(!num) return;
+
+	float sum = 0.0;
+	for(int i=0; i<num; i++) {
+		sum += weight[i];
+	}
+	if(sum <= 0.0) {
+		prob.clear();
+		alias.clear();
+		return;
+	}
+
+	vector<int> small, large;
+	for(int i=0; i<num; i++) {
+		prob[i] = weight[i] * num / sum;
+		alias[i] = i;
+		if(prob[i] < 1.0) {
+			small.push_back(i);
+		} else {
+			large.push_back(i);
+		}
+	}
+
+	while(!small.empty() && !large.empty()) {
+		int s = small.back();
+		int l = large.back();
+		small.pop_back();
+
+		alias[s] = l;
+		prob[l] += prob[s] - 1.0;
+
+		if(prob[l] < 1.0) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+
+	// whatever is left is 1 give or take rounding errors
+	for(size_t i=0; i<small.size(); i++) {
+		prob[small[i]] = 1.0;
+	}
+	for(size_t i=0; i<large.size(); i++) {
+		prob[large[i]] = 1.0;
+	}
+}
+
+bool EmitShape::sample(RandGen *rng, Vector3 *pos, Vector3 *norm) const
+{
+	int num = (int)prob.size();
+	if(!num) return false;
+
+	int idx = (int)(rng->frand() * num);
+	if(idx >= num) idx = num - 1;
+	if(rng->frand() >= prob[idx]) {
+		idx = alias[idx];
+	}
+
+	if(!mesh) {
+		*pos = lerp(curve[idx], curve[idx + 1], rng->frand());
+		*norm = Vector3(0, 0, 0);
+		return true;
+	}
+
+	const Vector3 *vert = mesh->get_data_vec3(EL_VERTEX);
+	const Vector3 *vnorm = mesh->get_data_vec3(EL_NORMAL);
+	if(mesh->get_count(EL_NORMAL) != mesh->get_count(EL_VERTEX)) {
+		vnorm = 0;
+	}
+
+	int vidx[3];
+	get_tri(mesh, idx, vidx);
+
+	// uniformly distributed barycentric coordinates
+	float r = sqrt(rng->frand());
+	float s = rng->frand();
+	float b0 = 1.0 - r;
+	float b1 = r * (1.0 - s);
+	float b2 = r * s;
+
+	*pos = vert[vidx[0]] * b0 + vert[vidx[1]] * b1 + vert[vidx[2]] * b2;
+
+	if(vnorm) {
+		*norm = (vnorm[vidx[0]] * b0 + vnorm[vidx[1]] * b1 + vnorm[vidx[2]] * b2).normalized();
+	} else {
+		Vector3 v1 = vert[vidx[1]] - vert[vidx[0]];
+		Vector3 v2 = vert[vidx[2]] - vert[vidx[0]];
+		*norm = cross_product(v1, v2).normalized();
+	}
+	return true;
+}
+
+static void get_tri(const TriMesh *mesh, int idx, int *vidx)
+{
+	const unsigned int *index = mesh->get_data_int(EL_INDEX);
+	for(int i=0; i<3; i++) {
+		vidx[i] = index ? (int)index[idx * 3 + i] : idx * 3 + i;
+	}
+}
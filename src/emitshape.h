@@ -0,0 +1,57 @@
+#ifndef HENGE_EMITSHAPE_H_
+#define HENGE_EMITSHAPE_H_
+
+#include <vector>
+#include "vmath.h"
+
+namespace henge {
+
+class TriMesh;
+class RandGen;
+
+/* shape for particle systems to emit from: the surface of a mesh, or a curve
+ * given as a polyline. Points are picked uniformly over the area (or length)
+ * by choosing a triangle (or segment) with probability proportional to its
+ * size, in constant time through an alias table.
+ *
+ * Points are taken from the current vertex positions of the mesh, so they
+ * follow any animation of the vertices. The table itself only needs to be
+ * rebuilt (with update) when the relative sizes of the triangles change
+ * significantly.
+ */
+class EmitShape {
+private:
+	const TriMesh *mesh;
+	std::vector<Vector3> curve;
+
+	// alias table, one entry per triangle or segment
+	std::vector<float> prob;
+	std::vector<int> alias;
+
+	float radius;
+
+	void build_table(const std::vector<float> &weight);
+
+public:
+	EmitShape();
+	EmitShape(const TriMesh *mesh);
+
+	// the mesh isn't copied, it must stay around as long as the shape is used
+	void set_mesh(const TriMesh *mesh);
+	void set_curve(const Vector3 *pts, int count);
+
+	void update();
+
+	// distance of the furthest point of the shape from the origin, as of the last update
+	float get_radius() const;
+
+	/* random point on the shape, with the interpolated vertex normal there
+	 * (or the face normal if the mesh has no normals). Curves have no normal,
+	 * and norm is set to zero for them.
+	 */
+	bool sample(RandGen *rng, Vector3 *pos, Vector3 *norm) const;
+};
+
+}	// namespace henge
+
+#endif	// HENGE_EMITSHAPE_H_
@@ -5,6 +5,7 @@
 #include "sdr.h"
 #include "errlog.h"
 #include "datapath.h"
+#include "tpool.h"
 
 using namespace henge;
 
@@ -47,6 +48,7 @@ void henge::shutdown()
 {
 	destroy_textures();
 	destroy_sdr();
+	destroy_thread_pool();
 }
 
 static int vp[4] = {-1, -1, -1, -1};
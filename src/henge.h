@@ -2,7 +2,11 @@
 #define HENGE_H_
 
 #include "anim.h"
+#include "animclip.h"
 #include "bounds.h"
+#include "bvh.h"
+#include "collision.h"
+#include "emitshape.h"
 #include "byteorder.h"
 #include "color.h"
 #include "errlog.h"
@@ -25,6 +29,8 @@
 #include "sky.h"
 #include "ggen.h"
 #include "datapath.h"
+#include "tpool.h"
+#include "xfgraph.h"
 #include "vmath/vmath.h"
 
 namespace henge {
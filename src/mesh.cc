@@ -49,6 +49,7 @@ void TriMesh::init()
 
 	kdt_valid = false;
 	bounds_valid = false;
+	bvh_valid = false;
 }
 
 #define ELEM_BIT(x)		(1 << x)
@@ -64,6 +65,10 @@ void TriMesh::invalidate(int elmask)
 			vbo_valid[i] = false;
 		}
 	}
+
+	if(elmask & (ELEM_BIT(EL_VERTEX) | ELEM_BIT(EL_INDEX))) {
+		bvh_valid = false;
+	}
 }
 
 TriMesh &TriMesh::operator =(const TriMesh &m)
@@ -105,6 +110,7 @@ TriMesh &TriMesh::operator =(const TriMesh &m)
 		index = new unsigned int[nindex];
 		memcpy(index, m.index, nindex * sizeof *index);
 	}
+	bvh_valid = false;
 
 	return *this;
 }
@@ -375,6 +381,7 @@ Vector3 *TriMesh::get_data_vec3(int elem)
 	switch(elem) {
 	case EL_VERTEX:
 		kdt_valid = false;
+		bounds_valid = false;
 		if(vert) {
 			invalidate(ELEM_BIT(EL_VERTEX));
 		}
@@ -814,11 +821,45 @@ void TriMesh::draw() const
 }
 #endif
 
+void TriMesh::draw_instanced(int count) const
+{
+	// can't go in a display list, so it always uses the vertex arrays
+	setup_vertex_arrays();
+
+	if(index) {
+		if(caps.vbo) {
+			glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, vbo[EL_INDEX]);
+
+			// update if needed
+			if(!vbo_valid[EL_INDEX]) {
+				glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER_ARB, nindex * sizeof *index,
+						index, GL_DYNAMIC_DRAW_ARB);
+				vbo_valid[EL_INDEX] = true;
+			}
+
+			glDrawElementsInstancedARB(GL_TRIANGLES, nindex, GL_UNSIGNED_INT, 0, count);
+			glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+		} else {
+			glDrawElementsInstancedARB(GL_TRIANGLES, nindex, GL_UNSIGNED_INT, index, count);
+		}
+	} else {
+		glDrawArraysInstancedARB(GL_TRIANGLES, 0, nvert, count);
+	}
+
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	if(caps.glsl) {
+		glDisableVertexAttribArrayARB(SDR_ATTR_TANGENT);
+	}
+}
+
 void TriMesh::calc_bounds()
 {
 	centroid = Vector3(0, 0, 0);
 	aabb_min = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
-	aabb_max = Vector3(FLT_MIN, FLT_MIN, FLT_MIN);
+	aabb_max = Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 	bsph_rad = 0.0f;
 
 	for(int i=0; i<nvert; i++) {
@@ -830,7 +871,9 @@ void TriMesh::calc_bounds()
 		aabb_min.z = MIN(aabb_min.z, vert[i].z);
 		aabb_max.z = MAX(aabb_max.z, vert[i].z);
 	}
-	centroid /= (float)nvert;
+	if(nvert) {
+		centroid /= (float)nvert;
+	}
 
 	for(int i=0; i<nvert; i++) {
 		float dist = (vert[i] - centroid).length();
@@ -894,75 +937,24 @@ void TriMesh::draw_vertices(float sz, const Color &col) const
 	glPopAttrib();
 }
 
-struct Triangle {
-	Vector3 v[3];
-	Vector3 n;
-};
-
-static bool ray_triangle(const Ray &ray, Triangle *tri, float *pt);
-
 bool TriMesh::intersect(const Ray &ray, float *pt) const
 {
-	float t0 = FLT_MAX;
-
-	// indexed Triangles
-	int ntris = index ? nindex / 3 : nvert / 3;
-	for(int i=0; i<ntris; i++) {
-		Triangle tri;
-
-		if(index) {
-			tri.v[0] = vert[index[i * 3]];
-			tri.v[1] = vert[index[i * 3 + 1]];
-			tri.v[2] = vert[index[i * 3 + 2]];
-		} else {
-			tri.v[0] = vert[i * 3];
-			tri.v[1] = vert[i * 3 + 1];
-			tri.v[2] = vert[i * 3 + 2];
-		}
-
-		Vector3 v1 = tri.v[1] - tri.v[0];
-		Vector3 v2 = tri.v[2] - tri.v[0];
-		tri.n = cross_product(v1, v2).normalized();
-
-		float t;
-		if(ray_triangle(ray, &tri, &t) && t < t0) {
-			t0 = t;
-		}
+	TriHit hit;
+	if(!raycast(ray, &hit)) {
+		return false;
 	}
 
-	if(t0 < FLT_MAX) {
-		if(pt) *pt = t0;
-		return true;
+	if(pt) {
+		*pt = hit.t;
 	}
-	return false;
+	return true;
 }
 
-static bool ray_triangle(const Ray &ray, Triangle *tri, float *pt)
+bool TriMesh::raycast(const Ray &ray, TriHit *hit, float tmax) const
 {
-	float vdotn = dot_product(ray.dir, tri->n);
-	if(fabs(vdotn) < ERROR_MARGIN) {
-		return false;	// parallel to the plane
-	}
-
-	float t = dot_product(tri->v[0] - ray.origin, tri->n) / vdotn;
-	if(t < ERROR_MARGIN || t > 1.0) {
-		return false;
-	}
-
-	Vector3 pos = ray.origin + ray.dir * t;
-
-	for(int i=0; i<3; i++) {
-		Vector3 v0 = tri->v[(i + 1) % 3] - tri->v[i];
-		Vector3 v1 = pos - tri->v[i];
-
-		Vector3 n = cross_product(v0, v1);
-		if(dot_product(n, tri->n) < 0.0) {
-			return false;
-		}
+	if(!bvh_valid) {
+		bvh.build(vert, index, index ? nindex / 3 : nvert / 3);
+		bvh_valid = true;
 	}
-
-	if(pt) {
-		*pt = t;
-	}
-	return true;
+	return bvh.intersect(ray, hit, tmax);
 }
@@ -4,6 +4,7 @@
 #include "vmath.h"
 #include "color.h"
 #include "kdtree.h"
+#include "bvh.h"
 
 namespace henge {
 
@@ -42,6 +43,10 @@ private:
 	float bsph_rad;
 	bool bounds_valid;
 
+	// triangle hierarchy for raycast, built on demand
+	mutable TriBVH bvh;
+	mutable bool bvh_valid;
+
 	void build_kdtree();
 	void setup_vertex_arrays() const;
 
@@ -102,11 +107,23 @@ public:
 	float get_bsph_radius() const;
 
 	void draw() const;
+
+	/* draws count instances of the mesh with a single call, any per-instance
+	 * vertex attributes must be set up by the caller. Requires the
+	 * GL_ARB_draw_instanced extension (caps.draw_inst).
+	 */
+	void draw_instanced(int count) const;
 	void draw_normals(float sz = 1.0, const Color &col = Color(0, 1, 0, 1)) const;
 	void draw_tangents(float sz = 1.0, const Color &col = Color(0, 1, 0, 1)) const;
 	void draw_vertices(float sz = 1.0, const Color &col = Color(1, 0, 0, 1)) const;
 
 	bool intersect(const Ray &ray, float *pt = 0) const;
+
+	/* closest hit of the ray (see TriBVH::intersect) with the triangles,
+	 * through a hierarchy built on first use, and again after any change
+	 * of the vertices or indices.
+	 */
+	bool raycast(const Ray &ray, TriHit *hit, float tmax = 1.0) const;
 };
 
 }	// namespace henge
@@ -126,6 +126,8 @@ static struct {
 	{"GL_SGIS_generate_mipmap", &caps.gen_mipmaps, "mipmap generation"},
 	{"GL_ARB_texture_non_power_of_two", &caps.non_pow2_tex, "non power of 2 textures"},
 	{"GL_EXT_texture_filter_anisotropic", &caps.aniso, "anisotropic filtering"},
+	{"GL_ARB_instanced_arrays", &caps.inst_arrays, "instanced arrays"},
+	{"GL_ARB_draw_instanced", &caps.draw_inst, "instanced drawing"},
 	{0, 0, 0}
 };
 
@@ -63,6 +63,8 @@ extern struct GLCaps {
 	bool gen_mipmaps;
 	bool non_pow2_tex;
 	bool aniso;
+	bool inst_arrays;
+	bool draw_inst;
 	int max_lights;
 	int max_tex_units;
 	int max_vattr;
@@ -1,16 +1,29 @@
+#define PSYS_CC_IMPL
+
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <stdio.h>
 #include <math.h>
+#include <string.h>
+#include <float.h>
+#include <pthread.h>
 #include "psys.h"
+#include "tpool.h"
+#include "collision.h"
+#include "emitshape.h"
 #include "cfgfile.h"
 #include "errlog.h"
 #include "material.h"
+#include "mesh.h"
+#include "sdr.h"
+#include "psys_sdr.h"
+#include "radix.h"
 
 
 using namespace std;
 using namespace henge;
 
-#define MAX_FREE_LIST_SIZE	500000
-
 /* change this to a positive number, for a hard cap on the number of particles */
 #define MAX_PARTICLES		-1
 
@@ -22,22 +35,70 @@ static int max_active_particles = -1;
 
 // prototypes of the particle allocator (memory pool)
 static Particle *new_particle();
+static Particle *new_mesh_particle();
 static void delete_particle(Particle *p);
+static int alloc_particles(Particle *(*part_alloc)(), Particle **dest, int count);
+static void free_particles(void (*part_free)(Particle*), Particle **parr, int count);
+
+static void update_job(int idx, void *cls);
+
+static void integrate(Vector3 *dpos, Vector3 *vel, const Vector3 &force, float k, int steps);
+static inline void expand_bounds(Vector3 *bmin, Vector3 *bmax, const Vector3 &pt);
+static float particle_reach(const ParticleSysParams &prm, float timeslice);
+static void collide_particles(const CollisionSet *coll, const ParticleSysParams &prm,
+		Particle **part, const Vector3 *prev_pos, int count);
+
+// adds a reference to parameters from the cache, see get_psys_params
+static void add_psys_params_ref(const ParticleSysParams *prm);
+
+// random values for spawning particles are drawn in chunks of this size
+#define SPAWN_CHUNK		64
+
+// each new particle system gets the next seed, see ParticleSystem::set_seed
+static unsigned int next_seed = 1;
 
 static float global_time;
+static unsigned int global_msec;
 
 /* just a trial and error constant to match point-sprite size with
  * billboard size
  */
 #define PSPRITE_BILLBOARD_RATIO		100
 
-// particle rendering state
-static bool use_psprites = true;
-static bool volatile_particles = false;
+// vertex format of the particle vertex stream
+struct PVertex {
+	float x, y, z;
+	float u, v;
+	float r, g, b, a;
+};
+
+/* vertex array shared by all particle systems, it's (re)filled by each
+ * ParticleSystem::draw call and submitted with a single draw call.
+ */
+static vector<PVertex> vbuf;
+
+// scratch buffers for building and sorting the particle streams
+static vector<const Particle*> merge_buf, sorted_buf;
+static vector<float> angle_buf, sorted_angle_buf, depth_buf;
+
+static void begin_billboards(const ParticleSysParams &prm, bool psprites);
+static int build_points(const Particle * const *plist, int count);
+static int build_quads(const Particle * const *plist, int count, const float *angles);
+static void draw_vbuf(unsigned int prim, int count);
+static const Particle * const *depth_order(const Particle * const *plist, int count);
+static const unsigned int *sort_depth(const Particle * const *plist, int count);
+
+// per-instance data of instanced mesh particles (3x4 matrix and color)
+static vector<float> inst_buf;
+static unsigned int inst_vbo;
+
+static const Shader *get_inst_shader(bool inst_arrays);
+static void draw_inst_arrays(const TriMesh *mesh, int count);
 
 void henge::set_psys_global_time(unsigned int msec)
 {
 	global_time = (float)msec / 1000.0;
+	global_msec = msec;
 }
 
 
@@ -52,6 +113,37 @@ float FuzzyVal::operator()() const
 	return range == 0.0 ? num : frand(range) + num - range / 2.0;
 }
 
+float FuzzyVal::operator()(RandGen *rng) const
+{
+	return range == 0.0 ? num : rng->frand(range) + num - range / 2.0;
+}
+
+void FuzzyVal::generate(float *dest, int count, RandGen *rng) const
+{
+	if(range == 0.0) {
+		for(int i=0; i<count; i++) {
+			dest[i] = num;
+		}
+	} else {
+		rng->frand(dest, count);
+
+		float offs = num - range / 2.0;
+		for(int i=0; i<count; i++) {
+			dest[i] = dest[i] * range + offs;
+		}
+	}
+}
+
+float FuzzyVal::get_max() const
+{
+	return num + range / 2.0;
+}
+
+float FuzzyVal::get_abs_max() const
+{
+	return fabs(num) + range / 2.0;
+}
+
 
 FuzzyVec3::FuzzyVec3(const FuzzyVal &x, const FuzzyVal &y, const FuzzyVal &z)
 {
@@ -65,14 +157,129 @@ Vector3 FuzzyVec3::operator()() const
 	return Vector3(x(), y(), z());
 }
 
+Vector3 FuzzyVec3::operator()(RandGen *rng) const
+{
+	float vx = x(rng);
+	float vy = y(rng);
+	float vz = z(rng);
+	return Vector3(vx, vy, vz);
+}
+
+void FuzzyVec3::generate(Vector3 *dest, int count, RandGen *rng) const
+{
+	float tmp[SPAWN_CHUNK];
+
+	for(int i=0; i<count; i+=SPAWN_CHUNK) {
+		int n = count - i < SPAWN_CHUNK ? count - i : SPAWN_CHUNK;
+
+		x.generate(tmp, n, rng);
+		for(int j=0; j<n; j++) dest[i + j].x = tmp[j];
+		y.generate(tmp, n, rng);
+		for(int j=0; j<n; j++) dest[i + j].y = tmp[j];
+		z.generate(tmp, n, rng);
+		for(int j=0; j<n; j++) dest[i + j].z = tmp[j];
+	}
+}
+
+Vector3 FuzzyVec3::get_abs_max() const
+{
+	return Vector3(x.get_abs_max(), y.get_abs_max(), z.get_abs_max());
+}
+
+const FuzzyVal &FuzzyVec3::operator[](int idx) const
+{
+	return idx == 0 ? x : (idx == 1 ? y : z);
+}
+
+
+/* xoshiro128+ by David Blackman and Sebastiano Vigna, seeded through
+ * splitmix32 so that any seed (including 0) gives a usable state.
+ */
+static inline uint32_t rotl(uint32_t x, int k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+RandGen::RandGen(uint32_t seed)
+{
+	this->seed(seed);
+}
+
+void RandGen::seed(uint32_t seed)
+{
+	for(int i=0; i<4; i++) {
+		uint32_t z = (seed += 0x9e3779b9);
+		z = (z ^ (z >> 16)) * 0x85ebca6b;
+		z = (z ^ (z >> 13)) * 0xc2b2ae35;
+		s[i] = z ^ (z >> 16);
+	}
+}
+
+uint32_t RandGen::next()
+{
+	uint32_t res = s[0] + s[3];
+	uint32_t t = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 11);
+
+	return res;
+}
+
+// the low bits of xoshiro128+ are weak, use the top 24 bits for floats
+#define TO_FLOAT(x)		((float)((x) >> 8) * (1.0f / 16777216.0f))
+
+float RandGen::frand()
+{
+	return TO_FLOAT(next());
+}
+
+float RandGen::frand(float range)
+{
+	return TO_FLOAT(next()) * range;
+}
+
+void RandGen::frand(float *dest, int count)
+{
+	// keep the state in registers for the whole run
+	uint32_t s0 = s[0], s1 = s[1], s2 = s[2], s3 = s[3];
+
+	for(int i=0; i<count; i++) {
+		uint32_t res = s0 + s3;
+		uint32_t t = s1 << 9;
+
+		s2 ^= s0;
+		s3 ^= s1;
+		s1 ^= s2;
+		s0 ^= s3;
+		s2 ^= t;
+		s3 = rotl(s3, 11);
+
+		dest[i] = TO_FLOAT(res);
+	}
+
+	s[0] = s0;
+	s[1] = s1;
+	s[2] = s2;
+	s[3] = s3;
+}
+
 
 Particle::Particle()
 {
+	pool_next = 0;
+	pool_slab = 0;
 	reset();
 }
 
 Particle::Particle(const Vector3 &pos, const Vector3 &vel, float friction, float lifespan)
 {
+	pool_next = 0;
+	pool_slab = 0;
 	set_position(pos);
 	velocity = vel;
 	this->friction = friction;
@@ -94,20 +301,115 @@ bool Particle::alive() const
 	return global_time - birth_time < lifespan;
 }
 
-void Particle::update(const Vector3 &ext_force)
+void Particle::update(const Vector3 &ext_force, int steps)
 {
 	float time = global_time - birth_time;
-	if(time > lifespan) return;
+	if(time > lifespan || steps <= 0) return;
 
-	velocity = (velocity + ext_force) * friction;
-	translate(velocity);	// update position
+	if(steps == 1) {
+		velocity = (velocity + ext_force) * friction;
+		translate(velocity);	// update position
+		return;
+	}
+
+	Vector3 dpos;
+	integrate(&dpos, &velocity, ext_force, friction, steps);
+	translate(dpos);
+}
+
+/* Closed form of n iterations of the fixed timestep integrator:
+ *   v(i+1) = (v(i) + f) * k
+ *   p(i+1) = p(i) + v(i+1)
+ * with S = k + k^2 + ... + k^n = k (1 - k^n) / (1 - k) this unrolls to:
+ *   v(n) = k^n v(0) + S f
+ *   p(n) = p(0) + S v(0) + k / (1 - k) (n - S) f
+ * and for k = 1 (no friction) to:
+ *   v(n) = v(0) + n f
+ *   p(n) = p(0) + n v(0) + n (n + 1) / 2 f
+ */
+static void integrate(Vector3 *dpos, Vector3 *vel, const Vector3 &force, float k, int steps)
+{
+	float n = (float)steps;
+
+	if(fabs(1.0 - k) < SMALL_NUMBER) {
+		*dpos = *vel * n + force * (n * (n + 1.0f) / 2.0f);
+		*vel += force * n;
+	} else {
+		float kn = pow(k, n);
+		float s = k * (1.0f - kn) / (1.0f - k);
+
+		*dpos = *vel * s + force * (k / (1.0f - k) * (n - s));
+		*vel = *vel * kn + force * s;
+	}
+}
+
+static inline void expand_bounds(Vector3 *bmin, Vector3 *bmax, const Vector3 &pt)
+{
+	if(pt.x < bmin->x) bmin->x = pt.x;
+	if(pt.y < bmin->y) bmin->y = pt.y;
+	if(pt.z < bmin->z) bmin->z = pt.z;
+	if(pt.x > bmax->x) bmax->x = pt.x;
+	if(pt.y > bmax->y) bmax->y = pt.y;
+	if(pt.z > bmax->z) bmax->z = pt.z;
+}
+
+// distance particles are kept off the surfaces they collide with
+#define COLL_OFFSET		1e-3
+
+/* checks the moves of a batch of particles from their previous positions
+ * against the colliders, and applies the collision response.
+ */
+static void collide_particles(const CollisionSet *coll, const ParticleSysParams &prm,
+		Particle **part, const Vector3 *prev_pos, int count)
+{
+	Vector3 pos[SPAWN_CHUNK], norm[SPAWN_CHUNK];
+	float t[SPAWN_CHUNK];
+
+	for(int i=0; i<count; i++) {
+		pos[i] = part[i]->get_position();
+	}
+
+	coll->collide(prev_pos, pos, t, norm, count);
+
+	for(int i=0; i<count; i++) {
+		if(t[i] > 1.0) continue;
+
+		Particle *p = part[i];
+		const Vector3 &n = norm[i];
+		Vector3 hit = prev_pos[i] + (pos[i] - prev_pos[i]) * t[i];
+
+		switch(prm.collision) {
+		case COLL_KILL:
+			p->lifespan = 0.0;
+			break;
+
+		case COLL_STICK:
+			p->set_position(hit + n * COLL_OFFSET);
+			p->velocity = Vector3(0, 0, 0);
+			break;
+
+		case COLL_BOUNCE:
+			{
+				// reflect the rest of the move and the velocity about the surface
+				float k = 1.0 + prm.restitution;
+				float depth = dot_product(pos[i] - hit, n);
+
+				p->set_position(pos[i] - n * (k * depth - COLL_OFFSET));
+				p->velocity -= n * (k * dot_product(p->velocity, n));
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
 }
 
 BillboardParticle::~BillboardParticle() {}
 
-void BillboardParticle::update(const Vector3 &ext_force)
+void BillboardParticle::update(const Vector3 &ext_force, int steps)
 {
-	Particle::update(ext_force);
+	Particle::update(ext_force, steps);
 
 	float time = global_time - birth_time;
 	if(time > lifespan) return;
@@ -120,45 +422,66 @@ void BillboardParticle::update(const Vector3 &ext_force)
 	angle = rot * time + birth_angle;
 }
 
-/* NOTE:
- * if we use point sprites, and the particles are not rotating, then the
- * calling function has taken care to call glBegin() before calling this.
+/* draws a single particle on its own, ParticleSystem::draw doesn't call this
+ * for billboards, it batches all of them into a single vertex array instead.
  */
 void BillboardParticle::draw() const
 {
 	Matrix4x4 tex_rot;
-	if(volatile_particles) {
-		tex_rot.translate(Vector3(0.5, 0.5, 0.0));
-		tex_rot.rotate(Vector3(0.0, 0.0, angle));
-		tex_rot.translate(Vector3(-0.5, -0.5, 0.0));
+	tex_rot.translate(Vector3(0.5, 0.5, 0.0));
+	tex_rot.rotate(Vector3(0.0, 0.0, angle));
+	tex_rot.translate(Vector3(-0.5, -0.5, 0.0));
 
-		glMatrixMode(GL_TEXTURE);
-		glPushMatrix();
-		load_matrix(tex_rot);
-	}
+	glMatrixMode(GL_TEXTURE);
+	glPushMatrix();
+	load_matrix(tex_rot);
 
-	Vector3 pos = get_position();
+	draw_point(get_position(), col, size / PSPRITE_BILLBOARD_RATIO);
 
-	if(use_psprites) {
-		if(volatile_particles) {
-			glPointSize(size);
+	glMatrixMode(GL_TEXTURE);
+	glPopMatrix();
+}
 
-			glBegin(GL_POINTS);
-			glColor4f(col.x, col.y, col.z, col.w);
-			glVertex3f(pos.x, pos.y, pos.z);
-			glEnd();
-		} else {
-			glColor4f(col.x, col.y, col.z, col.w);
-			glVertex3f(pos.x, pos.y, pos.z);
-		}
-	} else {	// don't use point sprites
-		draw_point(pos, col, size / PSPRITE_BILLBOARD_RATIO);
-	}
 
-	if(volatile_particles) {
-		glMatrixMode(GL_TEXTURE);
-		glPopMatrix();
-	}
+MeshParticle::~MeshParticle() {}
+
+void MeshParticle::update(const Vector3 &ext_force, int steps)
+{
+	Particle::update(ext_force, steps);
+
+	float time = global_time - birth_time;
+	if(time > lifespan) return;
+	float t = time / lifespan;
+
+	col = lerp(start_color, end_color, t);
+
+	size = size_start + (size_end - size_start) * t;
+
+	angle = rot * time + birth_angle;
+}
+
+// translation, spin and scaling of the particle's mesh instance
+Matrix4x4 MeshParticle::get_instance_matrix() const
+{
+	Matrix4x4 mat;
+	mat.set_translation(get_position());
+	mat.rotate(axis, angle);
+	mat.scale(Vector4(size, size, size, 1.0));
+	return mat;
+}
+
+void MeshParticle::draw() const
+{
+	if(!mesh) return;
+
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	mult_matrix(get_instance_matrix());
+
+	glColor4f(col.x, col.y, col.z, col.w);
+	mesh->draw();
+
+	glPopMatrix();
 }
 
 
@@ -173,39 +496,123 @@ ParticleSystem::ParticleSystem(const char *fname)
 	psprites_unsupported = !caps.psprites;
 
 	prev_update = -1.0;
+	started = false;
 	fraction = 0.0;
+	emitter_valid = false;
 	ptype = PTYPE_BILLBOARD;
 
 	ready = true;
 
+	set_seed(next_seed++);
+
+	psys_params = own_params = 0;
+
 	if(fname) {
-		if(!psys_params.load(fname)) {
+		if(!(psys_params = get_psys_params(fname))) {
 			error("error loading particle file: %s\n", fname);
 			ready = false;
+		} else if(!psys_params->sub_psys.empty()) {
+			const char *sub_fname = psys_params->sub_psys.c_str();
+			const ParticleSysParams *sub = get_psys_params(sub_fname);
+			if(sub) {
+				sub_params = *sub;
+				release_psys_params(sub);
+			} else {
+				error("error loading sub-emitter particle file: %s\n", sub_fname);
+				ready = false;
+			}
+			ptype = PTYPE_PSYS;
 		}
 	}
+	if(!psys_params) {
+		psys_params = own_params = new ParticleSysParams;
+	}
 
 	part_alloc = new_particle;
+	part_free = delete_particle;
+
+	colliders = 0;
+}
+
+ParticleSystem::ParticleSystem(const ParticleSystem &psys)
+	: Particle(psys)
+{
+	timeslice = psys.timeslice;
+	num_particles = 0;
+
+	active = psys.active;
+	visible = psys.visible;
+
+	psprites_unsupported = psys.psprites_unsupported;
+
+	prev_update = -1.0;
+	started = false;
+	fraction = 0.0;
+	emitter_valid = false;
+	ptype = psys.ptype;
+
+	ready = psys.ready;
+
+	set_seed(next_seed++);
+
+	if(psys.own_params) {
+		psys_params = own_params = new ParticleSysParams(*psys.own_params);
+	} else {
+		psys_params = psys.psys_params;
+		own_params = 0;
+		add_psys_params_ref(psys_params);
+	}
+	sub_params = psys.sub_params;
+
+	part_alloc = psys.part_alloc;
+	part_free = psys.part_free;
+
+	colliders = psys.colliders;
 }
 
 ParticleSystem::~ParticleSystem()
 {
 	reset();
+
+	if(own_params) {
+		delete own_params;
+	} else {
+		release_psys_params(psys_params);
+	}
 }
 
-void ParticleSystem::set_particle_alloc(Particle *(*func)())
+void ParticleSystem::set_particle_alloc(Particle *(*alloc_func)(), void (*free_func)(Particle*))
 {
-	part_alloc = func;
+	part_alloc = alloc_func;
+	part_free = free_func ? free_func : delete_particle;
 }
 
 void ParticleSystem::reset()
 {
 	prev_update = -1.0;
-	std::list<Particle*>::iterator iter = particles.begin();
-	while(iter != particles.end()) {
-		delete *iter++;
+	started = false;
+	rng.seed(seed);
+	if(!particles.empty()) {
+		free_particles(part_free, &particles[0], (int)particles.size());
 	}
 	particles.clear();
+	num_particles = 0;
+
+	if(!sub_particles.empty()) {
+		free_particles(part_free, &sub_particles[0], (int)sub_particles.size());
+	}
+	sub_particles.clear();
+}
+
+void ParticleSystem::set_seed(unsigned int seed)
+{
+	this->seed = seed;
+	rng.seed(seed);
+}
+
+unsigned int ParticleSystem::get_seed() const
+{
+	return seed;
 }
 
 void ParticleSystem::set_update_interval(float timeslice)
@@ -234,27 +641,76 @@ bool ParticleSystem::is_visible() const
 	return visible;
 }
 
+void ParticleSystem::set_colliders(CollisionSet *cset)
+{
+	colliders = cset;
+}
+
+CollisionSet *ParticleSystem::get_colliders() const
+{
+	return colliders;
+}
+
 void ParticleSystem::set_params(const ParticleSysParams &psys_params)
 {
-	this->psys_params = psys_params;
+	if(own_params) {
+		*own_params = psys_params;
+	} else {
+		// copy first, psys_params might be the shared parameters themselves
+		own_params = new ParticleSysParams(psys_params);
+		release_psys_params(this->psys_params);
+		this->psys_params = own_params;
+	}
 }
 
 ParticleSysParams *ParticleSystem::get_params()
 {
-	return &psys_params;
+	if(!own_params) {
+		own_params = new ParticleSysParams(*psys_params);
+		release_psys_params(psys_params);
+		psys_params = own_params;
+	}
+	return own_params;
+}
+
+const ParticleSysParams *ParticleSystem::get_params_const() const
+{
+	return psys_params;
 }
 
 void ParticleSystem::set_particle_type(ParticleType ptype)
 {
+	if(ptype == this->ptype) return;
+
+	reset();
 	this->ptype = ptype;
+
+	// mesh particles come from their own pool
+	if(part_alloc == new_particle || part_alloc == new_mesh_particle) {
+		part_alloc = ptype == PTYPE_MESH ? new_mesh_particle : new_particle;
+	}
+}
+
+void ParticleSystem::set_sub_params(const ParticleSysParams &prm)
+{
+	sub_params = prm;
+	ptype = PTYPE_PSYS;
+}
+
+ParticleSysParams *ParticleSystem::get_sub_params()
+{
+	return &sub_params;
 }
 
 #ifdef __sgi__
 #define round(x)	floor((x) + 0.5)
 #endif
 
-void ParticleSystem::update(const Vector3 &ext_force)
+void ParticleSystem::update(const Vector3 &ext_force, int steps)
 {
+	bool emitter_done = emitter_valid;
+	emitter_valid = false;
+
 	if(!ready) {// || (!active && num_particles == 0)) {
 		return;
 	}
@@ -264,16 +720,89 @@ void ParticleSystem::update(const Vector3 &ext_force)
 
 	if(!updates_missed) return;	// less than a timeslice has elapsed, nothing to do
 
-	Vector3 pos;
-	curr_pos = pos.transformed(get_xform_matrix((unsigned int)(global_time * 1000.0)));
-	//curr_pos = get_position((unsigned int)(global_time * 1000.0));
-	curr_halo_rot = psys_params.halo_rot * global_time;
+	if(!emitter_done) {
+		eval_emitter();
+	}
+	curr_halo_rot = psys_params->halo_rot * global_time;
+
+	curr_rot = fmod(psys_params->glob_rot * global_time, 2.0f * (float)M_PI);
+
+	Vector3 bmin(FLT_MAX, FLT_MAX, FLT_MAX), bmax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	/* update particles, catching up on all the missed timeslices in one go.
+	 * Sub-emitters also need to know where they moved from.
+	 */
+	bool sub_emit = ptype == PTYPE_PSYS;
+	if(sub_emit) {
+		emit_pos.resize(particles.size());
+	}
+
+	// particles to check for collisions, with their positions before moving
+	const CollisionSet *coll = psys_params->collision != COLL_NONE ? colliders : 0;
+	Particle *cpart[SPAWN_CHUNK];
+	Vector3 cpos[SPAWN_CHUNK];
+	int num_coll = 0;
+
+	for(size_t i=0; i<particles.size(); i++) {
+		Particle *p = particles[i];
+		if(!p->alive()) continue;
 
-	curr_rot = fmod(psys_params.glob_rot * global_time, 2.0f * (float)M_PI);
+		if(sub_emit) {
+			emit_pos[i] = p->get_position();
+		}
+		if(coll) {
+			cpart[num_coll] = p;
+			cpos[num_coll] = p->get_position();
+		}
+
+		p->update(psys_params->gravity, updates_missed);
+
+		if(coll && ++num_coll == SPAWN_CHUNK) {
+			collide_particles(coll, *psys_params, cpart, cpos, num_coll);
+			num_coll = 0;
+		}
+	}
+	if(num_coll) {
+		collide_particles(coll, *psys_params, cpart, cpos, num_coll);
+	}
+
+	if(sub_emit) {
+		update_sub_particles(updates_missed, &bmin, &bmax);
+	}
+
+	// compact the array in place, dropping the dead ones
+	Particle *dead[SPAWN_CHUNK];
+	int num_dead = 0;
+
+	size_t num_alive = 0;
+	for(size_t i=0; i<particles.size(); i++) {
+		Particle *p = particles[i];
+
+		if(p->alive()) {
+			particles[num_alive++] = p;
+			expand_bounds(&bmin, &bmax, p->get_position());
+		} else {
+			dead[num_dead++] = p;
+			if(num_dead == SPAWN_CHUNK) {
+				free_particles(part_free, dead, num_dead);
+				num_dead = 0;
+			}
+			num_particles--;
+		}
+	}
+	free_particles(part_free, dead, num_dead);
+	particles.resize(num_alive);
 
 	// spawn new particles
 	if(active) {
-		float spawn = psys_params.birth_rate() * (global_time - prev_update);
+		if(!started) {
+			prev_pos = curr_pos;
+			prev_update = curr_time;
+			started = true;
+			return;
+		}
+
+		float spawn = psys_params->birth_rate(&rng) * (global_time - prev_update);
 		int spawn_count = (int)round(spawn);
 
 		// handle sub-timeslice spawning rates
@@ -286,206 +815,901 @@ void ParticleSystem::update(const Vector3 &ext_force)
 			spawn_count--;
 		}
 
-		Vector3 dp, pos;
-		if(prev_update < 0.0) {
-			prev_pos = curr_pos;
-			prev_update = curr_time;
-			return;
+		int max_spawn = spawn_count;
+		if(psys_params->max_active_particles >= 0 &&
+				num_particles + max_spawn > psys_params->max_active_particles) {
+			max_spawn = psys_params->max_active_particles - num_particles;
+		}
+
+		ParticleType spawn_type = ptype == PTYPE_MESH ? PTYPE_MESH : PTYPE_BILLBOARD;
+		num_particles += spawn_particles(*psys_params, spawn_type, &particles, spawn_count, max_spawn,
+				prev_pos, curr_pos, prev_update, &bmin, &bmax);
+	}
+
+	if(!particles.empty() || !sub_particles.empty()) {
+		part_box.min = bmin;
+		part_box.max = bmax;
+	}
+
+	prev_update = global_time;
+	prev_pos = curr_pos;
+}
+
+/* spawns count particles of the given type (billboards or meshes) with the
+ * given parameters, evenly spread
+ * over the time from t0 to now, and the path from pos0 to pos1, and appends
+ * them to dest. Only up to max_spawn of them which are still alive by now are
+ * actually spawned, advanced to the current time. Returns how many.
+ */
+int ParticleSystem::spawn_particles(const ParticleSysParams &prm, ParticleType type, std::vector<Particle*> *dest,
+		int count, int max_spawn, const Vector3 &pos0, const Vector3 &pos1, float t0,
+		Vector3 *bmin, Vector3 *bmax)
+{
+	if(count <= 0 || max_spawn <= 0) return 0;
+
+	Vector3 pos = pos0;
+	float t = t0;
+
+	/* when catching up after a long pause, anything spawned earlier than
+	 * the longest lifespan ago is dead by now, so skip that part of the
+	 * interval altogether.
+	 */
+	float interval = global_time - t0;
+	float max_life = prm.lifespan.get_max();
+	if(interval > max_life) {
+		float skip = (interval - max_life) / interval;
+		int skip_count = (int)(count * skip);
+
+		pos += (pos1 - pos0) * skip;
+		t += interval * skip;
+		count -= skip_count;
+	}
+
+	Vector3 dp = (pos1 - pos) / (float)count;
+	float dt = (global_time - t) / (float)count;
+
+	const CollisionSet *coll = prm.collision != COLL_NONE ? colliders : 0;
+
+	// XXX: correct this rotation to span the whole interval
+	const Quaternion &rot = curr_emit_rot;
+	const Vector3 &scale = curr_emit_scale;
+
+	/* draw the random values for the spawn batch a chunk at a time from
+	 * this system's random number stream.
+	 */
+	float size_val[SPAWN_CHUNK], life_val[SPAWN_CHUNK];
+	Vector3 offs_val[SPAWN_CHUNK], vel_val[SPAWN_CHUNK], cpos[SPAWN_CHUNK];
+	Particle *new_part[SPAWN_CHUNK], *dead[SPAWN_CHUNK];
+	int num_spawned = 0;
+
+	int i = 0;
+	while(i < count && max_spawn > 0) {
+		int chunk = count - i;
+		if(chunk > SPAWN_CHUNK) {
+			chunk = SPAWN_CHUNK;
+		}
+
+		prm.psize.generate(size_val, chunk, &rng);
+		prm.lifespan.generate(life_val, chunk, &rng);
+		prm.spawn_offset.generate(offs_val, chunk, &rng);
+		prm.shoot_dir.generate(vel_val, chunk, &rng);
+
+		// only allocate the ones which haven't died already
+		int num_live = 0;
+		float tj = t;
+		for(int j=0; j<chunk; j++) {
+			if(tj + life_val[j] > global_time) {
+				num_live++;
+			}
+			tj += dt;
+		}
+		if(num_live > max_spawn) {
+			num_live = max_spawn;
+		}
+
+		int num_new = alloc_particles(part_alloc, new_part, num_live);
+		max_spawn -= num_new;
+		int k = 0;
+
+		for(int j=0; j<chunk; j++, i++) {
+			if(k < num_new && t + life_val[j] > global_time) {
+				Particle *p = new_part[k];
+
+				if(type == PTYPE_MESH) {
+					MeshParticle *mp = (MeshParticle*)p;
+					mp->mesh = prm.mesh;
+					mp->start_color = prm.start_color;
+					mp->end_color = prm.end_color;
+					mp->rot = prm.rot;
+
+					// tumble around a random axis, from a random orientation
+					Vector3 axis(rng.frand() - 0.5, rng.frand() - 0.5, rng.frand() - 0.5);
+					mp->axis = axis.length_sq() > SMALL_NUMBER ? axis.normalized() : Vector3(0, 1, 0);
+					mp->birth_angle = rng.frand(2.0f * (float)M_PI);
+				} else {
+					BillboardParticle *bbp = (BillboardParticle*)p;
+					bbp->tex = prm.billboard_tex;
+					bbp->start_color = prm.start_color;
+					bbp->end_color = prm.end_color;
+					bbp->rot = prm.rot;
+					bbp->birth_angle = fmod(prm.glob_rot * t, 2.0f * (float)M_PI);
+				}
+
+				// emit from a surface or curve, on top of the offset
+				if(prm.spawn_shape) {
+					Vector3 spos, snorm;
+					if(prm.spawn_shape->sample(&rng, &spos, &snorm)) {
+						offs_val[j] += spos;
+						vel_val[j] += snorm * prm.normal_speed(&rng);
+					}
+				}
+
+				p->set_position(pos + offs_val[j].transformed(rot));
+				p->set_rotation(rot);
+				p->set_scaling(scale);
+
+				p->size_start = size_val[j];
+				if(prm.psize_end < 0.0) {
+					p->size_end = p->size_start;
+				} else {
+					p->size_end = prm.psize_end;
+				}
+
+				// XXX: correct this next rotation to span the interval
+				p->velocity = vel_val[j].transformed(rot);
+				p->friction = prm.friction;
+				p->birth_time = t;
+				p->lifespan = life_val[j];
+
+				cpos[k++] = p->get_position();
+
+				// advance it by the timeslices elapsed since its birth
+				p->update(prm.gravity, (int)round((global_time - t) / timeslice));
+			}
+
+			pos += dp;
+			t += dt;
+		}
+
+		if(coll) {
+			collide_particles(coll, prm, new_part, cpos, num_new);
+		}
+
+		int num_dead = 0;
+		for(int j=0; j<num_new; j++) {
+			Particle *p = new_part[j];
+			if(p->alive()) {
+				dest->push_back(p);
+				expand_bounds(bmin, bmax, p->get_position());
+				num_spawned++;
+			} else {
+				dead[num_dead++] = p;
+			}
+		}
+		free_particles(part_free, dead, num_dead);
+	}
+
+	return num_spawned;
+}
+
+/* sub-emitters: every particle of a PTYPE_PSYS system emits particles with
+ * the sub-system parameters. Rather than being particle systems of their own,
+ * they all share the sub_particles array of the parent, and get updated here,
+ * in a single pass. Expects the previous position of each emitter particle
+ * in emit_pos.
+ */
+void ParticleSystem::update_sub_particles(int steps, Vector3 *bmin, Vector3 *bmax)
+{
+	const CollisionSet *coll = sub_params.collision != COLL_NONE ? colliders : 0;
+	Particle *cpart[SPAWN_CHUNK], *dead[SPAWN_CHUNK];
+	Vector3 cpos[SPAWN_CHUNK];
+	int num_coll = 0, num_dead = 0;
+
+	for(size_t i=0; i<sub_particles.size(); i++) {
+		Particle *p = sub_particles[i];
+		if(!p->alive()) continue;
+
+		if(coll) {
+			cpart[num_coll] = p;
+			cpos[num_coll] = p->get_position();
+		}
+
+		p->update(sub_params.gravity, steps);
+
+		if(coll && ++num_coll == SPAWN_CHUNK) {
+			collide_particles(coll, sub_params, cpart, cpos, num_coll);
+			num_coll = 0;
+		}
+	}
+	if(num_coll) {
+		collide_particles(coll, sub_params, cpart, cpos, num_coll);
+	}
+
+	size_t num_alive = 0;
+	for(size_t i=0; i<sub_particles.size(); i++) {
+		Particle *p = sub_particles[i];
+
+		if(p->alive()) {
+			sub_particles[num_alive++] = p;
+			expand_bounds(bmin, bmax, p->get_position());
+		} else {
+			dead[num_dead++] = p;
+			if(num_dead == SPAWN_CHUNK) {
+				free_particles(part_free, dead, num_dead);
+				num_dead = 0;
+			}
+		}
+	}
+	free_particles(part_free, dead, num_dead);
+	sub_particles.resize(num_alive);
+
+	if(!started) return;
+
+	// emit from every live emitter along the path it moved
+	for(size_t i=0; i<particles.size(); i++) {
+		Particle *em = particles[i];
+		if(!em->alive()) continue;
+
+		float t0 = MAX(prev_update, em->birth_time);
+
+		// stochastic rounding keeps the average rate without per-emitter state
+		float spawn = sub_params.birth_rate(&rng) * (global_time - t0);
+		int count = (int)(spawn + rng.frand());
+
+		int max_spawn = count;
+		if(sub_params.max_active_particles >= 0 &&
+				(int)sub_particles.size() + max_spawn > sub_params.max_active_particles) {
+			max_spawn = sub_params.max_active_particles - (int)sub_particles.size();
+		}
+
+		spawn_particles(sub_params, PTYPE_BILLBOARD, &sub_particles, count, max_spawn, emit_pos[i],
+				em->get_position(), t0, bmin, bmax);
+	}
+}
+
+/* reads the world transformation of the emitter for the current update, so
+ * that nothing else during the update touches the node, or any of its
+ * ancestors which may be shared with other particle systems.
+ */
+void ParticleSystem::eval_emitter()
+{
+	Vector3 pos;
+	curr_pos = pos.transformed(get_xform_matrix(global_msec));
+	curr_emit_rot = get_rotation(global_msec);
+	curr_emit_scale = get_scaling(global_msec);
+}
+
+void ParticleSystem::prewarm(float seconds)
+{
+	if(!ready || seconds <= 0.0) return;
+
+	Vector3 pos;
+	prev_pos = pos.transformed(get_xform_matrix(global_msec));
+	prev_update = global_time - seconds;
+	started = true;
+
+	update();
+}
+
+AABox ParticleSystem::get_bounds(unsigned int msec) const
+{
+	Vector3 pos;
+	pos.transform(get_xform_matrix(msec));
+
+	float rad = particle_reach(*psys_params, timeslice);
+	float max_life = psys_params->lifespan.get_max();
+	float size = MAX(psys_params->psize.get_max(), psys_params->psize_end);
+
+	// world space extent of a particle around its position
+	float pad = size / PSPRITE_BILLBOARD_RATIO;
+
+	if(ptype == PTYPE_PSYS) {
+		// sub-emitters can emit from anywhere their own particles reach
+		rad += particle_reach(sub_params, timeslice);
+		max_life += sub_params.lifespan.get_max();
+
+		float sub_size = MAX(sub_params.psize.get_max(), sub_params.psize_end);
+		pad = MAX(pad, sub_size / PSPRITE_BILLBOARD_RATIO);
+	}
+
+	if(ptype == PTYPE_MESH && psys_params->mesh) {
+		// mesh particles are scaled by their size, rather than being that size
+		const TriMesh *mesh = psys_params->mesh;
+		float mesh_pad = size * (mesh->get_centroid().length() + mesh->get_bsph_radius());
+
+		rad += mesh_pad - pad;
+		pad = mesh_pad;
+	}
+
+	Vector3 ext(rad, rad, rad);
+	AABox box(pos - ext, pos + ext);
+
+	// particles left behind by a moving emitter, unless they're all dead
+	if((!particles.empty() || !sub_particles.empty()) && msec / 1000.0 - prev_update < max_life) {
+		for(int i=0; i<3; i++) {
+			box.min[i] = MIN(box.min[i], part_box.min[i] - pad);
+			box.max[i] = MAX(box.max[i], part_box.max[i] + pad);
+		}
+	}
+	return box;
+}
+
+/* the furthest a particle can get from its emitter in its lifespan (plus its
+ * size), from the closed form of the integrator, with the largest initial
+ * speed and the force pointing the same way. Both terms grow with the number
+ * of steps.
+ */
+static float particle_reach(const ParticleSysParams &prm, float timeslice)
+{
+	int steps = (int)ceil(prm.lifespan.get_max() / timeslice);
+
+	float speed = prm.shoot_dir.get_abs_max().length();
+	float offs = prm.spawn_offset.get_abs_max().length();
+	if(prm.spawn_shape) {
+		speed += prm.normal_speed.get_abs_max();
+		offs += prm.spawn_shape->get_radius();
+	}
+
+	Vector3 dist, vel(speed, 0, 0);
+	Vector3 force(prm.gravity.length(), 0, 0);
+	integrate(&dist, &vel, force, prm.friction, steps);
+
+	float size = MAX(prm.psize.get_max(), prm.psize_end);
+	return offs + fabs(dist.x) + size / PSPRITE_BILLBOARD_RATIO;
+}
+
+void ParticleSystem::draw() const
+{
+	if(!ready || !visible) return;
+
+	if(!particles.empty()) {
+		if(ptype == PTYPE_BILLBOARD) {
+			draw_billboards(&particles[0], (int)particles.size(), *psys_params);
+		} else if(ptype == PTYPE_PSYS) {
+			// the emitters themselves are only drawn if they have a texture
+			if(psys_params->billboard_tex) {
+				draw_billboards(&particles[0], (int)particles.size(), *psys_params);
+			}
 		} else {
-			dp = (curr_pos - prev_pos) / (float)spawn_count;
-			pos = prev_pos;
+			draw_meshes(&particles[0], (int)particles.size(), *psys_params);
+		}
+	}
+
+	if(ptype == PTYPE_PSYS && !sub_particles.empty()) {
+		draw_billboards(&sub_particles[0], (int)sub_particles.size(), sub_params);
+	}
+
+	draw_halo();
+}
+
+void ParticleSystem::draw_billboards(const Particle * const *plist, int count,
+		const ParticleSysParams &prm) const
+{
+	// use point sprites if the system supports them AND we don't need big particles
+	bool use_psprites = !prm.big_particles && !psprites_unsupported;
+
+	/* particles are volatile if they rotate OR they fluctuate in size, in
+	 * which case they can't be drawn as point sprites with a common size and
+	 * texture matrix. Expand them to quads on the CPU instead. Same goes for
+	 * depth-sorted particles, which are drawn one quad after the other.
+	 */
+	bool volatile_particles = prm.rot > SMALL_NUMBER || prm.psize.range > SMALL_NUMBER;
+	if(volatile_particles || prm.depth_sort) {
+		use_psprites = false;
+	}
+
+	if(prm.depth_sort) {
+		plist = depth_order(plist, count);
+	}
+
+	const float *angles = 0;
+	if(volatile_particles) {
+		if((int)angle_buf.size() < count) {
+			angle_buf.resize(count);
+		}
+		for(int i=0; i<count; i++) {
+			angle_buf[i] = ((const BillboardParticle*)plist[i])->angle;
 		}
+		angles = &angle_buf[0];
+	}
+
+	// ------ setup render state ------
+	begin_billboards(prm, use_psprites);
 
-		float dt = (global_time - prev_update) / (float)spawn_count;
-		float t = prev_update;
+	if(prm.billboard_tex && !volatile_particles) {
+		Matrix4x4 prot;
+		prot.translate(Vector3(0.5, 0.5, 0.0));
+		prot.rotate(Vector3(0.0, 0.0, curr_rot));
+		prot.translate(Vector3(-0.5, -0.5, 0.0));
+
+		glMatrixMode(GL_TEXTURE);
+		glPushMatrix();
+		load_matrix(prot);
+	}
 
-		for(int i=0; i<spawn_count; i++) {
-			if(psys_params.max_active_particles >= 0 &&
-					num_particles >= psys_params.max_active_particles) {
-				break;
+	// ------ render particles ------
+	if(use_psprites) {
+		glPointSize(plist[0]->size);
+		draw_vbuf(GL_POINTS, build_points(plist, count));
+	} else {
+		draw_vbuf(GL_QUADS, build_quads(plist, count, angles));
+	}
+
+	// ------ restore render states -------
+	if(prm.billboard_tex && !volatile_particles) {
+		glMatrixMode(GL_TEXTURE);
+		glPopMatrix();
+	}
+	glPopAttrib();
+}
+
+/* draws all the mesh particles in as few draw calls as possible. With
+ * instancing support the per-instance matrices and colors are streamed into a
+ * vertex buffer, and the whole batch is a single draw call. Without instanced
+ * arrays, but with instanced drawing, they're passed to the shader as uniform
+ * arrays, a chunk of INST_UNIFORM_BATCH particles per draw call. Otherwise
+ * every particle loads its own matrix and calls the (display listed) mesh.
+ */
+void ParticleSystem::draw_meshes(const Particle * const *plist, int count,
+		const ParticleSysParams &prm) const
+{
+	if(!prm.mesh) return;
+
+	glPushAttrib(GL_ENABLE_BIT | GL_TEXTURE_BIT | GL_COLOR_BUFFER_BIT |
+			GL_DEPTH_BUFFER_BIT | GL_LIGHTING_BIT);
+
+	glEnable(GL_COLOR_MATERIAL);
+	glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
+
+	// opaque unless they fade out
+	if(prm.start_color.w < 1.0 || prm.end_color.w < 1.0) {
+		glEnable(GL_BLEND);
+		glBlendFunc(prm.src_blend, prm.dest_blend);
+		glDepthMask(0);
+	}
+
+	if(prm.billboard_tex) {
+		if(get_mat_bind_mask() & MAT_BIND_TEXTURE) {
+			prm.billboard_tex->bind();
+		}
+	} else {
+		glDisable(GL_TEXTURE_2D);
+	}
+
+	bool inst_arrays = caps.inst_arrays && caps.vbo;
+	const Shader *sdr = 0;
+	if(caps.draw_inst && caps.glsl) {
+		sdr = get_inst_shader(inst_arrays);
+	}
+
+	if(sdr) {
+		if((int)inst_buf.size() < count * 16) {
+			inst_buf.resize(count * 16);
+		}
+
+		float *dest = &inst_buf[0];
+		for(int i=0; i<count; i++) {
+			const MeshParticle *p = (const MeshParticle*)plist[i];
+			Matrix4x4 mat = p->get_instance_matrix();
+
+			for(int j=0; j<3; j++) {
+				for(int k=0; k<4; k++) {
+					*dest++ = mat[j][k];
+				}
 			}
+			*dest++ = p->col.x;
+			*dest++ = p->col.y;
+			*dest++ = p->col.z;
+			*dest++ = p->col.w;
+		}
 
-			Particle *p;
-			switch(ptype) {
-			case PTYPE_BILLBOARD:
-				if((p = part_alloc())) {
-					curr_rot = fmod(psys_params.glob_rot * t, 2.0f * (float)M_PI);
+		sdr->set_uniform("lighting", glIsEnabled(GL_LIGHTING) ? 1.0f : 0.0f);
+		sdr->set_uniform("tex_enable", prm.billboard_tex ? 1.0f : 0.0f);
+		sdr->set_uniform("tex", 0);
+		set_shader(sdr);
 
-					BillboardParticle *bbp = (BillboardParticle*)p;
-					bbp->tex = psys_params.billboard_tex;
-					bbp->start_color = psys_params.start_color;
-					bbp->end_color = psys_params.end_color;
-					bbp->rot = psys_params.rot;
-					bbp->birth_angle = curr_rot;
+		if(inst_arrays) {
+			draw_inst_arrays(prm.mesh, count);
+		} else {
+			for(int i=0; i<count; i+=INST_UNIFORM_BATCH) {
+				int num = count - i;
+				if(num > INST_UNIFORM_BATCH) {
+					num = INST_UNIFORM_BATCH;
 				}
-				break;
+				sdr->set_uniform_array("inst_data", &inst_buf[i * 16], num * 4);
+				prm.mesh->draw_instanced(num);
+			}
+		}
+
+		set_shader(0);
+	} else {
+		/* no way to replicate the mesh in a single call, but at least grab the
+		 * modelview matrix once, instead of pushing and multiplying per particle.
+		 */
+		Matrix4x4 view;
+		glMatrixMode(GL_MODELVIEW);
+		store_matrix(&view);
+		glPushMatrix();
+
+		for(int i=0; i<count; i++) {
+			const MeshParticle *p = (const MeshParticle*)plist[i];
+			load_matrix(view * p->get_instance_matrix());
+			glColor4f(p->col.x, p->col.y, p->col.z, p->col.w);
+			prm.mesh->draw();
+		}
+
+		glPopMatrix();
+	}
+
+	glPopAttrib();
+}
+
+// streams the instance data into a vertex buffer, and draws the whole batch
+static void draw_inst_arrays(const TriMesh *mesh, int count)
+{
+	if(!inst_vbo) {
+		glGenBuffersARB(1, &inst_vbo);
+	}
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, inst_vbo);
+	glBufferDataARB(GL_ARRAY_BUFFER_ARB, count * 16 * sizeof(float), &inst_buf[0], GL_STREAM_DRAW_ARB);
+
+	static const int inst_attr[] = {
+		SDR_ATTR_INST_XFORM, SDR_ATTR_INST_XFORM + 1, SDR_ATTR_INST_XFORM + 2,
+		SDR_ATTR_INST_COLOR
+	};
+	for(int i=0; i<4; i++) {
+		glEnableVertexAttribArrayARB(inst_attr[i]);
+		glVertexAttribPointerARB(inst_attr[i], 4, GL_FLOAT, 0, 16 * sizeof(float),
+				(void*)(i * 4 * sizeof(float)));
+		glVertexAttribDivisorARB(inst_attr[i], 1);
+	}
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+
+	mesh->draw_instanced(count);
+
+	for(int i=0; i<4; i++) {
+		glVertexAttribDivisorARB(inst_attr[i], 0);
+		glDisableVertexAttribArrayARB(inst_attr[i]);
+	}
+}
+
+/* compiles the built-in mesh instancing shader on first use, the one taking
+ * the instance data from vertex attributes, or the one taking it from uniforms.
+ */
+static const Shader *get_inst_shader(bool inst_arrays)
+{
+	static Shader *sdr[2];
+	static bool failed[2];
+
+	int idx = inst_arrays ? 1 : 0;
+	if(!sdr[idx] && !failed[idx]) {
+		const char *vs = inst_arrays ? inst_mesh_vs : inst_mesh_uniform_vs;
+
+		sdr[idx] = new Shader;
+		if(!sdr[idx]->compile_shader(vs, SDR_VERTEX, "<mesh instancing vs>") ||
+				!sdr[idx]->compile_shader(inst_mesh_ps, SDR_PIXEL, "<mesh instancing ps>") ||
+				!sdr[idx]->link()) {
+			warning("failed to create the mesh instancing shader, falling back to one draw per particle\n");
+			delete sdr[idx];
+			sdr[idx] = 0;
+			failed[idx] = true;
+		}
+	}
+	return sdr[idx];
+}
+
+// render a halo around the emitter if we need to
+void ParticleSystem::draw_halo() const
+{
+	if(!psys_params->halo) return;
+
+	// construct texture matrix for halo rotation
+	Matrix4x4 mat;
+	mat.translate(Vector3(0.5, 0.5, 0.0));
+	mat.rotate(Vector3(0, 0, curr_halo_rot));
+	mat.translate(Vector3(-0.5, -0.5, 0.0));
+
+	glMatrixMode(GL_TEXTURE);
+	glPushMatrix();
+	load_matrix(mat);
+
+	glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+
+	psys_params->halo->bind();
+
+	glDepthMask(0);
+
+	float sz = psys_params->halo_size() / PSPRITE_BILLBOARD_RATIO;
+	draw_point(curr_pos, psys_params->halo_color, sz);
+
+	glPopAttrib();
+
+	glMatrixMode(GL_TEXTURE);
+	glPopMatrix();
+}
+
+/* draws the particles of a number of depth-sorted billboard systems, which
+ * share the same texture and blending mode, as a single back-to-front sorted
+ * stream. The global rotation of non-volatile systems is baked into the
+ * texture coordinates, since they can't share a texture matrix.
+ */
+void ParticleSystem::draw_merged(ParticleSystem * const *psys, int count)
+{
+	merge_buf.clear();
+	angle_buf.clear();
+
+	for(int i=0; i<count; i++) {
+		const ParticleSystem *ps = psys[i];
+		const ParticleSysParams &prm = *ps->psys_params;
+		bool volatile_particles = prm.rot > SMALL_NUMBER || prm.psize.range > SMALL_NUMBER;
+
+		for(size_t j=0; j<ps->particles.size(); j++) {
+			const Particle *p = ps->particles[j];
+			merge_buf.push_back(p);
+			angle_buf.push_back(volatile_particles ? ((const BillboardParticle*)p)->angle : ps->curr_rot);
+		}
+	}
+
+	int num = (int)merge_buf.size();
+	if(num) {
+		const unsigned int *order = sort_depth(&merge_buf[0], num);
+
+		sorted_buf.resize(num);
+		sorted_angle_buf.resize(num);
+		for(int i=0; i<num; i++) {
+			sorted_buf[i] = merge_buf[order[i]];
+			sorted_angle_buf[i] = angle_buf[order[i]];
+		}
+
+		begin_billboards(*psys[0]->psys_params, false);
+		draw_vbuf(GL_QUADS, build_quads(&sorted_buf[0], num, &sorted_angle_buf[0]));
+		glPopAttrib();
+	}
+
+	for(int i=0; i<count; i++) {
+		psys[i]->draw_halo();
+	}
+}
+
+// sets up the render state for drawing billboards, pushes GL attributes
+static void begin_billboards(const ParticleSysParams &prm, bool psprites)
+{
+	glPushAttrib(GL_ENABLE_BIT | GL_TEXTURE_BIT | GL_COLOR_BUFFER_BIT |
+			GL_DEPTH_BUFFER_BIT | GL_POINT_BIT);
+
+	glDisable(GL_LIGHTING);
+	glDepthMask(0);
+	glEnable(GL_BLEND);
+	glBlendFunc(prm.src_blend, prm.dest_blend);
+
+	if(prm.billboard_tex) {
+		if(get_mat_bind_mask() & MAT_BIND_TEXTURE) {
+			prm.billboard_tex->bind();
+		}
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		if(psprites) {
+			glEnable(GL_POINT_SPRITE_ARB);
+			glTexEnvi(GL_POINT_SPRITE_ARB, GL_COORD_REPLACE_ARB, 1);
+		}
+	}
+}
 
-			default:
-				error("Only billboarded particles implemented currently");
-				return;
-			}
+// fills the vertex stream with one vertex per particle, for point sprites
+static int build_points(const Particle * const *plist, int count)
+{
+	if((int)vbuf.size() < count) {
+		vbuf.resize(count);
+	}
 
-			if(!p) continue;
+	PVertex *vptr = &vbuf[0];
+	for(int i=0; i<count; i++) {
+		const BillboardParticle *p = (const BillboardParticle*)plist[i];
+		Vector3 pos = p->get_position();
+
+		vptr->x = pos.x;
+		vptr->y = pos.y;
+		vptr->z = pos.z;
+		vptr->u = vptr->v = 0.0f;
+		vptr->r = p->col.x;
+		vptr->g = p->col.y;
+		vptr->b = p->col.z;
+		vptr->a = p->col.w;
+		vptr++;
+	}
+	return count;
+}
 
-			num_particles++;
+/* fills the vertex stream with camera-facing quads, 4 vertices per particle.
+ * If angles is not null, the texture coordinates of each quad are rotated by
+ * the corresponding angle, instead of using a common texture matrix.
+ */
+static int build_quads(const Particle * const *plist, int count, const float *angles)
+{
+	static const float quad_u[] = {0, 1, 1, 0};
+	static const float quad_v[] = {0, 0, 1, 1};
+	static const float quad_x[] = {-1, 1, 1, -1};
+	static const float quad_y[] = {-1, -1, 1, 1};
 
-			Vector3 offset = psys_params.spawn_offset();
-			/*
-			if(psys_params.spawn_offset_curve) {
-				float t = psys_params.spawn_offset_curve_area();
-				offset += (*psys_params.spawn_offset_curve)(t);
-			}
-			*/
-			// XXX: correct this rotation to span the whole interval
-			Quaternion rot = get_rotation();
-			p->set_position(pos + offset.transformed(rot));
-			p->set_rotation(rot);
-			p->set_scaling(get_scaling());
-
-			p->size_start = psys_params.psize();
-			if(psys_params.psize_end < 0.0) {
-				p->size_end = p->size_start;
-			} else {
-				p->size_end = psys_params.psize_end;
-			}
+	if((int)vbuf.size() < count * 4) {
+		vbuf.resize(count * 4);
+	}
 
-			// XXX: correct this next rotation to span the interval
-			p->velocity = psys_params.shoot_dir().transformed(rot);
-			p->friction = psys_params.friction;
-			p->birth_time = t;
-			p->lifespan = psys_params.lifespan();
+	/* the object-space right and up vectors are the first two rows of the
+	 * upper 3x3 part of the modelview matrix, divided by their squared length
+	 * to undo any uniform scaling (the same thing draw_point does by loading
+	 * an identity rotation part).
+	 */
+	float m[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, m);
 
-			particles.push_back(p);
+	Vector3 right(m[0], m[4], m[8]);
+	Vector3 up(m[1], m[5], m[9]);
+	right /= right.length_sq();
+	up /= up.length_sq();
 
-			pos += dp;
-			t += dt;
-		}
-	}
+	PVertex *vptr = &vbuf[0];
+	for(int i=0; i<count; i++) {
+		const BillboardParticle *p = (const BillboardParticle*)plist[i];
+		Vector3 pos = p->get_position();
+		float sz = p->size / PSPRITE_BILLBOARD_RATIO;
 
+		Vector3 dx = right * sz;
+		Vector3 dy = up * sz;
 
-	// update particles
-	std::list<Particle*>::iterator iter = particles.begin();
-	while(iter != particles.end()) {
-		Particle *p = *iter;
-		int i = 0;
-		while(p->alive() && i++ < updates_missed) {
-			p->update(psys_params.gravity);
+		float cos_a = 1.0f, sin_a = 0.0f;
+		if(angles) {
+			cos_a = cos(angles[i]);
+			sin_a = sin(angles[i]);
 		}
 
-		if(p->alive()) {
-			iter++;
-		} else {
-			delete_particle(*iter);
-			iter = particles.erase(iter);
-			num_particles--;
+		for(int j=0; j<4; j++) {
+			Vector3 vpos = pos + dx * quad_x[j] + dy * quad_y[j];
+			vptr->x = vpos.x;
+			vptr->y = vpos.y;
+			vptr->z = vpos.z;
+
+			// rotate the texture coordinates around the center of the texture
+			float u = quad_u[j] - 0.5f;
+			float v = quad_v[j] - 0.5f;
+			vptr->u = cos_a * u - sin_a * v + 0.5f;
+			vptr->v = sin_a * u + cos_a * v + 0.5f;
+
+			vptr->r = p->col.x;
+			vptr->g = p->col.y;
+			vptr->b = p->col.z;
+			vptr->a = p->col.w;
+			vptr++;
 		}
 	}
-
-	prev_update = global_time;
-	prev_pos = curr_pos;
+	return count * 4;
 }
 
-void ParticleSystem::draw() const
+static void draw_vbuf(unsigned int prim, int count)
 {
-	if(!ready || !visible) return;
+	if(!count) return;
 
-	// use point sprites if the system supports them AND we don't need big particles
-	use_psprites = !psys_params.big_particles && !psprites_unsupported;
+	glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
 
-	// particles are volatile if they rotate OR they fluctuate in size
-	volatile_particles = psys_params.rot > SMALL_NUMBER || psys_params.psize.range > SMALL_NUMBER;
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
 
-	std::list<Particle*>::const_iterator iter = particles.begin();
-	if(iter != particles.end()) {
+	glVertexPointer(3, GL_FLOAT, sizeof(PVertex), &vbuf[0].x);
+	glTexCoordPointer(2, GL_FLOAT, sizeof(PVertex), &vbuf[0].u);
+	glColorPointer(4, GL_FLOAT, sizeof(PVertex), &vbuf[0].r);
 
-		if(ptype == PTYPE_BILLBOARD) {
-			// ------ setup render state ------
-			glPushAttrib(GL_ENABLE_BIT | GL_TEXTURE_BIT | GL_COLOR_BUFFER_BIT |
-					GL_DEPTH_BUFFER_BIT | GL_POINT_BIT);
-
-			glDisable(GL_LIGHTING);
-			glDepthMask(0);
-			glEnable(GL_BLEND);
-			glBlendFunc(psys_params.src_blend, psys_params.dest_blend);
-
-			if(psys_params.billboard_tex) {
-				if(get_mat_bind_mask() & MAT_BIND_TEXTURE) {
-					psys_params.billboard_tex->bind();
-				}
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glDrawArrays(prim, 0, count);
 
-				if(use_psprites) {
-					glEnable(GL_POINT_SPRITE_ARB);
-					glTexEnvi(GL_POINT_SPRITE_ARB, GL_COORD_REPLACE_ARB, 1);
-				}
+	glPopClientAttrib();
+}
 
-				if(!volatile_particles) {
-					Matrix4x4 prot;
-					prot.translate(Vector3(0.5, 0.5, 0.0));
-					prot.rotate(Vector3(0.0, 0.0, curr_rot));
-					prot.translate(Vector3(-0.5, -0.5, 0.0));
+// returns the particles re-ordered back to front, for the current modelview matrix
+static const Particle * const *depth_order(const Particle * const *plist, int count)
+{
+	const unsigned int *order = sort_depth(plist, count);
 
-					glMatrixMode(GL_TEXTURE);
-					glPushMatrix();
-					load_matrix(prot);
-				}
-			}
+	sorted_buf.resize(count);
+	for(int i=0; i<count; i++) {
+		sorted_buf[i] = plist[order[i]];
+	}
+	return &sorted_buf[0];
+}
 
-			if(use_psprites && !volatile_particles) {
-				glPointSize((*iter)->size);
-				glBegin(GL_POINTS);
-			}
-		}
+/* calculates the view-space depth of each particle, and returns the order
+ * which sorts them back to front.
+ */
+static const unsigned int *sort_depth(const Particle * const *plist, int count)
+{
+	if((int)depth_buf.size() < count) {
+		depth_buf.resize(count);
+	}
 
-		// ------ render particles ------
-		while(iter != particles.end()) {
-			(*iter++)->draw();
-		}
+	float m[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, m);
 
-		if(ptype == PTYPE_BILLBOARD) {
-			// ------ restore render states -------
-			if(use_psprites) {
-				if(!volatile_particles) glEnd();
-			}
+	/* we're looking down -Z in view space, so the farthest particle has the
+	 * lowest z, and ascending z order is back to front.
+	 */
+	for(int i=0; i<count; i++) {
+		Vector3 pos = plist[i]->get_position();
+		depth_buf[i] = m[2] * pos.x + m[6] * pos.y + m[10] * pos.z + m[14];
+	}
 
-			if(psys_params.billboard_tex && !volatile_particles) {
-				glMatrixMode(GL_TEXTURE);
-				glPopMatrix();
-			}
-			glPopAttrib();
+	return radix_sort(&depth_buf[0], count);
+}
+
+void henge::update_psys(ParticleSystem * const *psys, int count)
+{
+	/* evaluate the emitter transformations serially first, so that the
+	 * workers never evaluate any shared parent nodes (and their tracks).
+	 */
+	for(int i=0; i<count; i++) {
+		psys[i]->eval_emitter();
+		psys[i]->emitter_valid = true;
+
+		// likewise (re)build any shared collision sets
+		CollisionSet *coll = psys[i]->get_colliders();
+		if(coll && !coll->is_valid()) {
+			coll->build(global_msec);
 		}
 	}
 
-	// ------ render a halo around the emitter if we need to ------
-	if(psys_params.halo) {
-		// construct texture matrix for halo rotation
-		Matrix4x4 mat;
-		mat.translate(Vector3(0.5, 0.5, 0.0));
-		mat.rotate(Vector3(0, 0, curr_halo_rot));
-		mat.translate(Vector3(-0.5, -0.5, 0.0));
+	get_thread_pool()->run(update_job, count, (void*)psys);
+}
 
-		glMatrixMode(GL_TEXTURE);
-		glPushMatrix();
-		load_matrix(mat);
+void henge::draw_psys(ParticleSystem * const *psys, int count)
+{
+	static vector<ParticleSystem*> sorted;
+	sorted.clear();
 
-		glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	for(int i=0; i<count; i++) {
+		ParticleSystem *ps = psys[i];
+		if(!ps->ready || !ps->visible) continue;
 
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+		if(ps->psys_params->depth_sort && ps->ptype == PTYPE_BILLBOARD) {
+			sorted.push_back(ps);
+		} else {
+			ps->draw();
+		}
+	}
 
-		psys_params.halo->bind();
+	if(sorted.empty()) return;
 
-		glDepthMask(0);
+	// group the depth-sorted systems by texture and blending mode
+	stable_sort(sorted.begin(), sorted.end(), ParticleSystem::draw_state_less);
 
-		float sz = psys_params.halo_size() / PSPRITE_BILLBOARD_RATIO;
-		draw_point(curr_pos, psys_params.halo_color, sz);
+	size_t start = 0;
+	for(size_t i=1; i<=sorted.size(); i++) {
+		if(i == sorted.size() || ParticleSystem::draw_state_less(sorted[start], sorted[i])) {
+			ParticleSystem::draw_merged(&sorted[start], (int)(i - start));
+			start = i;
+		}
+	}
+}
 
-		glPopAttrib();
+bool ParticleSystem::draw_state_less(const ParticleSystem *a, const ParticleSystem *b)
+{
+	const ParticleSysParams *pa = a->psys_params;
+	const ParticleSysParams *pb = b->psys_params;
 
-		glMatrixMode(GL_TEXTURE);
-		glPopMatrix();
+	if(pa->billboard_tex != pb->billboard_tex) {
+		return pa->billboard_tex < pb->billboard_tex;
+	}
+	if(pa->src_blend != pb->src_blend) {
+		return pa->src_blend < pb->src_blend;
 	}
+	return pa->dest_blend < pb->dest_blend;
+}
+
+static void update_job(int idx, void *cls)
+{
+	ParticleSystem * const *psys = (ParticleSystem * const*)cls;
+	psys[idx]->update();
 }
 
 void henge::set_psys_max_mempool(int max_free)
@@ -538,6 +1762,24 @@ void henge::draw_point(const Vector3 &p, const Color &col, float size)
 
 static unsigned int get_blend_factor(const char *str);
 
+/* binary particle files start with the magic number as a native 32bit
+ * integer, followed by the format version, the integer and floating point
+ * parameters (see pack_params), and the names of the textures and the
+ * sub-emitter particle file as a 32bit length and the characters.
+ */
+#define PSYS_BIN_MAGIC		0x48505342	// "HPSB"
+#define PSYS_BIN_MAGIC_SWAP	0x42535048
+#define PSYS_BIN_VERSION	1
+
+#define PSYS_BIN_INTS		6
+#define PSYS_BIN_FLOATS		43
+
+static bool read_binary(ParticleSysParams *prm, FILE *fp, const char *fname);
+static void pack_params(const ParticleSysParams *prm, int32_t *ival, float *fval);
+static void unpack_params(ParticleSysParams *prm, const int32_t *ival, const float *fval);
+static bool write_string(FILE *fp, const char *str);
+static bool read_string(FILE *fp, std::string *str);
+
 
 ParticleSysParams::ParticleSysParams()
 {
@@ -549,9 +1791,12 @@ ParticleSysParams::ParticleSysParams()
 	glob_rot = 0.0;
 	halo_rot = 0.0;
 	big_particles = false;
+	depth_sort = false;
 	max_active_particles = -1;
-	//spawn_offset_curve = 0;
-	//spawn_offset_curve_area = FuzzyVal(0.5, 1.0);
+	collision = COLL_NONE;
+	restitution = 0.5;
+	mesh = 0;
+	spawn_shape = 0;
 
 	start_color = end_color = halo_color = Color(1, 1, 1, 1);
 
@@ -569,6 +1814,25 @@ bool ParticleSysParams::load(const char *fname)
 	Vector3 tmp_shoot, tmp_shoot_range;
 	Vector3 tmp_spawn_off, tmp_spawn_off_range;
 
+	FILE *fp = fopen(fname, "rb");
+	if(!fp) {
+		return false;
+	}
+	uint32_t magic;
+	if(fread(&magic, sizeof magic, 1, fp) == 1) {
+		if(magic == PSYS_BIN_MAGIC) {
+			bool res = read_binary(this, fp, fname);
+			fclose(fp);
+			return res;
+		}
+		if(magic == PSYS_BIN_MAGIC_SWAP) {
+			error("%s: binary particle file of the wrong byte order\n", fname);
+			fclose(fp);
+			return false;
+		}
+	}
+	fclose(fp);
+
 	ConfigFile cfg;
 	if(!(cfg.read(fname))) {
 		return false;
@@ -654,6 +1918,30 @@ bool ParticleSysParams::load(const char *fname)
 			big_particles = true;
 		}
 	}
+	if(cfg.getopt("depth_sort", &str)) {
+		if(str == "true") {
+			depth_sort = true;
+		}
+	}
+	if(cfg.getopt("collision", &str)) {
+		if(str == "bounce") {
+			collision = COLL_BOUNCE;
+		} else if(str == "kill") {
+			collision = COLL_KILL;
+		} else if(str == "stick") {
+			collision = COLL_STICK;
+		} else if(str == "none") {
+			collision = COLL_NONE;
+		} else {
+			warning("%s: invalid collision response: %s\n", fname, str.c_str());
+		}
+	}
+	if(cfg.getopt("restitution", &val)) {
+		restitution = val;
+	}
+	if(cfg.getopt("sub_psys", &str)) {
+		sub_psys = str;
+	}
 	if(cfg.getopt("blend_src", &str)) {
 		unsigned int factor = get_blend_factor(str.c_str());
 		if(factor != 0xbadbad) {
@@ -666,8 +1954,11 @@ bool ParticleSysParams::load(const char *fname)
 			dest_blend = factor;
 		}
 	}
-	if(cfg.getopt("spawn_offset_curve", &str)) {
-		// TODO load curve...
+	if(cfg.getopt("normal_speed", &val)) {
+		normal_speed.num = val;
+	}
+	if(cfg.getopt("normal_speed-r", &val)) {
+		normal_speed.range = val;
 	}
 
 
@@ -681,6 +1972,248 @@ bool ParticleSysParams::load(const char *fname)
 	return true;
 }
 
+bool ParticleSysParams::save_binary(const char *fname) const
+{
+	FILE *fp = fopen(fname, "wb");
+	if(!fp) {
+		error("failed to open %s for writing\n", fname);
+		return false;
+	}
+
+	uint32_t hdr[2] = {PSYS_BIN_MAGIC, PSYS_BIN_VERSION};
+	int32_t ival[PSYS_BIN_INTS];
+	float fval[PSYS_BIN_FLOATS];
+	pack_params(this, ival, fval);
+
+	const char *tex_name = billboard_tex ? get_texture_name(billboard_tex) : 0;
+	const char *halo_name = halo ? get_texture_name(halo) : 0;
+
+	bool res = fwrite(hdr, sizeof hdr, 1, fp) == 1 &&
+		fwrite(ival, sizeof ival, 1, fp) == 1 &&
+		fwrite(fval, sizeof fval, 1, fp) == 1 &&
+		write_string(fp, tex_name) &&
+		write_string(fp, halo_name) &&
+		write_string(fp, sub_psys.c_str());
+	fclose(fp);
+
+	if(!res) {
+		error("failed to write binary particle file: %s\n", fname);
+	}
+	return res;
+}
+
+// called with the file position right after the magic number
+static bool read_binary(ParticleSysParams *prm, FILE *fp, const char *fname)
+{
+	uint32_t version;
+	int32_t ival[PSYS_BIN_INTS];
+	float fval[PSYS_BIN_FLOATS];
+	string tex_name, halo_name, sub_psys;
+
+	if(fread(&version, sizeof version, 1, fp) < 1) {
+		error("%s: unexpected end of file\n", fname);
+		return false;
+	}
+	if(version != PSYS_BIN_VERSION) {
+		error("%s: unsupported binary particle file version: %u\n", fname, (unsigned int)version);
+		return false;
+	}
+
+	if(fread(ival, sizeof ival, 1, fp) < 1 || fread(fval, sizeof fval, 1, fp) < 1 ||
+			!read_string(fp, &tex_name) || !read_string(fp, &halo_name) ||
+			!read_string(fp, &sub_psys)) {
+		error("%s: unexpected end of file\n", fname);
+		return false;
+	}
+
+	unpack_params(prm, ival, fval);
+	prm->billboard_tex = tex_name.empty() ? 0 : get_texture(tex_name.c_str());
+	prm->halo = halo_name.empty() ? 0 : get_texture(halo_name.c_str());
+	prm->sub_psys = sub_psys;
+	return true;
+}
+
+/* packs the parameters into the arrays written to binary files. The order
+ * must match unpack_params.
+ */
+static void pack_params(const ParticleSysParams *prm, int32_t *ival, float *fval)
+{
+	ival[0] = prm->src_blend;
+	ival[1] = prm->dest_blend;
+	ival[2] = prm->big_particles;
+	ival[3] = prm->depth_sort;
+	ival[4] = prm->max_active_particles;
+	ival[5] = prm->collision;
+
+	float *f = fval;
+	*f++ = prm->psize.num;
+	*f++ = prm->psize.range;
+	*f++ = prm->psize_end;
+	*f++ = prm->lifespan.num;
+	*f++ = prm->lifespan.range;
+	*f++ = prm->birth_rate.num;
+	*f++ = prm->birth_rate.range;
+	for(int i=0; i<3; i++) {
+		*f++ = prm->gravity[i];
+		*f++ = prm->shoot_dir[i].num;
+		*f++ = prm->shoot_dir[i].range;
+		*f++ = prm->spawn_offset[i].num;
+		*f++ = prm->spawn_offset[i].range;
+	}
+	*f++ = prm->friction;
+	*f++ = prm->normal_speed.num;
+	*f++ = prm->normal_speed.range;
+	for(int i=0; i<4; i++) {
+		*f++ = prm->start_color[i];
+		*f++ = prm->end_color[i];
+		*f++ = prm->halo_color[i];
+	}
+	*f++ = prm->rot;
+	*f++ = prm->glob_rot;
+	*f++ = prm->halo_size.num;
+	*f++ = prm->halo_size.range;
+	*f++ = prm->halo_rot;
+	*f++ = prm->restitution;
+}
+
+// the inverse of pack_params
+static void unpack_params(ParticleSysParams *prm, const int32_t *ival, const float *fval)
+{
+	prm->src_blend = ival[0];
+	prm->dest_blend = ival[1];
+	prm->big_particles = ival[2] != 0;
+	prm->depth_sort = ival[3] != 0;
+	prm->max_active_particles = ival[4];
+	prm->collision = (CollisionResponse)ival[5];
+
+	const float *f = fval;
+	prm->psize.num = *f++;
+	prm->psize.range = *f++;
+	prm->psize_end = *f++;
+	prm->lifespan.num = *f++;
+	prm->lifespan.range = *f++;
+	prm->birth_rate.num = *f++;
+	prm->birth_rate.range = *f++;
+
+	FuzzyVal shoot[3], spawn_off[3];
+	for(int i=0; i<3; i++) {
+		prm->gravity[i] = *f++;
+		shoot[i].num = *f++;
+		shoot[i].range = *f++;
+		spawn_off[i].num = *f++;
+		spawn_off[i].range = *f++;
+	}
+	prm->shoot_dir = FuzzyVec3(shoot[0], shoot[1], shoot[2]);
+	prm->spawn_offset = FuzzyVec3(spawn_off[0], spawn_off[1], spawn_off[2]);
+
+	prm->friction = *f++;
+	prm->normal_speed.num = *f++;
+	prm->normal_speed.range = *f++;
+	for(int i=0; i<4; i++) {
+		prm->start_color[i] = *f++;
+		prm->end_color[i] = *f++;
+		prm->halo_color[i] = *f++;
+	}
+	prm->rot = *f++;
+	prm->glob_rot = *f++;
+	prm->halo_size.num = *f++;
+	prm->halo_size.range = *f++;
+	prm->halo_rot = *f++;
+	prm->restitution = *f++;
+}
+
+static bool write_string(FILE *fp, const char *str)
+{
+	uint32_t len = str ? (uint32_t)strlen(str) : 0;
+	if(fwrite(&len, sizeof len, 1, fp) < 1) {
+		return false;
+	}
+	return !len || fwrite(str, len, 1, fp) == 1;
+}
+
+static bool read_string(FILE *fp, std::string *str)
+{
+	uint32_t len;
+	if(fread(&len, sizeof len, 1, fp) < 1) {
+		return false;
+	}
+	str->resize(len);
+	return !len || fread(&(*str)[0], len, 1, fp) == 1;
+}
+
+
+/* ---- parameter cache ----
+ * Only used from the main thread, while loading particle systems.
+ */
+struct PCacheEntry {
+	ParticleSysParams *prm;
+	int refs;
+};
+
+static map<string, PCacheEntry> pcache;
+static map<const ParticleSysParams*, string> pcache_names;
+
+const ParticleSysParams *henge::get_psys_params(const char *fname)
+{
+	map<string, PCacheEntry>::iterator it = pcache.find(fname);
+	if(it != pcache.end()) {
+		it->second.refs++;
+		return it->second.prm;
+	}
+
+	ParticleSysParams *prm = new ParticleSysParams;
+	if(!prm->load(fname)) {
+		delete prm;
+		return 0;
+	}
+
+	PCacheEntry ent;
+	ent.prm = prm;
+	ent.refs = 1;
+	pcache[fname] = ent;
+	pcache_names[prm] = fname;
+	return prm;
+}
+
+static void add_psys_params_ref(const ParticleSysParams *prm)
+{
+	map<const ParticleSysParams*, string>::iterator it = pcache_names.find(prm);
+	if(it != pcache_names.end()) {
+		pcache[it->second].refs++;
+	}
+}
+
+void henge::release_psys_params(const ParticleSysParams *prm)
+{
+	map<const ParticleSysParams*, string>::iterator it = pcache_names.find(prm);
+	if(it == pcache_names.end()) {
+		return;
+	}
+
+	PCacheEntry *ent = &pcache[it->second];
+	if(ent->refs > 0) {
+		ent->refs--;
+	}
+}
+
+/* entries still referenced by particle systems are left alone, so this
+ * only frees the parameters nobody uses any more.
+ */
+void henge::clear_psys_params_cache()
+{
+	map<string, PCacheEntry>::iterator it = pcache.begin();
+	while(it != pcache.end()) {
+		if(it->second.refs > 0) {
+			++it;
+			continue;
+		}
+		pcache_names.erase(it->second.prm);
+		delete it->second.prm;
+		pcache.erase(it++);
+	}
+}
+
+
 static struct {
 	const char *name;
 	unsigned int factor;
@@ -707,36 +2240,243 @@ static unsigned int get_blend_factor(const char *str)
 }
 
 // ---- particle memory allocator ----
-static std::list<Particle*> free_list;
-static size_t free_list_size;
+
+/* particles are allocated in slabs of PSYS_SLAB_SIZE. Each slab keeps an
+ * intrusive list of its free particles, linked through Particle::pool_next,
+ * and slabs with free particles are kept in a doubly linked list, so both
+ * allocation and deallocation are O(1) and don't touch the heap in the
+ * steady state. There's a separate list of slabs for each particle class.
+ */
+#define PSYS_SLAB_SIZE		256
+
+struct PPool;
+
+struct PSlab {
+	Particle *part;		// array of PSYS_SLAB_SIZE particles of the pool's class
+	Particle *free_list;
+	int num_free;
+	PSlab *prev, *next;
+	PPool *pool;
+};
+
+struct PPool {
+	PSlab *partial_slabs;	// slabs with at least one free particle
+
+	// create and destroy the particle arrays of the slabs
+	Particle *(*new_array)(PSlab *slab);
+	void (*delete_array)(Particle *arr);
+};
+
+template <class T> static Particle *new_particle_array(PSlab *slab);
+template <class T> static void delete_particle_array(Particle *arr);
+
+static PPool billboard_pool = {
+	0, new_particle_array<BillboardParticle>, delete_particle_array<BillboardParticle>
+};
+static PPool mesh_pool = {
+	0, new_particle_array<MeshParticle>, delete_particle_array<MeshParticle>
+};
+
+static int num_free;			// free particles in all the slabs
 static int active_particles;
 
+/* particle systems are updated in parallel, so the pool is protected by a
+ * mutex. Systems allocate and release particles a batch at a time (see
+ * alloc_particles/free_particles), so it's locked once per batch.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Particle *pool_alloc(PPool *pool);
+static void pool_free(Particle *p);
+
+static void link_slab(PSlab *slab)
+{
+	PPool *pool = slab->pool;
+
+	slab->prev = 0;
+	slab->next = pool->partial_slabs;
+	if(pool->partial_slabs) {
+		pool->partial_slabs->prev = slab;
+	}
+	pool->partial_slabs = slab;
+}
+
+static void unlink_slab(PSlab *slab)
+{
+	if(slab->prev) {
+		slab->prev->next = slab->next;
+	} else {
+		slab->pool->partial_slabs = slab->next;
+	}
+	if(slab->next) {
+		slab->next->prev = slab->prev;
+	}
+	slab->prev = slab->next = 0;
+}
+
+// builds the free list through the particles of the new slab
+template <class T>
+static Particle *new_particle_array(PSlab *slab)
+{
+	T *arr = new T[PSYS_SLAB_SIZE];
+
+	slab->free_list = 0;
+	for(int i=PSYS_SLAB_SIZE-1; i>=0; i--) {
+		arr[i].pool_slab = slab;
+		arr[i].pool_next = slab->free_list;
+		slab->free_list = arr + i;
+	}
+	return arr;
+}
+
+template <class T>
+static void delete_particle_array(Particle *arr)
+{
+	delete [] (T*)arr;
+}
+
+static PSlab *new_slab(PPool *pool)
+{
+	PSlab *slab;
+	try {
+		slab = new PSlab;
+		slab->part = pool->new_array(slab);
+	}
+	catch(...) {
+		return 0;
+	}
+
+	slab->num_free = PSYS_SLAB_SIZE;
+	slab->pool = pool;
+	num_free += PSYS_SLAB_SIZE;
+
+	link_slab(slab);
+	return slab;
+}
+
+static void delete_slab(PSlab *slab)
+{
+	slab->pool->delete_array(slab->part);
+	delete slab;
+}
+
 static Particle *new_particle()
+{
+	pthread_mutex_lock(&pool_lock);
+	Particle *p = pool_alloc(&billboard_pool);
+	pthread_mutex_unlock(&pool_lock);
+	return p;
+}
+
+static Particle *new_mesh_particle()
+{
+	pthread_mutex_lock(&pool_lock);
+	Particle *p = pool_alloc(&mesh_pool);
+	pthread_mutex_unlock(&pool_lock);
+	return p;
+}
+
+static void delete_particle(Particle *p)
+{
+	pthread_mutex_lock(&pool_lock);
+	pool_free(p);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* allocates up to count particles into dest, returns the number allocated.
+ * For the default allocators the pool is locked once for the whole batch.
+ */
+static int alloc_particles(Particle *(*part_alloc)(), Particle **dest, int count)
+{
+	int num = 0;
+
+	PPool *pool = 0;
+	if(part_alloc == new_particle) {
+		pool = &billboard_pool;
+	} else if(part_alloc == new_mesh_particle) {
+		pool = &mesh_pool;
+	}
+
+	if(pool) {
+		pthread_mutex_lock(&pool_lock);
+		while(num < count && (dest[num] = pool_alloc(pool))) {
+			num++;
+		}
+		pthread_mutex_unlock(&pool_lock);
+	} else {
+		for(int i=0; i<count; i++) {
+			if((dest[num] = part_alloc())) {
+				num++;
+			}
+		}
+	}
+	return num;
+}
+
+static void free_particles(void (*part_free)(Particle*), Particle **parr, int count)
+{
+	if(count <= 0) return;
+
+	if(part_free == delete_particle) {
+		pthread_mutex_lock(&pool_lock);
+		for(int i=0; i<count; i++) {
+			pool_free(parr[i]);
+		}
+		pthread_mutex_unlock(&pool_lock);
+	} else {
+		for(int i=0; i<count; i++) {
+			part_free(parr[i]);
+		}
+	}
+}
+
+static Particle *pool_alloc(PPool *pool)
 {
 	if(max_active_particles >= 0 && active_particles >= max_active_particles) {
 		return 0;
 	}
 
-	Particle *p;
-	if(free_list.empty()) {
-		p = new BillboardParticle;
-	} else {
-		p = *free_list.begin();
-		free_list.erase(free_list.begin());
-		p->reset();	// re-initialize everything
-		free_list_size--;
+	if(!pool->partial_slabs && !new_slab(pool)) {
+		return 0;
+	}
+	PSlab *slab = pool->partial_slabs;
+
+	Particle *p = slab->free_list;
+	slab->free_list = p->pool_next;
+	p->pool_next = 0;
+	p->reset();	// re-initialize everything
+
+	num_free--;
+	if(--slab->num_free == 0) {
+		unlink_slab(slab);
 	}
 
 	active_particles++;
 	return p;
 }
 
-static void delete_particle(Particle *p)
+static void pool_free(Particle *p)
 {
-	if(free_list_size < MAX_FREE_LIST_SIZE) {
-		free_list.push_front(p);
-		free_list_size++;
-	} else {
+	PSlab *slab = (PSlab*)p->pool_slab;
+	if(!slab) {
+		// not allocated by the pool
 		delete p;
+		return;
+	}
+
+	if(!slab->free_list) {
+		link_slab(slab);	// it was full, now it has a free particle
+	}
+	p->pool_next = slab->free_list;
+	slab->free_list = p;
+	slab->num_free++;
+	num_free++;
+	active_particles--;
+
+	// give back completely free slabs, if we keep too many free particles around
+	if(slab->num_free == PSYS_SLAB_SIZE && num_free > max_free_list_size) {
+		unlink_slab(slab);
+		num_free -= PSYS_SLAB_SIZE;
+		delete_slab(slab);
 	}
 }
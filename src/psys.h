@@ -1,14 +1,38 @@
 #ifndef HENGE_PSYS_H_
 #define HENGE_PSYS_H_
 
-#include <list>
+#include <vector>
+#include <string>
 #include "texture.h"
 #include "color.h"
 #include "anim.h"
+#include "bounds.h"
+#include "int_types.h"
 #include "vmath.h"
 
 namespace henge {
 
+/* fast pseudo-random number generator (xoshiro128+)
+ * Each particle system owns one, so emission doesn't go through the global
+ * rand() state, and is reproducible for a given seed.
+ */
+class RandGen {
+private:
+	uint32_t s[4];
+
+public:
+	RandGen(uint32_t seed = 0);
+
+	void seed(uint32_t seed);
+
+	uint32_t next();
+	float frand();				// [0, 1)
+	float frand(float range);	// [0, range)
+
+	// fills an array with count random values in [0, 1)
+	void frand(float *dest, int count);
+};
+
 /* fuzzy scalar values
  * random variables defined as a range of values around a central,
  * with equiprobable distrubution function
@@ -19,6 +43,13 @@ public:
 
 	FuzzyVal(float num = 0.0, float range = 0.0);
 	float operator()() const;
+	float operator()(RandGen *rng) const;
+
+	// fills an array with count samples drawn from rng
+	void generate(float *dest, int count, RandGen *rng) const;
+
+	float get_max() const;
+	float get_abs_max() const;	// largest possible magnitude
 };
 
 /* TODO: make a fuzzy direction with polar coordinates, so the random
@@ -33,6 +64,14 @@ private:
 public:
 	FuzzyVec3(const FuzzyVal &x = FuzzyVal(), const FuzzyVal &y = FuzzyVal(), const FuzzyVal &z = FuzzyVal());
 	Vector3 operator()() const;
+	Vector3 operator()(RandGen *rng) const;
+
+	// fills an array with count samples drawn from rng
+	void generate(Vector3 *dest, int count, RandGen *rng) const;
+
+	Vector3 get_abs_max() const;
+
+	const FuzzyVal &operator[](int idx) const;
 };
 
 
@@ -46,6 +85,9 @@ public:
 	float size, size_start, size_end;
 	float birth_time, lifespan;
 
+	// used by the particle memory pool (intrusive free list)
+	Particle *pool_next;
+	void *pool_slab;
 
 	Particle();
 	Particle(const Vector3 &pos, const Vector3 &vel, float friction, float lifespan);
@@ -55,7 +97,10 @@ public:
 
 	virtual bool alive() const;
 
-	virtual void update(const Vector3 &ext_force = Vector3());
+	/* advances the particle by the specified number of timeslices at once,
+	 * the cost is the same regardless of the number of steps.
+	 */
+	virtual void update(const Vector3 &ext_force = Vector3(), int steps = 1);
 	virtual void draw() const = 0;
 };
 
@@ -71,18 +116,46 @@ public:
 
 	virtual ~BillboardParticle();
 
-	virtual void update(const Vector3 &ext_force = Vector3());
+	virtual void update(const Vector3 &ext_force = Vector3(), int steps = 1);
 	virtual void draw() const;
 };
 
-/* TODO: draws a 3D object in the position of the particle
- * note that rotational and such controllers also apply for each
- * of the particles seperately
+class TriMesh;
+
+/* draws a 3D object in the position of the particle, spinning around its
+ * own axis and scaled by the particle size. Particle systems draw all their
+ * mesh particles together, instanced where possible (see draw_psys).
  */
 class MeshParticle : public Particle {
+public:
+	const TriMesh *mesh;
+	Color start_color, end_color;
+	Vector3 axis;
+	float rot, birth_angle;
+
+	Color col;
+	float angle;
+
+	virtual ~MeshParticle();
+
+	Matrix4x4 get_instance_matrix() const;
+
+	virtual void update(const Vector3 &ext_force = Vector3(), int steps = 1);
+	virtual void draw() const;
 };
 
 
+class CollisionSet;
+class EmitShape;
+
+// what happens to particles hitting a collider
+enum CollisionResponse {
+	COLL_NONE,		// collisions aren't checked at all
+	COLL_BOUNCE,	// reflect off the surface, see ParticleSysParams::restitution
+	COLL_KILL,		// die on impact
+	COLL_STICK		// stop at the point of impact
+};
+
 struct ParticleSysParams {
 	FuzzyVal psize;				// particle size
 	float psize_end;			// end size (end of life)
@@ -92,8 +165,8 @@ struct ParticleSysParams {
 	FuzzyVec3 shoot_dir;		// shoot direction (initial particle velocity)
 	float friction;				// friction of the environment
 	FuzzyVec3 spawn_offset;		// where to spawn in relation to position
-	//Curve *spawn_offset_curve;	// a spawn curve in space, relative to position, offset still counts
-	//FuzzyVal spawn_offset_curve_area;
+	const EmitShape *spawn_shape;	// mesh surface or curve to spawn on, relative to position, offset still counts
+	FuzzyVal normal_speed;		// initial speed along the spawn shape normal, added to shoot_dir
 	Texture *billboard_tex;		// texture used for billboards
 	Color start_color;			// start color
 	Color end_color;			// end color
@@ -108,12 +181,37 @@ struct ParticleSysParams {
 	float halo_rot;				// halo rotation (radians / second)
 
 	bool big_particles;			// need support for big particles (i.e. don't use point sprites)
+	bool depth_sort;			// draw particles back to front (for non-additive blending)
 	int max_active_particles;	// hard limit to the active particle count (-1 = no limit)
 
+	CollisionResponse collision;	// response to collisions with the system's colliders
+	float restitution;			// fraction of the normal velocity kept when bouncing
+
+	std::string sub_psys;		// parameter file of the sub-emitters (makes it a PTYPE_PSYS)
+
+	const TriMesh *mesh;		// mesh of PTYPE_MESH particles (not owned), textured with billboard_tex
+
 	ParticleSysParams();
+
+	/* loads either a text particle file, or the binary form written by
+	 * save_binary, which doesn't need any parsing. The mesh and spawn_shape
+	 * pointers are not part of either.
+	 */
 	bool load(const char *fname);
+	bool save_binary(const char *fname) const;
 };
 
+/* shared cache of particle parameter files, so that any number of particle
+ * systems using the same file only parse it once. Each get_psys_params adds
+ * a reference which must be dropped with release_psys_params. Entries are
+ * kept around when the last reference is released, until the cache is
+ * cleared, since the same effects tend to be spawned again and again.
+ * Returns null if the file can't be loaded.
+ */
+const ParticleSysParams *get_psys_params(const char *fname);
+void release_psys_params(const ParticleSysParams *prm);
+void clear_psys_params_cache();
+
 enum ParticleType {PTYPE_PSYS, PTYPE_BILLBOARD, PTYPE_MESH};
 
 /* particle system
@@ -121,6 +219,11 @@ enum ParticleType {PTYPE_PSYS, PTYPE_BILLBOARD, PTYPE_MESH};
  * the particle system is also a particle because it can be emmited by
  * another particle system. This way we get a tree structure of particle
  * emmiters with the leaves being just billboards or mesh-particles.
+ *
+ * In practice the tree is flattened to two levels: the particles of a
+ * PTYPE_PSYS system are plain pooled particles acting as emitters, and all
+ * the particles they emit live in a single array of the parent system,
+ * instead of each emitter being a ParticleSystem of its own.
  */
 class ParticleSystem : public Particle {
 protected:
@@ -129,13 +232,18 @@ protected:
 
 	bool ready;
 	bool psprites_unsupported;
-	std::list<Particle*> particles;
+	std::vector<Particle*> particles;
 	int num_particles;
 
-	ParticleSysParams psys_params;
+	/* parameters shared through the cache (see get_psys_params) are
+	 * copied into own_params the first time anyone asks to modify them.
+	 */
+	const ParticleSysParams *psys_params;
+	ParticleSysParams *own_params;
 	ParticleType ptype;
 
 	float fraction;
+	bool started;		// false until the first update after a reset
 	float prev_update;
 	Vector3 prev_pos;
 
@@ -143,16 +251,64 @@ protected:
 	float curr_time;
 	Vector3 curr_pos;
 	float curr_rot, curr_halo_rot;
+	Quaternion curr_emit_rot;		// world rotation and scaling of the emitter
+	Vector3 curr_emit_scale;
+	bool emitter_valid;		// set by update_psys, which calls eval_emitter serially
+
+	// bounds of the particles alive at the last update
+	AABox part_box;
+
+	CollisionSet *colliders;
+
+	// PTYPE_PSYS: parameters and particles of the sub-emitters
+	ParticleSysParams sub_params;
+	std::vector<Particle*> sub_particles;
+	std::vector<Vector3> emit_pos;
+
+	int spawn_particles(const ParticleSysParams &prm, ParticleType type, std::vector<Particle*> *dest,
+			int count, int max_spawn, const Vector3 &pos0, const Vector3 &pos1, float t0,
+			Vector3 *bmin, Vector3 *bmax);
+	void update_sub_particles(int steps, Vector3 *bmin, Vector3 *bmax);
+	void eval_emitter();
+	void draw_billboards(const Particle * const *plist, int count, const ParticleSysParams &prm) const;
+	void draw_meshes(const Particle * const *plist, int count, const ParticleSysParams &prm) const;
 
 	Particle *(*part_alloc)();
+	void (*part_free)(Particle*);
+
+	void draw_halo() const;
+	static void draw_merged(ParticleSystem * const *psys, int count);
+	static bool draw_state_less(const ParticleSystem *a, const ParticleSystem *b);
+
+	RandGen rng;
+	unsigned int seed;
+
+	ParticleSystem &operator =(const ParticleSystem &psys);	// not implemented
 
 public:
 	ParticleSystem(const char *fname = 0);
+
+	/* copies the configuration of another particle system, sharing its
+	 * parameters if they came from the cache. The copy starts out with no
+	 * particles and its own random seed.
+	 */
+	ParticleSystem(const ParticleSystem &psys);
 	virtual ~ParticleSystem();
 
-	virtual void set_particle_alloc(Particle *(*func)());
+	/* custom particle allocator. If free_func is null, particles are
+	 * released by the default deallocator, which returns particles from the
+	 * slab pool to their slab, and deletes any others.
+	 */
+	virtual void set_particle_alloc(Particle *(*alloc_func)(), void (*free_func)(Particle*) = 0);
 
 	virtual void reset();
+
+	/* seed of the random number stream used for emission. Each new particle
+	 * system gets a different seed by default, reset() rewinds the stream.
+	 */
+	virtual void set_seed(unsigned int seed);
+	virtual unsigned int get_seed() const;
+
 	virtual void set_update_interval(float timeslice);
 
 	virtual void set_active(bool active);
@@ -161,18 +317,67 @@ public:
 	virtual void set_visible(bool vis);
 	virtual bool is_visible() const;
 
+	/* colliders the particles are checked against, if the collision response
+	 * in the parameters isn't COLL_NONE. Not owned by the particle system.
+	 */
+	virtual void set_colliders(CollisionSet *cset);
+	virtual CollisionSet *get_colliders() const;
+
 	virtual void set_params(const ParticleSysParams &psys_params);
+	// makes a private copy of shared parameters, use get_params_const to just look
 	virtual ParticleSysParams *get_params();
+	virtual const ParticleSysParams *get_params_const() const;
 	virtual void set_particle_type(ParticleType ptype);
 
-	virtual void update(const Vector3 &ext_force = Vector3());
+	/* parameters of the particles emitted by each particle of a PTYPE_PSYS
+	 * system. Setting them also sets the particle type to PTYPE_PSYS.
+	 */
+	virtual void set_sub_params(const ParticleSysParams &prm);
+	virtual ParticleSysParams *get_sub_params();
+
+	/* conservative world space bounds at the given time: a box around the
+	 * emitter large enough for anything it can spawn during a lifespan,
+	 * merged with the box of the particles alive at the last update.
+	 */
+	virtual AABox get_bounds(unsigned int msec) const;
+
+	/* A system which isn't updated for a while (e.g. while out of view),
+	 * catches up in a single step on the next update: live particles are
+	 * advanced analytically, and only the particles it would have emitted
+	 * that are still alive by now are spawned.
+	 */
+	virtual void update(const Vector3 &ext_force = Vector3(), int steps = 1);
 	virtual void draw() const;
+
+	/* advances the system by the given number of seconds in a single update,
+	 * through the catch-up described above, so that effects start out in
+	 * their steady state instead of visibly starting up. The emitter is
+	 * considered stationary at its current position for that time. Call it
+	 * after set_psys_global_time.
+	 */
+	virtual void prewarm(float seconds);
+
+	friend void update_psys(ParticleSystem * const *psys, int count);
+	friend void draw_psys(ParticleSystem * const *psys, int count);
 };
 
 void set_psys_global_time(unsigned int msec);
 
-/* set a limit to the maximum number of particles kept in the
- * memory pool (default: 500000)
+/* updates a number of particle systems in parallel, using the shared
+ * thread pool (see tpool.h), one job per particle system. Drawing is
+ * left to the caller, and must happen after this returns.
+ */
+void update_psys(ParticleSystem * const *psys, int count);
+
+/* draws a number of particle systems. Depth-sorted billboard systems which
+ * share the same texture and blending mode are merged, and their particles
+ * are drawn as a single back-to-front sorted stream.
+ */
+void draw_psys(ParticleSystem * const *psys, int count);
+
+/* set a limit to the maximum number of free particles kept in the
+ * memory pool (default: 500000). Memory is returned to the system a whole
+ * slab at a time, so the actual number may exceed this by a slab or so.
  */
 void set_psys_max_mempool(int max_free);
 
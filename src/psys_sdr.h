@@ -0,0 +1,71 @@
+#ifndef PSYS_CC_IMPL
+#error "don't include psys_sdr.h!"
+#endif
+// shaders for drawing instanced mesh particles
+
+// instances per draw call when the instance data is passed as uniforms
+#define INST_UNIFORM_BATCH	16
+
+// transformation and lighting shared by both ways of getting the instance data
+#define INST_MESH_VS_COMMON \
+	"uniform float lighting;\n" \
+	"\n" \
+	"void draw_instance(vec4 xform0, vec4 xform1, vec4 xform2, vec4 color)\n" \
+	"{\n" \
+	"	vec4 pos = vec4(dot(xform0, gl_Vertex), dot(xform1, gl_Vertex),\n" \
+	"			dot(xform2, gl_Vertex), 1.0);\n" \
+	"	vec3 norm = vec3(dot(xform0.xyz, gl_Normal), dot(xform1.xyz, gl_Normal),\n" \
+	"			dot(xform2.xyz, gl_Normal));\n" \
+	"\n" \
+	"	gl_Position = gl_ModelViewProjectionMatrix * pos;\n" \
+	"	gl_TexCoord[0] = gl_TextureMatrix[0] * gl_MultiTexCoord0;\n" \
+	"\n" \
+	"	// diffuse lighting from the first light, like the fixed function path\n" \
+	"	vec4 vpos = gl_ModelViewMatrix * pos;\n" \
+	"	vec3 n = normalize(gl_NormalMatrix * norm);\n" \
+	"	vec4 lpos = gl_LightSource[0].position;\n" \
+	"	vec3 ldir = normalize(lpos.xyz - vpos.xyz * lpos.w);\n" \
+	"	vec3 light = gl_LightModel.ambient.rgb + gl_LightSource[0].diffuse.rgb * max(dot(n, ldir), 0.0);\n" \
+	"\n" \
+	"	vec3 col = color.rgb * mix(vec3(1.0), light, lighting);\n" \
+	"	gl_FrontColor = vec4(col, color.a);\n" \
+	"}\n" \
+	"\n"
+
+// instance data from per-instance vertex attributes (GL_ARB_instanced_arrays)
+static const char *inst_mesh_vs =
+	"attribute vec4 attr_inst_xform0, attr_inst_xform1, attr_inst_xform2;\n"
+	"attribute vec4 attr_inst_color;\n"
+	"\n"
+	INST_MESH_VS_COMMON
+	"void main()\n"
+	"{\n"
+	"	draw_instance(attr_inst_xform0, attr_inst_xform1, attr_inst_xform2, attr_inst_color);\n"
+	"}\n";
+
+/* instance data from a uniform array, 4 vectors per instance, indexed by the
+ * instance id (64 = INST_UNIFORM_BATCH * 4). The array is kept small enough
+ * to fit in the minimum number of vertex uniforms, next to the built-in
+ * matrices and light.
+ */
+static const char *inst_mesh_uniform_vs =
+	"#extension GL_ARB_draw_instanced : enable\n"
+	"\n"
+	"uniform vec4 inst_data[64];\n"
+	"\n"
+	INST_MESH_VS_COMMON
+	"void main()\n"
+	"{\n"
+	"	int idx = gl_InstanceIDARB * 4;\n"
+	"	draw_instance(inst_data[idx], inst_data[idx + 1], inst_data[idx + 2], inst_data[idx + 3]);\n"
+	"}\n";
+
+static const char *inst_mesh_ps =
+	"uniform sampler2D tex;\n"
+	"uniform float tex_enable;\n"
+	"\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 texel = mix(vec4(1.0), texture2D(tex, gl_TexCoord[0].st), tex_enable);\n"
+	"	gl_FragColor = gl_Color * texel;\n"
+	"}\n";
@@ -0,0 +1,93 @@
+#include <string.h>
+#include <vector>
+#include "radix.h"
+#include "int_types.h"
+
+using namespace henge;
+using namespace std;
+
+static vector<uint32_t> rkey_buf[2];
+static vector<unsigned int> ridx_buf[2];
+
+static inline uint32_t float_key(float x);
+
+#define RADIX_BITS		11
+#define RADIX_SIZE		(1 << RADIX_BITS)
+#define RADIX_MASK		(RADIX_SIZE - 1)
+#define RADIX_PASSES	3
+
+const unsigned int *henge::radix_sort(const float *keys, int count)
+{
+	static unsigned int hist[RADIX_PASSES][RADIX_SIZE];
+
+	if(count <= 0) {
+		return 0;
+	}
+
+	if((int)rkey_buf[0].size() < count) {
+		for(int i=0; i<2; i++) {
+			rkey_buf[i].resize(count);
+			ridx_buf[i].resize(count);
+		}
+	}
+	uint32_t *src_key = &rkey_buf[0][0], *dst_key = &rkey_buf[1][0];
+	unsigned int *src_idx = &ridx_buf[0][0], *dst_idx = &ridx_buf[1][0];
+
+	// convert the keys and build all the histograms in one go
+	memset(hist, 0, sizeof hist);
+	for(int i=0; i<count; i++) {
+		uint32_t k = float_key(keys[i]);
+		src_key[i] = k;
+		src_idx[i] = i;
+
+		for(int j=0; j<RADIX_PASSES; j++) {
+			hist[j][(k >> (j * RADIX_BITS)) & RADIX_MASK]++;
+		}
+	}
+
+	for(int pass=0; pass<RADIX_PASSES; pass++) {
+		unsigned int *h = hist[pass];
+		int shift = pass * RADIX_BITS;
+
+		// skip the pass if every key lands in the same bucket
+		if(h[(src_key[0] >> shift) & RADIX_MASK] == (unsigned int)count) {
+			continue;
+		}
+
+		// turn the histogram into the starting offset of each bucket
+		unsigned int sum = 0;
+		for(int i=0; i<RADIX_SIZE; i++) {
+			unsigned int tmp = h[i];
+			h[i] = sum;
+			sum += tmp;
+		}
+
+		for(int i=0; i<count; i++) {
+			uint32_t k = src_key[i];
+			unsigned int dest = h[(k >> shift) & RADIX_MASK]++;
+			dst_key[dest] = k;
+			dst_idx[dest] = src_idx[i];
+		}
+
+		uint32_t *tmp_key = src_key;
+		src_key = dst_key;
+		dst_key = tmp_key;
+
+		unsigned int *tmp_idx = src_idx;
+		src_idx = dst_idx;
+		dst_idx = tmp_idx;
+	}
+
+	return src_idx;
+}
+
+/* maps the bits of a float to an unsigned integer with the same ordering:
+ * flip the sign bit of positive numbers, and all the bits of negative ones.
+ */
+static inline uint32_t float_key(float x)
+{
+	uint32_t u;
+	memcpy(&u, &x, sizeof u);
+	uint32_t mask = -(int32_t)(u >> 31) | 0x80000000;
+	return u ^ mask;
+}
@@ -0,0 +1,16 @@
+#ifndef HENGE_RADIX_H_
+#define HENGE_RADIX_H_
+
+namespace henge {
+
+/* LSD radix sort of count float keys, in 3 passes of 11 bits. Returns an
+ * array of indices, which sorts the keys in ascending order, with -0 before
+ * +0. Passes where all keys fall into the same bucket are skipped. The
+ * returned array is reused by the next call, so it's only for one thread at
+ * a time.
+ */
+const unsigned int *radix_sort(const float *keys, int count);
+
+}	// namespace henge
+
+#endif	// HENGE_RADIX_H_
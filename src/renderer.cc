@@ -1,5 +1,7 @@
 #include <list>
+#include <vector>
 #include "renderer.h"
+#include "opengl.h"
 
 using namespace std;
 using namespace henge;
@@ -9,6 +11,16 @@ namespace henge {
 }
 
 static bool obj_cmp(const RObject *r1, const RObject *r2);
+static void get_view_frustum(Frustum *frust, const Camera *cam, const Matrix4x4 *proj,
+		unsigned int msec);
+
+// objects and particle systems in view, rebuilt every frame
+static vector<RObject*> vis_obj;
+static vector<ParticleSystem*> vis_psys;
+
+// bounds of the particle systems, one array per coordinate (see Frustum::cull_boxes)
+static vector<float> psys_box[6];
+static vector<uint32_t> psys_vis;
 
 static StdRenderer def_rend;
 static Renderer *act_rend = &def_rend;
@@ -28,6 +40,7 @@ Renderer *henge::get_renderer()
 Renderer::Renderer()
 {
 	rend_mask = REND_ALL;
+	proj_set = false;
 }
 
 Renderer::~Renderer() {}
@@ -42,6 +55,17 @@ unsigned int Renderer::get_render_mask() const
 	return rend_mask;
 }
 
+void Renderer::set_projection(const Matrix4x4 &proj)
+{
+	this->proj = proj;
+	proj_set = true;
+}
+
+const Matrix4x4 &Renderer::get_projection() const
+{
+	return proj;
+}
+
 //StdRenderer::~StdRenderer()
 //{
 //}
@@ -57,22 +81,30 @@ void StdRenderer::render(const Scene *scn, unsigned int msec) const
 		scn->setup_lights(msec);	// TODO get rid of this
 	}
 
+	// the camera only sets up the view if the renderer binds it
+	const Camera *cam = rend_mask & REND_CAM ? scn->get_active_camera() : 0;
+	Frustum frust;
+	get_view_frustum(&frust, cam, proj_set ? &proj : 0, msec);
+
 	list<RObject*> transp_obj;
 
 	if(rend_mask & REND_OBJ) {
+		// only the objects in view, according to the scene's spatial index
+		scn->update_bounds(msec);
+		vis_obj.clear();
+		scn->cull_objects(frust, &vis_obj);
+
 		// opaque objects pass, push transparent ones on another list for
 		// sorting back->front and rendering separately.
-		RObject * const *obj = scn->get_objects();
-		int num_obj = scn->object_count();
-
-		for(int i=0; i<num_obj; i++) {
-			const Material *mat = obj[i]->get_material_ptr();
+		for(size_t i=0; i<vis_obj.size(); i++) {
+			RObject *obj = vis_obj[i];
+			const Material *mat = obj->get_material_ptr();
 			if(mat->is_transparent()) {
 				if(rend_mask & REND_TRANSPARENT) {
-					transp_obj.push_back(obj[i]);
+					transp_obj.push_back(obj);
 				}
 			} else {
-				obj[i]->render(msec);
+				obj->render(msec);
 			}
 		}
 	}
@@ -100,14 +132,42 @@ void StdRenderer::render(const Scene *scn, unsigned int msec) const
 	}
 
 	if(rend_mask & REND_PSYS) {
-		// update and render the particle systems
+		/* update the particle systems in view in parallel, then render them.
+		 * The ones out of view are left alone, and catch up when they come
+		 * back into view.
+		 */
 		ParticleSystem * const *psys = scn->get_particles();
 		int num_psys = scn->particle_count();
 
-		set_psys_global_time(msec);
-		for(int i=0; i<num_psys; i++) {
-			psys[i]->update();
-			psys[i]->draw();
+		vis_psys.clear();
+		if(num_psys > 0) {
+			const float *box[6];
+			for(int i=0; i<6; i++) {
+				psys_box[i].resize(num_psys);
+				box[i] = &psys_box[i][0];
+			}
+			for(int i=0; i<num_psys; i++) {
+				AABox bounds = psys[i]->get_bounds(msec);
+				for(int j=0; j<3; j++) {
+					psys_box[j][i] = bounds.min[j];
+					psys_box[j + 3][i] = bounds.max[j];
+				}
+			}
+
+			psys_vis.resize((num_psys + 31) / 32);
+			frust.cull_boxes(box, num_psys, &psys_vis[0]);
+
+			for(int i=0; i<num_psys; i++) {
+				if(psys_vis[i / 32] & (1u << (i % 32))) {
+					vis_psys.push_back(psys[i]);
+				}
+			}
+		}
+
+		if(!vis_psys.empty()) {
+			set_psys_global_time(msec);
+			update_psys(&vis_psys[0], (int)vis_psys.size());
+			draw_psys(&vis_psys[0], (int)vis_psys.size());
 		}
 	}
 }
@@ -118,3 +178,36 @@ static bool obj_cmp(const RObject *r1, const RObject *r2)
 	return *r1 < *r2;
 }
 
+/* world space view frustum of the camera with the given projection. Without
+ * a projection, or a camera, whatever's missing is read back from the
+ * current OpenGL matrices instead.
+ */
+static void get_view_frustum(Frustum *frust, const Camera *cam, const Matrix4x4 *proj,
+		unsigned int msec)
+{
+	if(cam && proj) {
+		*frust = cam->get_frustum(*proj, msec);
+		return;
+	}
+
+	int mmode;
+	glGetIntegerv(GL_MATRIX_MODE, &mmode);
+
+	Matrix4x4 pmat, mview;
+	if(proj) {
+		pmat = *proj;
+	} else {
+		glMatrixMode(GL_PROJECTION);
+		store_matrix(&pmat);
+	}
+	if(cam) {
+		mview = cam->get_matrix(msec);
+	} else {
+		glMatrixMode(GL_MODELVIEW);
+		store_matrix(&mview);
+	}
+	glMatrixMode(mmode);
+
+	frust->set_matrix(pmat * mview);
+}
+
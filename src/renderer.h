@@ -28,6 +28,9 @@ class Renderer {
 protected:
 	unsigned int rend_mask;
 
+	Matrix4x4 proj;
+	bool proj_set;
+
 public:
 	Renderer();
 	virtual ~Renderer();
@@ -35,6 +38,13 @@ public:
 	void set_render_mask(unsigned int rmask);
 	unsigned int get_render_mask() const;
 
+	/* the projection the scene is viewed with, which together with the
+	 * active camera of the scene gives the view frustum used for culling.
+	 * Until it's set, it's read back from OpenGL every frame.
+	 */
+	void set_projection(const Matrix4x4 &proj);
+	const Matrix4x4 &get_projection() const;
+
 	virtual void render(const Scene *scn, unsigned int msec = 0) const = 0;
 };
 
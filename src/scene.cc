@@ -1,4 +1,4 @@
-#include <float.h>
+#include <algorithm>
 #include "scene.h"
 #include "unicache.h"
 #include "renderer.h"
@@ -8,9 +8,23 @@
 using namespace std;
 using namespace henge;
 
+// state of a Scene::raycast/raycast_all query, see ray_object
+struct RaycastQuery {
+	unsigned int msec;
+	RayHit *hit;			// closest hit so far, or null to collect all of them
+	vector<RayHit> *hits;
+};
+
+static void calc_world_box(AABox *res, const AABox &box, const Matrix4x4 &mat);
+static float ray_object(void *data, const Ray &ray, float tmax, void *cls);
+static bool hit_cmp(const RayHit &a, const RayHit &b);
+
 Scene::Scene()
 {
 	active_cam = 0;
+	bounds_valid = false;
+	bounds_time = 0;
+	xfgraph_valid = false;
 }
 
 Scene::~Scene()
@@ -18,24 +32,19 @@ Scene::~Scene()
 	clear();
 }
 
+/* the exact bounds of the spatial index, after bringing in any objects
+ * added since the last update_bounds, and the sphere around them.
+ */
 void Scene::calc_bounds() const
 {
-	bsph.center = Vector3(0, 0, 0);
-	bbox.min.x = bbox.min.y = bbox.min.z = FLT_MAX;
-	bbox.max.x = bbox.max.y = bbox.max.z = -FLT_MAX;
-
-	for(int i=0; i<object_count(); i++) {
-		AABox *box = objects[i]->get_aabox();
-		//bsphere *sph = objects[i]->get_bsphere();
-
-		if(box->min.x < bbox.min.x) bbox.min.x = box->min.x;
-		if(box->min.y < bbox.min.y) bbox.min.y = box->min.y;
-		if(box->min.z < bbox.min.z) bbox.min.z = box->min.z;
+	update_bounds(bounds_time);
 
-		if(box->max.x > bbox.max.x) bbox.max.x = box->max.x;
-		if(box->max.y > bbox.max.y) bbox.max.y = box->max.y;
-		if(box->max.z > bbox.max.z) bbox.max.z = box->max.z;
+	if(!objtree.get_bounds(&bbox)) {
+		bbox.min = bbox.max = Vector3(0, 0, 0);
 	}
+
+	bsph.center = (bbox.min + bbox.max) * 0.5;
+	bsph.radius = (bbox.max - bbox.min).length() * 0.5;
 	bounds_valid = true;
 }
 
@@ -98,6 +107,11 @@ void Scene::clear_objects()
 		}
 	}
 	objects.clear();
+	obj_bounds.clear();
+	unbounded.clear();
+	objtree.clear();
+	bounds_valid = false;
+	xfgraph_valid = false;
 }
 
 void Scene::clear_lights()
@@ -108,6 +122,7 @@ void Scene::clear_lights()
 		}
 	}
 	lights.clear();
+	xfgraph_valid = false;
 }
 
 void Scene::clear_cameras()
@@ -118,6 +133,8 @@ void Scene::clear_cameras()
 		}
 	}
 	cameras.clear();
+	active_cam = 0;
+	xfgraph_valid = false;
 }
 
 void Scene::clear_particles()
@@ -128,6 +145,7 @@ void Scene::clear_particles()
 		}
 	}
 	particles.clear();
+	xfgraph_valid = false;
 }
 
 void Scene::clear_renderfuncs()
@@ -154,6 +172,10 @@ bool Scene::add_object(RObject *obj)
 	const char *name = obj->get_name() ? obj->get_name() : "<unnamed>";
 	try {
 		objects.push_back(obj);
+		ObjBounds ob;
+		ob.proxy = -1;
+		ob.stamp = 0;
+		obj_bounds.push_back(ob);
 		objmap[name] = obj;
 		del_item[obj] = true;
 	}
@@ -162,6 +184,7 @@ bool Scene::add_object(RObject *obj)
 	}
 
 	bounds_valid = false;
+	xfgraph_valid = false;
 	return true;
 }
 
@@ -174,6 +197,8 @@ bool Scene::add_light(Light *lt)
 	catch(...) {
 		return false;
 	}
+
+	xfgraph_valid = false;
 	return true;
 }
 
@@ -187,6 +212,8 @@ bool Scene::add_camera(Camera *cam)
 		return false;
 	}
 
+	xfgraph_valid = false;
+
 	if(!active_cam) {
 		active_cam = cam;
 	}
@@ -204,6 +231,8 @@ bool Scene::add_particles(ParticleSystem *psys)
 	catch(...) {
 		return false;
 	}
+
+	xfgraph_valid = false;
 	return true;
 }
 
@@ -266,14 +295,29 @@ Camera *Scene::get_camera(int idx) const
 	return cameras[idx];
 }
 
+Camera *Scene::get_active_camera() const
+{
+	return active_cam;
+}
+
 
 bool Scene::remove_object(const char *name)
 {
 	vector<RObject*>::iterator iter = objects.begin();
 	while(iter != objects.end()) {
 		if(strcmp((*iter)->get_name(), name) == 0) {
+			int idx = (int)(iter - objects.begin());
+			if(obj_bounds[idx].proxy != -1) {
+				objtree.remove(obj_bounds[idx].proxy);
+			} else {
+				unbounded.erase(remove(unbounded.begin(), unbounded.end(), *iter), unbounded.end());
+			}
+			obj_bounds.erase(obj_bounds.begin() + idx);
+
 			objects.erase(iter);
 			objmap[name] = 0;
+			bounds_valid = false;
+			xfgraph_valid = false;
 			return true;
 		}
 		iter++;
@@ -437,11 +481,169 @@ void Scene::setup_camera(unsigned int msec) const
 	}
 }
 
+void Scene::update_xforms(unsigned int msec) const
+{
+	if(!xfgraph_valid) {
+		xfgraph.clear();
+		for(size_t i=0; i<objects.size(); i++) {
+			xfgraph.add_node(objects[i]);
+		}
+		for(size_t i=0; i<lights.size(); i++) {
+			xfgraph.add_node(lights[i]);
+		}
+		for(size_t i=0; i<cameras.size(); i++) {
+			xfgraph.add_node(cameras[i]);
+		}
+		for(size_t i=0; i<particles.size(); i++) {
+			xfgraph.add_node(particles[i]);
+		}
+		xfgraph_valid = true;
+	}
+	xfgraph.update((int)msec);
+}
+
+void Scene::update_bounds(unsigned int msec) const
+{
+	bounds_time = msec;
+	unbounded.clear();
+
+	for(size_t i=0; i<objects.size(); i++) {
+		RObject *obj = objects[i];
+		ObjBounds *ob = &obj_bounds[i];
+
+		if(!obj->get_mesh()->get_count(EL_VERTEX)) {
+			if(ob->proxy != -1) {
+				objtree.remove(ob->proxy);
+				ob->proxy = -1;
+				bounds_valid = false;
+			}
+			unbounded.push_back(obj);
+			continue;
+		}
+
+		unsigned int stamp = obj->get_xform_stamp((int)msec);
+		const AABox *local = obj->get_aabox();
+
+		if(ob->proxy != -1 && ob->stamp == stamp && ob->local.min == local->min &&
+				ob->local.max == local->max) {
+			continue;	// hasn't changed
+		}
+		ob->stamp = stamp;
+		ob->local.min = local->min;
+		ob->local.max = local->max;
+
+		AABox box;
+		calc_world_box(&box, *local, obj->get_xform_matrix((int)msec));
+
+		if(ob->proxy == -1) {
+			ob->proxy = objtree.insert(box, obj);
+		} else {
+			objtree.move(ob->proxy, box);
+		}
+		bounds_valid = false;
+	}
+}
+
+void Scene::cull_objects(const Frustum &frust, vector<RObject*> *res) const
+{
+	res->insert(res->end(), unbounded.begin(), unbounded.end());
+
+	vector<void*> vis;
+	objtree.query(frust, &vis);
+	for(size_t i=0; i<vis.size(); i++) {
+		res->push_back((RObject*)vis[i]);
+	}
+}
+
+bool Scene::raycast(const Ray &ray, RayHit *hit, unsigned int msec) const
+{
+	update_bounds(msec);
+
+	RaycastQuery query;
+	query.msec = msec;
+	query.hit = hit;
+	query.hits = 0;
+
+	hit->obj = 0;
+	objtree.raycast(ray, ray_object, &query);
+	return hit->obj != 0;
+}
+
+int Scene::raycast_all(const Ray &ray, vector<RayHit> *hits, unsigned int msec) const
+{
+	update_bounds(msec);
+
+	RaycastQuery query;
+	query.msec = msec;
+	query.hit = 0;
+	query.hits = hits;
+
+	hits->clear();
+	objtree.raycast(ray, ray_object, &query);
+	sort(hits->begin(), hits->end(), hit_cmp);
+	return (int)hits->size();
+}
+
 void Scene::render(unsigned int msec) const
 {
+	update_xforms(msec);
 	get_renderer()->render(this, msec);
 }
 
+/* box of a transformed box, straight from the matrix elements instead of
+ * transforming all 8 corners, see: "Transforming Axis-Aligned Bounding
+ * Boxes", James Arvo, Graphics Gems, 1990
+ */
+static void calc_world_box(AABox *res, const AABox &box, const Matrix4x4 &mat)
+{
+	for(int i=0; i<3; i++) {
+		float lo = mat[i][3], hi = mat[i][3];
+		for(int j=0; j<3; j++) {
+			float a = mat[i][j] * box.min[j];
+			float b = mat[i][j] * box.max[j];
+			lo += MIN(a, b);
+			hi += MAX(a, b);
+		}
+		res->min[i] = lo;
+		res->max[i] = hi;
+	}
+}
+
+/* the ray is taken to the space of the object, where the distances along it
+ * are the same, for affine transformations.
+ */
+static float ray_object(void *data, const Ray &ray, float tmax, void *cls)
+{
+	RObject *obj = (RObject*)data;
+	RaycastQuery *query = (RaycastQuery*)cls;
+
+	Ray local = ray.transformed(obj->get_inv_xform_matrix((int)query->msec));
+
+	TriHit tri_hit;
+	if(!obj->get_mesh()->raycast(local, &tri_hit, tmax)) {
+		return tmax;
+	}
+
+	RayHit hit;
+	hit.obj = obj;
+	hit.tri = tri_hit.tri;
+	hit.t = tri_hit.t;
+	hit.u = tri_hit.u;
+	hit.v = tri_hit.v;
+
+	if(!query->hit) {
+		query->hits->push_back(hit);
+		return tmax;
+	}
+	*query->hit = hit;
+	return hit.t;
+}
+
+static bool hit_cmp(const RayHit &a, const RayHit &b)
+{
+	return a.t < b.t;
+}
+
 /*
 void Scene::render(unsigned int msec) const
 {
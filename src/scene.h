@@ -11,9 +11,19 @@
 #include "psys.h"
 #include "renderfunc.h"
 #include "bounds.h"
+#include "xfgraph.h"
+#include "bvh.h"
 
 namespace henge {
 
+// a hit of Scene::raycast
+struct RayHit {
+	RObject *obj;
+	int tri;		// index of the triangle in the mesh of the object
+	float t;		// distance along the ray, in units of its direction vector
+	float u, v;		// barycentric coordinates in the triangle (see TriHit)
+};
+
 enum {
 	SCITEM_OBJ,
 	SCITEM_CAM,
@@ -34,9 +44,29 @@ protected:
 	std::vector<ParticleSystem*> particles;
 	std::vector<RenderFunc> rfuncs;
 
+	// world space bounds of all the objects, see get_bbox
 	mutable AABox bbox;
 	mutable BSphere bsph;
 	mutable bool bounds_valid;
+	mutable unsigned int bounds_time;	// time of the last update_bounds
+
+	// transformation hierarchies of all the items, see update_xforms
+	mutable XFormGraph xfgraph;
+	mutable bool xfgraph_valid;
+
+	/* world space bounding boxes of the objects, see update_bounds. Objects
+	 * without any geometry to bound aren't in the tree, and are never culled.
+	 */
+	mutable AABBTree objtree;
+	mutable std::vector<RObject*> unbounded;
+
+	// what the box of each object in the tree was last computed from
+	struct ObjBounds {
+		int proxy;				// -1 if not in the tree
+		unsigned int stamp;		// see XFormNode::get_xform_stamp
+		AABox local;
+	};
+	mutable std::vector<ObjBounds> obj_bounds;
 
 	// maps each item (object/light/etc) to a flag controlling
 	// automatic deletion of the item when clean is called.
@@ -82,6 +112,9 @@ public:
 	virtual Camera *get_camera(const char *name) const;
 	virtual Camera *get_camera(int idx) const;
 
+	// the camera setup_camera binds, the first one added
+	virtual Camera *get_active_camera() const;
+
 	virtual bool remove_object(const char *name);
 
 	virtual RObject **get_objects();
@@ -103,12 +136,48 @@ public:
 
 	virtual bool merge(const Scene &scn);
 
+	/* world space bounds of all the objects with geometry, at the time of
+	 * the last update_bounds (which the renderer calls every frame).
+	 */
 	virtual const AABox *get_bbox() const;
 	virtual const BSphere *get_bsphere() const;
 
 	virtual void setup_lights(unsigned int msec = 0) const;
 	virtual void setup_camera(unsigned int msec = 0) const;
 
+	/* computes the world matrices of every object, light, camera and
+	 * particle system at once (see XFormGraph). Called by render, before
+	 * the renderer gets to the scene.
+	 */
+	virtual void update_xforms(unsigned int msec = 0) const;
+
+	/* brings the spatial index of the objects up to date with their world
+	 * transformations at the given time. Only the boxes of objects whose
+	 * world matrices or meshes have changed are recomputed, and only the
+	 * ones which have moved out of their (slightly enlarged) boxes in the
+	 * index are reinserted.
+	 */
+	virtual void update_bounds(unsigned int msec = 0) const;
+
+	/* appends to res the objects whose boxes in the spatial index intersect
+	 * the frustum, as of the last update_bounds, and all objects without
+	 * geometry.
+	 */
+	virtual void cull_objects(const Frustum &frust, std::vector<RObject*> *res) const;
+
+	/* closest hit of a world space ray, taken as the segment from origin to
+	 * origin + dir, with the objects at the given time. The spatial index
+	 * is brought up to date first (see update_bounds), and each object it
+	 * finds along the ray is tested in its own space, against the triangle
+	 * hierarchy of its mesh (see TriMesh::raycast).
+	 */
+	virtual bool raycast(const Ray &ray, RayHit *hit, unsigned int msec = 0) const;
+
+	/* all objects hit by the ray, each with its closest hit, sorted by
+	 * distance. Returns the number of hits.
+	 */
+	virtual int raycast_all(const Ray &ray, std::vector<RayHit> *hits, unsigned int msec = 0) const;
+
 	virtual void render(unsigned int msec = 0) const;
 };
 
@@ -225,6 +225,10 @@ bool Shader::link()
 
 	unsigned int prog = glCreateProgramObjectARB();
 	glBindAttribLocationARB(prog, SDR_ATTR_TANGENT, "attr_tangent");
+	glBindAttribLocationARB(prog, SDR_ATTR_INST_XFORM, "attr_inst_xform0");
+	glBindAttribLocationARB(prog, SDR_ATTR_INST_XFORM + 1, "attr_inst_xform1");
+	glBindAttribLocationARB(prog, SDR_ATTR_INST_XFORM + 2, "attr_inst_xform2");
+	glBindAttribLocationARB(prog, SDR_ATTR_INST_COLOR, "attr_inst_color");
 
 	if(vsdr) {
 		glAttachObjectARB(prog, vsdr);
@@ -341,6 +345,14 @@ bool Shader::set_uniform(const char *name, const Matrix4x4 &mat) const
 	END_UNIFORM_CODE;
 }
 
+bool Shader::set_uniform_array(const char *name, const float *vec4, int count) const
+{
+	BEGIN_UNIFORM_CODE {
+		glUniform4fvARB(loc, count, vec4);
+	}
+	END_UNIFORM_CODE;
+}
+
 
 bool Shader::bind() const
 {
@@ -7,6 +7,10 @@
 // GLSL attribute slot used by the tangent vector
 #define SDR_ATTR_TANGENT	12	// collision with MultiTexCoord4 shouldn't matter
 
+// per-instance attribute slots used by instanced drawing
+#define SDR_ATTR_INST_XFORM	13	// 3 slots: rows of the instance 3x4 matrix
+#define SDR_ATTR_INST_COLOR	6
+
 namespace henge {
 
 class Shader;
@@ -50,6 +54,8 @@ public:
 	bool set_uniform(const char *name, const Vector3 &vec) const;
 	bool set_uniform(const char *name, const Vector4 &vec) const;
 	bool set_uniform(const char *name, const Matrix4x4 &mat) const;
+	// sets the first count elements of a vec4 uniform array
+	bool set_uniform_array(const char *name, const float *vec4, int count) const;
 
 	bool bind() const;
 };
@@ -0,0 +1,79 @@
+#ifndef HENGE_SIMD_H_
+#define HENGE_SIMD_H_
+
+#include <math.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+namespace henge {
+
+/* 4-wide float vectors, SSE if available, plain arrays otherwise. Loads and
+ * stores (except v4_loadu) must be 16 byte aligned.
+ */
+#ifdef __SSE__
+typedef __m128 v4f;
+
+inline v4f v4_load(const float *p) { return _mm_load_ps(p); }
+inline v4f v4_loadu(const float *p) { return _mm_loadu_ps(p); }
+inline void v4_store(float *p, v4f v) { _mm_store_ps(p, v); }
+inline v4f v4_set(float x) { return _mm_set1_ps(x); }
+inline v4f v4_add(v4f a, v4f b) { return _mm_add_ps(a, b); }
+inline v4f v4_sub(v4f a, v4f b) { return _mm_sub_ps(a, b); }
+inline v4f v4_mul(v4f a, v4f b) { return _mm_mul_ps(a, b); }
+inline v4f v4_div(v4f a, v4f b) { return _mm_div_ps(a, b); }
+inline v4f v4_rsqrt(v4f a) { return _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(a)); }
+
+// -1 where x is negative, 1 elsewhere
+inline v4f v4_sign(v4f x)
+{
+	v4f neg = _mm_cmplt_ps(x, _mm_setzero_ps());
+	return _mm_or_ps(_mm_set1_ps(1.0f), _mm_and_ps(neg, _mm_set1_ps(-0.0f)));
+}
+
+// x, with zeros replaced by 1
+inline v4f v4_nonzero(v4f x)
+{
+	v4f zero = _mm_cmpeq_ps(x, _mm_setzero_ps());
+	return _mm_or_ps(_mm_andnot_ps(zero, x), _mm_and_ps(zero, _mm_set1_ps(1.0f)));
+}
+
+// bit i set where a[i] < b[i]
+inline int v4_lt_mask(v4f a, v4f b) { return _mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+#else
+struct v4f {
+	float v[4];
+};
+
+#define V4_OP(expr)	\
+	v4f res; \
+	for(int i=0; i<4; i++) res.v[i] = (expr); \
+	return res
+
+inline v4f v4_load(const float *p) { V4_OP(p[i]); }
+inline v4f v4_loadu(const float *p) { V4_OP(p[i]); }
+inline void v4_store(float *p, v4f v) { for(int i=0; i<4; i++) p[i] = v.v[i]; }
+inline v4f v4_set(float x) { V4_OP(x); }
+inline v4f v4_add(v4f a, v4f b) { V4_OP(a.v[i] + b.v[i]); }
+inline v4f v4_sub(v4f a, v4f b) { V4_OP(a.v[i] - b.v[i]); }
+inline v4f v4_mul(v4f a, v4f b) { V4_OP(a.v[i] * b.v[i]); }
+inline v4f v4_div(v4f a, v4f b) { V4_OP(a.v[i] / b.v[i]); }
+inline v4f v4_rsqrt(v4f a) { V4_OP(1.0 / sqrt(a.v[i])); }
+inline v4f v4_sign(v4f x) { V4_OP(x.v[i] < 0.0 ? -1.0 : 1.0); }
+inline v4f v4_nonzero(v4f x) { V4_OP(x.v[i] == 0.0 ? 1.0 : x.v[i]); }
+
+inline int v4_lt_mask(v4f a, v4f b)
+{
+	int mask = 0;
+	for(int i=0; i<4; i++) {
+		if(a.v[i] < b.v[i]) mask |= 1 << i;
+	}
+	return mask;
+}
+
+#undef V4_OP
+#endif
+
+}	// namespace henge
+
+#endif	// HENGE_SIMD_H_
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include "tpool.h"
+#include "errlog.h"
+
+using namespace henge;
+
+static ThreadPool *pool;
+
+ThreadPool::ThreadPool(int num_threads)
+{
+	if(num_threads < 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = ncpu > 1 ? (int)ncpu - 1 : 0;
+	}
+
+	func = 0;
+	cls = 0;
+	num_jobs = next_job = jobs_done = 0;
+	quit = false;
+
+	pthread_mutex_init(&mutex, 0);
+	pthread_cond_init(&work_cond, 0);
+	pthread_cond_init(&done_cond, 0);
+
+	this->num_threads = 0;
+	threads = num_threads > 0 ? new pthread_t[num_threads] : 0;
+
+	for(int i=0; i<num_threads; i++) {
+		if(pthread_create(threads + i, 0, thread_func, this) != 0) {
+			warning("failed to create worker thread %d\n", i);
+			break;
+		}
+		this->num_threads++;
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	pthread_mutex_lock(&mutex);
+	quit = true;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&mutex);
+
+	for(int i=0; i<num_threads; i++) {
+		pthread_join(threads[i], 0);
+	}
+	delete [] threads;
+
+	pthread_cond_destroy(&done_cond);
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+int ThreadPool::get_thread_count() const
+{
+	return num_threads;
+}
+
+void ThreadPool::run(JobFunc func, int count, void *cls)
+{
+	if(count <= 0) return;
+
+	// not worth waking up anyone for a single job
+	if(!num_threads || count == 1) {
+		for(int i=0; i<count; i++) {
+			func(i, cls);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&mutex);
+
+	this->func = func;
+	this->cls = cls;
+	num_jobs = count;
+	next_job = jobs_done = 0;
+	pthread_cond_broadcast(&work_cond);
+
+	work();
+
+	while(jobs_done < num_jobs) {
+		pthread_cond_wait(&done_cond, &mutex);
+	}
+
+	pthread_mutex_unlock(&mutex);
+}
+
+// runs jobs until there are none left, called with the mutex locked
+void ThreadPool::work()
+{
+	while(next_job < num_jobs) {
+		int idx = next_job++;
+
+		pthread_mutex_unlock(&mutex);
+		func(idx, cls);
+		pthread_mutex_lock(&mutex);
+
+		if(++jobs_done == num_jobs) {
+			pthread_cond_signal(&done_cond);
+		}
+	}
+}
+
+void *ThreadPool::thread_func(void *arg)
+{
+	ThreadPool *tp = (ThreadPool*)arg;
+
+	pthread_mutex_lock(&tp->mutex);
+	while(!tp->quit) {
+		if(tp->next_job < tp->num_jobs) {
+			tp->work();
+		} else {
+			pthread_cond_wait(&tp->work_cond, &tp->mutex);
+		}
+	}
+	pthread_mutex_unlock(&tp->mutex);
+	return 0;
+}
+
+
+ThreadPool *henge::get_thread_pool()
+{
+	if(!pool) {
+		const char *env = getenv("HENGE_THREADS");
+		pool = new ThreadPool(env ? atoi(env) : -1);
+		info("thread pool: %d worker threads\n", pool->get_thread_count());
+	}
+	return pool;
+}
+
+void henge::destroy_thread_pool()
+{
+	delete pool;
+	pool = 0;
+}
@@ -0,0 +1,53 @@
+#ifndef HENGE_TPOOL_H_
+#define HENGE_TPOOL_H_
+
+#include <pthread.h>
+
+namespace henge {
+
+// job function, called with the index of the job and the closure pointer
+typedef void (*JobFunc)(int, void*);
+
+/* pool of worker threads, for running batches of independent jobs in parallel.
+ * run() hands out the job indices to the workers, and to the calling thread,
+ * and returns when all of them are done. Jobs must not call run() themselves.
+ */
+class ThreadPool {
+private:
+	int num_threads;
+	pthread_t *threads;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond, done_cond;
+
+	// current batch of jobs
+	JobFunc func;
+	void *cls;
+	int num_jobs, next_job, jobs_done;
+	bool quit;
+
+	static void *thread_func(void *arg);
+	void work();
+
+public:
+	/* num_threads is the number of worker threads besides the calling
+	 * thread, a negative number means one less than the number of processors.
+	 */
+	ThreadPool(int num_threads = -1);
+	~ThreadPool();
+
+	int get_thread_count() const;
+
+	void run(JobFunc func, int count, void *cls = 0);
+};
+
+/* shared thread pool, created on first use. The number of worker threads
+ * can be overriden with the HENGE_THREADS environment variable (0 disables
+ * multi-threading).
+ */
+ThreadPool *get_thread_pool();
+void destroy_thread_pool();
+
+}	// namespace henge
+
+#endif	// HENGE_TPOOL_H_
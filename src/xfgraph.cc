@@ -0,0 +1,178 @@
+#include <algorithm>
+#include "xfgraph.h"
+#include "tpool.h"
+
+using namespace std;
+using namespace henge;
+
+// number of nodes per job for the local matrices
+#define LOCAL_CHUNK		256
+// minimum number of nodes per job for the world matrices
+#define MIN_WORLD_JOB	64
+
+XFormGraph::XFormGraph()
+{
+	valid = false;
+	hier_version = 0;
+	upd_time = 0;
+}
+
+void XFormGraph::add_node(XFormNode *node)
+{
+	added.push_back(node);
+	valid = false;
+}
+
+void XFormGraph::remove_node(XFormNode *node)
+{
+	vector<XFormNode*>::iterator iter = find(added.begin(), added.end(), node);
+	if(iter != added.end()) {
+		added.erase(iter);
+		valid = false;
+	}
+}
+
+void XFormGraph::clear()
+{
+	added.clear();
+	nodes.clear();
+	jobs.clear();
+	split.clear();
+	valid = true;
+}
+
+void XFormGraph::build()
+{
+	nodes.clear();
+	jobs.clear();
+	split.clear();
+
+	// find the top of every hierarchy, each one must only be laid out once
+	vector<XFormNode*> top(added.size());
+	for(size_t i=0; i<added.size(); i++) {
+		XFormNode *node = added[i];
+		while(node->parent) {
+			node = node->parent;
+		}
+		top[i] = node;
+	}
+	sort(top.begin(), top.end());
+	top.erase(unique(top.begin(), top.end()), top.end());
+
+	// sizes[i] is the number of nodes in the subtree starting at nodes[i]
+	vector<int> sizes;
+	for(size_t i=0; i<top.size(); i++) {
+		add_subtree(top[i], &sizes);
+	}
+
+	// a few jobs per thread, of whole subtrees
+	int num_threads = get_thread_pool()->get_thread_count() + 1;
+	int job_size = MAX((int)nodes.size() / (num_threads * 4), MIN_WORLD_JOB);
+
+	int idx = 0;
+	while(idx < (int)nodes.size()) {
+		add_jobs(idx, sizes, job_size);
+		idx += sizes[idx];
+	}
+
+	hier_version = XFormNode::get_hierarchy_version();
+	valid = true;
+}
+
+// lays out the subtree depth-first, and returns its number of nodes
+int XFormGraph::add_subtree(XFormNode *node, vector<int> *sizes)
+{
+	int idx = (int)nodes.size();
+	nodes.push_back(node);
+	sizes->push_back(1);
+
+	int count = 1;
+	for(size_t i=0; i<node->children.size(); i++) {
+		count += add_subtree(node->children[i], sizes);
+	}
+	(*sizes)[idx] = count;
+	return count;
+}
+
+/* adds the subtree starting at idx to the last job, or to a new one if that's
+ * full. A subtree larger than a job is split: its top goes to the list done
+ * first, and each of the subtrees below it is added in turn.
+ */
+void XFormGraph::add_jobs(int idx, const vector<int> &sizes, int job_size)
+{
+	int end = idx + sizes[idx];
+
+	if(sizes[idx] > job_size) {
+		split.push_back(idx);
+
+		int child = idx + 1;
+		while(child < end) {
+			add_jobs(child, sizes, job_size);
+			child += sizes[child];
+		}
+		return;
+	}
+
+	if(!jobs.empty() && jobs.back().end == idx && jobs.back().end - jobs.back().start < job_size) {
+		jobs.back().end = end;
+	} else {
+		JobRange job;
+		job.start = idx;
+		job.end = end;
+		jobs.push_back(job);
+	}
+}
+
+void XFormGraph::update(int time)
+{
+	if(!valid || hier_version != XFormNode::get_hierarchy_version()) {
+		build();
+	}
+	if(nodes.empty()) return;
+
+	upd_time = time;
+
+	ThreadPool *tpool = get_thread_pool();
+	tpool->run(local_job, ((int)nodes.size() + LOCAL_CHUNK - 1) / LOCAL_CHUNK, this);
+
+	// parents of split subtrees come before their children in the list
+	for(size_t i=0; i<split.size(); i++) {
+		nodes[split[i]]->update_world(time);
+	}
+	tpool->run(world_job, (int)jobs.size(), this);
+}
+
+int XFormGraph::get_node_count() const
+{
+	return (int)nodes.size();
+}
+
+XFormNode * const *XFormGraph::get_nodes() const
+{
+	return nodes.empty() ? 0 : &nodes[0];
+}
+
+void XFormGraph::local_job(int idx, void *cls)
+{
+	XFormGraph *graph = (XFormGraph*)cls;
+
+	int start = idx * LOCAL_CHUNK;
+	int end = MIN(start + LOCAL_CHUNK, (int)graph->nodes.size());
+
+	for(int i=start; i<end; i++) {
+		graph->nodes[i]->eval_local(graph->upd_time);
+	}
+}
+
+// parents come first, so their world matrices are always ready
+void XFormGraph::world_job(int idx, void *cls)
+{
+	XFormGraph *graph = (XFormGraph*)cls;
+
+	int start = graph->jobs[idx].start;
+	int end = graph->jobs[idx].end;
+
+	for(int i=start; i<end; i++) {
+		graph->nodes[i]->update_world(graph->upd_time);
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef HENGE_XFGRAPH_H_
+#define HENGE_XFGRAPH_H_
+
+#include <vector>
+#include "anim.h"
+
+namespace henge {
+
+/* flattened transformation hierarchy, for computing the world matrices of a
+ * large number of nodes in one go. The hierarchies of all the added nodes
+ * (from the top, so adding any node of a hierarchy brings in all of it) are
+ * laid out depth-first in a contiguous array, with parents before their
+ * children.
+ *
+ * update() evaluates the local matrices of all nodes in parallel, then
+ * concatenates them down the hierarchies, one job per group of independent
+ * subtrees, and leaves the results in the matrix caches of the nodes, so
+ * that get_xform_matrix for the same time just returns them. Subtrees too
+ * large for a single job are split below their top node, which is done
+ * first, along with any others like it, on the calling thread. Nodes whose
+ * caches are still valid (see XFormNode) are skipped.
+ */
+class XFormGraph {
+private:
+	std::vector<XFormNode*> added;
+
+	std::vector<XFormNode*> nodes;
+
+	// node ranges of the world matrix jobs, made of whole subtrees
+	struct JobRange {
+		int start, end;
+	};
+	std::vector<JobRange> jobs;
+	// tops of split subtrees, in order, done before the jobs
+	std::vector<int> split;
+
+	bool valid;
+	unsigned int hier_version;
+
+	int upd_time;	// time of the update in progress
+
+	void build();
+	int add_subtree(XFormNode *node, std::vector<int> *sizes);
+	void add_jobs(int idx, const std::vector<int> &sizes, int job_size);
+
+	static void local_job(int idx, void *cls);
+	static void world_job(int idx, void *cls);
+
+public:
+	XFormGraph();
+
+	void add_node(XFormNode *node);
+	void remove_node(XFormNode *node);
+	void clear();
+
+	/* computes the world matrices of all nodes at the given time. The
+	 * layout is redone first if any hierarchy has changed since the last
+	 * update (see XFormNode::get_hierarchy_version).
+	 */
+	void update(int time);
+
+	int get_node_count() const;
+	XFormNode * const *get_nodes() const;
+};
+
+}	// namespace henge
+
+#endif	// HENGE_XFGRAPH_H_
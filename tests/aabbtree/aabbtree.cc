@@ -0,0 +1,349 @@
+/* checks the dynamic AABB tree through a few thousand random insertions,
+ * moves and removals: the structure of the tree after every operation (see
+ * AABBTree::validate), and frustum, box and ray queries against testing
+ * every item one by one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include "bvh.h"
+#include "errlog.h"
+
+using namespace henge;
+
+#define NUM_ITEMS		3000
+#define QUERY_INTERVAL	250
+
+struct Item {
+	AABox box;
+	int proxy;		// -1 if not in the tree
+};
+
+static std::vector<Item> items;
+static AABBTree tree;
+
+static bool step(const char *what, int i);
+static bool check_queries(const char *what);
+static bool check_frustum(const Frustum &frust, const char *what);
+static bool check_box(const AABox &box, const char *what);
+static bool check_ray(const Ray &ray, const char *what);
+static bool same_items(std::vector<void*> *res, std::vector<void*> *expected, const char *what,
+		const char *query);
+
+static float collect_hit(void *data, const Ray &ray, float tmax, void *cls);
+static float nearest_hit(void *data, const Ray &ray, float tmax, void *cls);
+static bool ray_box(const Ray &ray, const AABox &box, float tmax, float *tnear);
+
+static AABox rand_box();
+static Frustum rand_frustum(bool persp);
+static float frand(float lo, float hi);
+
+int main()
+{
+	// AABBTree::validate reports what it finds wrong through the error log
+	set_log_stream(stderr, LOG_ERROR);
+
+	srand(0);
+	items.resize(NUM_ITEMS);
+	for(int i=0; i<NUM_ITEMS; i++) {
+		items[i].proxy = -1;
+	}
+
+	if(tree.get_count() != 0 || tree.get_height() != 0 || !tree.validate()) {
+		printf("empty tree: FAILED\n");
+		return 1;
+	}
+
+	// insert everything
+	for(int i=0; i<NUM_ITEMS; i++) {
+		items[i].box = rand_box();
+		items[i].proxy = tree.insert(items[i].box, (void*)&items[i]);
+		if(!step("insert", i)) return 1;
+	}
+	printf("insert: ok (height %d)\n", tree.get_height());
+
+	// small moves, mostly within the enlarged boxes, and a few long jumps
+	int num_reinserted = 0;
+	for(int iter=0; iter<3; iter++) {
+		for(int i=0; i<NUM_ITEMS; i++) {
+			AABox &box = items[i].box;
+			if(rand() % 10 == 0) {
+				box = rand_box();
+			} else {
+				Vector3 offs(frand(-0.2, 0.2), frand(-0.2, 0.2), frand(-0.2, 0.2));
+				box.min = box.min + offs;
+				box.max = box.max + offs;
+			}
+			num_reinserted += tree.move(items[i].proxy, box);
+			if(!step("move", i)) return 1;
+		}
+	}
+	printf("move: ok (%d reinserted, height %d)\n", num_reinserted, tree.get_height());
+
+	// remove every other item at random, and insert some more in their place
+	for(int i=0; i<NUM_ITEMS; i++) {
+		if(rand() & 1) {
+			tree.remove(items[i].proxy);
+			items[i].proxy = -1;
+			if(!step("remove", i)) return 1;
+		}
+	}
+	for(int i=0; i<NUM_ITEMS / 4; i++) {
+		Item &item = items[rand() % NUM_ITEMS];
+		if(item.proxy == -1) {
+			item.box = rand_box();
+			item.proxy = tree.insert(item.box, (void*)&item);
+			if(!step("reinsert", i)) return 1;
+		}
+	}
+	printf("remove: ok (%d left, height %d)\n", tree.get_count(), tree.get_height());
+
+	// and empty it
+	for(int i=0; i<NUM_ITEMS; i++) {
+		if(items[i].proxy != -1) {
+			tree.remove(items[i].proxy);
+			items[i].proxy = -1;
+			if(!step("remove all", i)) return 1;
+		}
+	}
+	AABox bounds;
+	if(tree.get_count() != 0 || tree.get_height() != 0 || tree.get_bounds(&bounds)) {
+		printf("remove all: FAILED, %d items left\n", tree.get_count());
+		return 1;
+	}
+	printf("remove all: ok\n");
+
+	printf("all tests passed\n");
+	return 0;
+}
+
+// validates the tree after an operation, and checks the queries every so often
+static bool step(const char *what, int i)
+{
+	if(!tree.validate()) {
+		printf("%s: FAILED, invalid tree after item %d\n", what, i);
+		return false;
+	}
+
+	int count = 0;
+	AABox bounds(Vector3(FLT_MAX, FLT_MAX, FLT_MAX), Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	for(int j=0; j<NUM_ITEMS; j++) {
+		if(items[j].proxy == -1) continue;
+		count++;
+
+		const AABox &box = items[j].box;
+		for(int k=0; k<3; k++) {
+			bounds.min[k] = MIN(bounds.min[k], box.min[k]);
+			bounds.max[k] = MAX(bounds.max[k], box.max[k]);
+		}
+	}
+	if(tree.get_count() != count) {
+		printf("%s: FAILED, tree has %d items instead of %d\n", what, tree.get_count(), count);
+		return false;
+	}
+
+	AABox tree_bounds;
+	if(count) {
+		bool match = tree.get_bounds(&tree_bounds);
+		for(int k=0; k<3; k++) {
+			match = match && tree_bounds.min[k] == bounds.min[k] && tree_bounds.max[k] == bounds.max[k];
+		}
+		if(!match) {
+			printf("%s: FAILED, tree bounds don't match the items\n", what);
+			return false;
+		}
+	}
+
+	if(i % QUERY_INTERVAL == 0) {
+		return check_queries(what);
+	}
+	return true;
+}
+
+static bool check_queries(const char *what)
+{
+	for(int i=0; i<4; i++) {
+		if(!check_frustum(rand_frustum(i & 1), what)) {
+			return false;
+		}
+		Vector3 pos(frand(0, 100), frand(0, 100), frand(0, 100));
+		Vector3 size(frand(1, 30), frand(1, 30), frand(1, 30));
+		if(!check_box(AABox(pos, pos + size), what)) {
+			return false;
+		}
+	}
+
+	for(int i=0; i<20; i++) {
+		Vector3 org(frand(-10, 110), frand(-10, 110), frand(-10, 110));
+		Vector3 dir(frand(-1, 1), frand(-1, 1), frand(-1, 1));
+		// some rays along the axes, for the infinite inverse directions
+		if(i % 5 == 0) {
+			dir[i % 3] = dir[(i + 1) % 3] = 0.0;
+		}
+		if(!check_ray(Ray(org, dir * frand(10, 150)), what)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool check_frustum(const Frustum &frust, const char *what)
+{
+	std::vector<void*> res, expected;
+	tree.query(frust, &res);
+
+	for(int i=0; i<NUM_ITEMS; i++) {
+		if(items[i].proxy != -1 && frust.intersect(items[i].box)) {
+			expected.push_back(&items[i]);
+		}
+	}
+	return same_items(&res, &expected, what, "frustum query");
+}
+
+static bool check_box(const AABox &box, const char *what)
+{
+	std::vector<void*> res, expected;
+	tree.query(box, &res);
+
+	for(int i=0; i<NUM_ITEMS; i++) {
+		const AABox &ib = items[i].box;
+		if(items[i].proxy != -1 && ib.min.x <= box.max.x && ib.max.x >= box.min.x &&
+				ib.min.y <= box.max.y && ib.max.y >= box.min.y &&
+				ib.min.z <= box.max.z && ib.max.z >= box.min.z) {
+			expected.push_back(&items[i]);
+		}
+	}
+	return same_items(&res, &expected, what, "box query");
+}
+
+static bool check_ray(const Ray &ray, const char *what)
+{
+	std::vector<void*> res, expected;
+	tree.raycast(ray, collect_hit, &res);
+
+	float nearest = FLT_MAX;
+	for(int i=0; i<NUM_ITEMS; i++) {
+		float t;
+		if(items[i].proxy != -1 && ray_box(ray, items[i].box, 1.0, &t)) {
+			expected.push_back(&items[i]);
+			nearest = MIN(nearest, t);
+		}
+	}
+	if(!same_items(&res, &expected, what, "raycast")) {
+		return false;
+	}
+
+	// shortening the ray on every hit must still find the nearest box
+	float found = FLT_MAX;
+	tree.raycast(ray, nearest_hit, &found);
+	if(found != nearest) {
+		printf("%s: FAILED, nearest box along the ray at %g instead of %g\n", what, found, nearest);
+		return false;
+	}
+	return true;
+}
+
+static bool same_items(std::vector<void*> *res, std::vector<void*> *expected, const char *what,
+		const char *query)
+{
+	std::sort(res->begin(), res->end());
+	std::sort(expected->begin(), expected->end());
+	if(*res != *expected) {
+		printf("%s: FAILED, %s found %d items instead of %d\n", what, query, (int)res->size(),
+				(int)expected->size());
+		return false;
+	}
+	return true;
+}
+
+static float collect_hit(void *data, const Ray &ray, float tmax, void *cls)
+{
+	((std::vector<void*>*)cls)->push_back(data);
+	return tmax;
+}
+
+static float nearest_hit(void *data, const Ray &ray, float tmax, void *cls)
+{
+	float t;
+	if(ray_box(ray, ((Item*)data)->box, tmax, &t)) {
+		float *found = (float*)cls;
+		*found = MIN(*found, t);
+		return t;
+	}
+	return tmax;
+}
+
+// the same slab test as the tree, so that the results match exactly
+static bool ray_box(const Ray &ray, const AABox &box, float tmax, float *tnear)
+{
+	float t0 = 0.0, t1 = tmax;
+	for(int i=0; i<3; i++) {
+		float dir = ray.dir[i];
+		float inv = fabs(dir) > XSMALL_NUMBER ? 1.0 / dir : (dir < 0.0 ? -FLT_MAX : FLT_MAX);
+
+		float ta = (box.min[i] - ray.origin[i]) * inv;
+		float tb = (box.max[i] - ray.origin[i]) * inv;
+		if(ta > tb) {
+			std::swap(ta, tb);
+		}
+
+		if(ta > t0) t0 = ta;
+		if(tb < t1) t1 = tb;
+		if(t0 > t1) return false;
+	}
+	*tnear = t0;
+	return true;
+}
+
+static AABox rand_box()
+{
+	Vector3 pos(frand(0, 100), frand(0, 100), frand(0, 100));
+	Vector3 size(frand(0.1, 5), frand(0.1, 5), frand(0.1, 5));
+	return AABox(pos, pos + size);
+}
+
+/* the planes are taken from a projection matrix: an orthographic box
+ * somewhere in the scene, or a perspective view looking into it.
+ */
+static Frustum rand_frustum(bool persp)
+{
+	Matrix4x4 mat;
+	for(int i=0; i<4; i++) {
+		for(int j=0; j<4; j++) {
+			mat[i][j] = 0.0;
+		}
+	}
+
+	if(!persp) {
+		for(int i=0; i<3; i++) {
+			float size = frand(5, 50);
+			float center = frand(0, 100);
+			mat[i][i] = 1.0 / size;
+			mat[i][3] = -center / size;
+		}
+		mat[3][3] = 1.0;
+	} else {
+		float f = 1.0 / tan(frand(0.2, 0.8));
+		float znear = 1.0, zfar = frand(20, 200);
+		Vector3 eye(frand(0, 100), frand(0, 100), 150.0);
+
+		// looking down -z from the eye: projection times the view translation
+		mat[0][0] = f;
+		mat[1][1] = f;
+		mat[2][2] = (zfar + znear) / (znear - zfar);
+		mat[3][2] = -1.0;
+		mat[0][3] = -f * eye.x;
+		mat[1][3] = -f * eye.y;
+		mat[2][3] = -mat[2][2] * eye.z + 2.0 * zfar * znear / (znear - zfar);
+		mat[3][3] = eye.z;
+	}
+	return Frustum(mat);
+}
+
+static float frand(float lo, float hi)
+{
+	return lo + (hi - lo) * (float)rand() / (float)RAND_MAX;
+}
@@ -0,0 +1,143 @@
+/* checks that EmitShape picks the triangles of a mesh (and the segments of a
+ * curve) with a frequency proportional to their area (or length), through
+ * its alias table.
+ */
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include "mesh.h"
+#include "psys.h"
+#include "emitshape.h"
+
+using namespace henge;
+
+#define NUM_SAMPLES		1000000
+#define SPACING			10.0f	// shapes are laid out along X this far apart
+
+static bool check_freq(const char *name, const float *size, int count, const EmitShape &shape,
+		bool curve);
+
+int main()
+{
+	int failed = 0;
+
+	/* right triangles with legs a and 2, so each has an area of a. One of them
+	 * is degenerate, and must never be picked.
+	 */
+	static const float area[] = {1.0f, 3.0f, 0.5f, 6.0f, 0.0f, 2.0f, 8.0f, 0.25f};
+	const int ntris = sizeof area / sizeof *area;
+
+	std::vector<Vector3> vert;
+	for(int i=0; i<ntris; i++) {
+		float x = i * SPACING;
+		vert.push_back(Vector3(x, 0, 0));
+		vert.push_back(Vector3(x + area[i], 0, 0));
+		vert.push_back(Vector3(x, 2, 0));
+	}
+
+	TriMesh mesh;
+	mesh.set_data(EL_VERTEX, &vert[0], (int)vert.size());
+
+	EmitShape mshape(&mesh);
+	failed += !check_freq("mesh", area, ntris, mshape, false);
+
+	// the same through an index array, with the vertices in reverse order
+	std::vector<Vector3> rvert(vert.rbegin(), vert.rend());
+	std::vector<unsigned int> index;
+	for(int i=0; i<ntris * 3; i++) {
+		index.push_back(ntris * 3 - 1 - i);
+	}
+
+	TriMesh imesh;
+	imesh.set_data(EL_VERTEX, &rvert[0], (int)rvert.size());
+	imesh.set_data(EL_INDEX, &index[0], (int)index.size());
+
+	EmitShape ishape(&imesh);
+	failed += !check_freq("indexed mesh", area, ntris, ishape, false);
+
+	// a polyline along X, with segments of different lengths laid end to end
+	static const float seg_len[] = {4.0f, 1.0f, 0.5f, 2.5f, 9.0f, 0.0f, 3.0f};
+	const int nseg = sizeof seg_len / sizeof *seg_len;
+
+	std::vector<Vector3> pts;
+	pts.push_back(Vector3(0, 0, 0));
+	for(int i=0; i<nseg; i++) {
+		pts.push_back(pts.back() + Vector3(seg_len[i], 0, 0));
+	}
+
+	EmitShape cshape;
+	cshape.set_curve(&pts[0], (int)pts.size());
+	failed += !check_freq("curve", seg_len, nseg, cshape, true);
+
+	if(failed) {
+		printf("%d test(s) failed\n", failed);
+		return 1;
+	}
+	printf("all tests passed\n");
+	return 0;
+}
+
+/* samples the shape, finds which triangle or segment each point came from,
+ * and checks the counts against the expected ones, within 5 standard
+ * deviations of the binomial distribution.
+ */
+static bool check_freq(const char *name, const float *size, int count, const EmitShape &shape,
+		bool curve)
+{
+	float total = 0.0f;
+	for(int i=0; i<count; i++) {
+		total += size[i];
+	}
+
+	/* the segments of curves are identified by where the point falls between
+	 * the cumulative lengths, triangles by their slot along X.
+	 */
+	std::vector<float> start(count + 1, 0.0f);
+	for(int i=0; i<count; i++) {
+		start[i + 1] = start[i] + size[i];
+	}
+
+	std::vector<int> hits(count, 0);
+	RandGen rng(1234);
+
+	for(int i=0; i<NUM_SAMPLES; i++) {
+		Vector3 pos, norm;
+		if(!shape.sample(&rng, &pos, &norm)) {
+			printf("%s: FAILED, sample returned false\n", name);
+			return false;
+		}
+
+		int idx = -1;
+		if(curve) {
+			for(int j=0; j<count; j++) {
+				if(size[j] > 0.0f && pos.x >= start[j] && pos.x <= start[j + 1]) {
+					idx = j;
+					break;
+				}
+			}
+		} else {
+			idx = (int)floor(pos.x / SPACING);
+		}
+		if(idx < 0 || idx >= count) {
+			printf("%s: FAILED, sample outside the shape: %g %g %g\n", name, pos.x, pos.y, pos.z);
+			return false;
+		}
+		hits[idx]++;
+	}
+
+	bool res = true;
+	for(int i=0; i<count; i++) {
+		double p = size[i] / total;
+		double expected = p * NUM_SAMPLES;
+		double sdev = sqrt(NUM_SAMPLES * p * (1.0 - p));
+
+		if(fabs(hits[i] - expected) > 5.0 * sdev || (p == 0.0 && hits[i] > 0)) {
+			printf("%s: FAILED, element %d: %d samples, expected %.0f\n", name, i, hits[i], expected);
+			res = false;
+		}
+	}
+	if(res) {
+		printf("%s: ok\n", name);
+	}
+	return res;
+}
@@ -0,0 +1,294 @@
+/* checks the compressed form of animation tracks: round trips through
+ * KeyCodec stay within the quantization error, keyframe reduction stays
+ * within the requested error, and compress falls back to the uncompressed
+ * keys when key times don't fit in 16bit offsets.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include "anim.h"
+
+using namespace henge;
+
+static bool test_vec_codec();
+static bool test_quat_codec();
+static bool test_reduce_vec();
+static bool test_reduce_quat();
+static bool test_time_overflow();
+
+static bool quat_round_trip(const Quaternion &q, float max_err);
+static Quaternion rand_quat();
+static float frand(float lo, float hi);
+
+int main()
+{
+	int failed = 0;
+
+	srand(0);
+
+	failed += !test_vec_codec();
+	failed += !test_quat_codec();
+	failed += !test_reduce_vec();
+	failed += !test_reduce_quat();
+	failed += !test_time_overflow();
+
+	if(failed) {
+		printf("%d test(s) failed\n", failed);
+		return 1;
+	}
+	printf("all tests passed\n");
+	return 0;
+}
+
+/* every component is quantized to 16 bits over the range of the keys, so
+ * it can be off by at most half a step (plus float rounding of the range).
+ */
+static bool test_vec_codec()
+{
+	std::vector<TrackKey<Vector3> > keys;
+	for(int i=0; i<1000; i++) {
+		Vector3 v(frand(-100.0, 100.0), frand(-0.01, 0.01), frand(-5000.0, -1000.0));
+		keys.push_back(TrackKey<Vector3>(v, i));
+	}
+
+	float range[KEY_CODEC_RANGE_SIZE];
+	if(!KeyCodec<Vector3>::init(&keys[0], (int)keys.size(), range)) {
+		printf("vector codec: FAILED, init refused a Vector3 track\n");
+		return false;
+	}
+
+	for(size_t i=0; i<keys.size(); i++) {
+		uint16_t packed[3];
+		KeyCodec<Vector3>::encode(keys[i].val, range, packed);
+		Vector3 res = KeyCodec<Vector3>::decode(packed, range);
+
+		for(int j=0; j<3; j++) {
+			float max_err = range[j + 3] * 0.5 + fabs(keys[i].val[j]) * 1e-6;
+			if(fabs(res[j] - keys[i].val[j]) > max_err) {
+				printf("vector codec: FAILED, key %d component %d: %g decoded as %g (max error %g)\n",
+						(int)i, j, keys[i].val[j], res[j], max_err);
+				return false;
+			}
+		}
+	}
+
+	// all keys equal: everything has a zero step
+	std::vector<TrackKey<Vector3> > same(10, TrackKey<Vector3>(Vector3(1, -2, 3), 0));
+	KeyCodec<Vector3>::init(&same[0], (int)same.size(), range);
+	uint16_t packed[3];
+	KeyCodec<Vector3>::encode(same[0].val, range, packed);
+	Vector3 res = KeyCodec<Vector3>::decode(packed, range);
+	if((res - same[0].val).length() > 1e-6) {
+		printf("vector codec: FAILED, constant key decoded as (%g %g %g)\n", res.x, res.y, res.z);
+		return false;
+	}
+
+	printf("vector codec: ok\n");
+	return true;
+}
+
+/* three components of 15 bits in +/- 1/sqrt(2): a step of about 4.3e-5,
+ * which makes the angle between the original and decoded rotation well
+ * under 2e-4 radians.
+ */
+#define QUAT_MAX_ERR	2e-4
+
+static bool test_quat_codec()
+{
+	// the largest component in every position, with either sign
+	for(int i=0; i<4; i++) {
+		for(int sign=-1; sign<=1; sign+=2) {
+			float c[4] = {0.1, -0.2, 0.3, -0.15};
+			c[i] = 0.9 * sign;
+			if(!quat_round_trip(Quaternion(c[3], c[0], c[1], c[2]), QUAT_MAX_ERR)) {
+				return false;
+			}
+		}
+	}
+
+	// exactly on the axes, and with two components tied for the largest
+	static const float axes[][4] = {
+		{1, 0, 0, 0}, {-1, 0, 0, 0}, {0, 0, 0, 1}, {0, 0, 0, -1},
+		{0.70710678, 0.70710678, 0, 0}, {-0.70710678, 0, 0, 0.70710678},
+		{0.5, -0.5, 0.5, -0.5}, {-0.5, -0.5, -0.5, -0.5}
+	};
+	for(int i=0; i<(int)(sizeof axes / sizeof *axes); i++) {
+		const float *c = axes[i];
+		if(!quat_round_trip(Quaternion(c[3], c[0], c[1], c[2]), QUAT_MAX_ERR)) {
+			return false;
+		}
+	}
+
+	// random rotations, and their negations, which are the same rotations
+	for(int i=0; i<10000; i++) {
+		Quaternion q = rand_quat();
+		if(!quat_round_trip(q, QUAT_MAX_ERR) || !quat_round_trip(-q, QUAT_MAX_ERR)) {
+			return false;
+		}
+	}
+
+	// the codec normalizes its input
+	if(!quat_round_trip(Quaternion(-3.0, 1.0, 0.5, -2.0), QUAT_MAX_ERR)) {
+		return false;
+	}
+
+	printf("quaternion codec: ok\n");
+	return true;
+}
+
+static bool test_reduce_vec()
+{
+	Track<Vector3> track;
+	std::vector<TrackKey<Vector3> > keys;
+
+	// straight stretches, curves and noise
+	for(int i=0; i<2000; i++) {
+		float t = i / 100.0;
+		Vector3 v(t * 3.0, sin(t) * 10.0, i < 1000 ? 0.0 : frand(-0.05, 0.05));
+		keys.push_back(TrackKey<Vector3>(v, i * 10));
+	}
+	track.set_keys(&keys[0], (int)keys.size());
+
+	const float max_err = 0.02;
+	int removed = track.reduce(max_err);
+	if(removed <= 0 || track.get_key_count() != (int)keys.size() - removed) {
+		printf("reduce vector: FAILED, removed %d of %d keys, %d left\n", removed,
+				(int)keys.size(), track.get_key_count());
+		return false;
+	}
+
+	for(size_t i=0; i<keys.size(); i++) {
+		float err = key_error(track(keys[i].time), keys[i].val);
+		if(err > max_err * 1.0001) {
+			printf("reduce vector: FAILED, error %g at time %d (max %g)\n", err, keys[i].time, max_err);
+			return false;
+		}
+	}
+	printf("reduce vector: ok (%d of %d keys removed)\n", removed, (int)keys.size());
+	return true;
+}
+
+static bool test_reduce_quat()
+{
+	Track<Quaternion> track;
+	std::vector<TrackKey<Quaternion> > keys;
+
+	// a steady spin, then a wobble around it
+	for(int i=0; i<2000; i++) {
+		float t = i / 200.0;
+		float wobble = i < 1000 ? 0.0 : sin(t * 7.0) * 0.3;
+		Quaternion q(Vector3(0, 1, 0), t);
+		q = q * Quaternion(Vector3(1, 0, 0), wobble);
+		keys.push_back(TrackKey<Quaternion>(q, i * 10));
+	}
+	track.set_keys(&keys[0], (int)keys.size());
+
+	const float max_err = 0.005;
+	int removed = track.reduce(max_err);
+	if(removed <= 0) {
+		printf("reduce quaternion: FAILED, no keys removed\n");
+		return false;
+	}
+
+	for(size_t i=0; i<keys.size(); i++) {
+		float err = key_error(track(keys[i].time), keys[i].val);
+		if(err > max_err * 1.0001) {
+			printf("reduce quaternion: FAILED, error %g at time %d (max %g)\n", err, keys[i].time, max_err);
+			return false;
+		}
+	}
+	printf("reduce quaternion: ok (%d of %d keys removed)\n", removed, (int)keys.size());
+	return true;
+}
+
+/* key times are stored as 16bit offsets from the first key of each block of
+ * TRACK_KEY_BLOCK keys: a block spanning more than that can't be compressed,
+ * and must leave the track as it was.
+ */
+static bool test_time_overflow()
+{
+	std::vector<TrackKey<Vector3> > keys;
+	for(int i=0; i<TRACK_KEY_BLOCK * 3; i++) {
+		keys.push_back(TrackKey<Vector3>(Vector3(i, -i, i * 0.5), i * 1000));
+	}
+	// a gap in the second block which pushes its last key over the limit
+	for(int i=TRACK_KEY_BLOCK + 5; i<(int)keys.size(); i++) {
+		keys[i].time += 60000;
+	}
+
+	Track<Vector3> track;
+	track.set_keys(&keys[0], (int)keys.size());
+	if(track.compress() || track.is_compressed()) {
+		printf("time overflow: FAILED, compressed a track with a block over 16bit offsets\n");
+		return false;
+	}
+	if(track.get_key_count() != (int)keys.size()) {
+		printf("time overflow: FAILED, %d keys left of %d\n", track.get_key_count(), (int)keys.size());
+		return false;
+	}
+	for(size_t i=0; i<keys.size(); i++) {
+		TrackKey<Vector3> k = track.get_key_at(i);
+		if(k.time != keys[i].time || k.val != keys[i].val) {
+			printf("time overflow: FAILED, key %d changed by the failed compression\n", (int)i);
+			return false;
+		}
+	}
+
+	// the same gap at the start of a block fits, as offsets restart there
+	for(int i=TRACK_KEY_BLOCK + 5; i<(int)keys.size(); i++) {
+		keys[i].time -= 60000;
+	}
+	for(int i=TRACK_KEY_BLOCK * 2; i<(int)keys.size(); i++) {
+		keys[i].time += 60000;
+	}
+	track.set_keys(&keys[0], (int)keys.size());
+	if(!track.compress() || !track.is_compressed()) {
+		printf("time overflow: FAILED, couldn't compress a track with a gap between blocks\n");
+		return false;
+	}
+	for(size_t i=0; i<keys.size(); i++) {
+		TrackKey<Vector3> k = track.get_key_at(i);
+		if(k.time != keys[i].time || (k.val - keys[i].val).length() > 1e-3) {
+			printf("time overflow: FAILED, key %d at %d decoded as key at %d\n", (int)i,
+					keys[i].time, k.time);
+			return false;
+		}
+	}
+
+	printf("time overflow: ok\n");
+	return true;
+}
+
+static bool quat_round_trip(const Quaternion &q, float max_err)
+{
+	float range[KEY_CODEC_RANGE_SIZE];
+	TrackKey<Quaternion> key(q, 0);
+	KeyCodec<Quaternion>::init(&key, 1, range);
+
+	uint16_t packed[3];
+	KeyCodec<Quaternion>::encode(q, range, packed);
+	Quaternion res = KeyCodec<Quaternion>::decode(packed, range);
+
+	float err = key_error(q, res);
+	if(err > max_err || fabs(res.length() - 1.0) > 1e-3) {
+		printf("quaternion codec: FAILED, (%g %g %g %g) decoded as (%g %g %g %g), error %g\n",
+				q.s, q.v.x, q.v.y, q.v.z, res.s, res.v.x, res.v.y, res.v.z, err);
+		return false;
+	}
+	return true;
+}
+
+static Quaternion rand_quat()
+{
+	Quaternion q;
+	do {
+		q = Quaternion(frand(-1, 1), frand(-1, 1), frand(-1, 1), frand(-1, 1));
+	} while(q.length() < 0.1 || q.length() > 1.0);
+	return q.normalized();
+}
+
+static float frand(float lo, float hi)
+{
+	return lo + (hi - lo) * (float)rand() / (float)RAND_MAX;
+}
@@ -0,0 +1,125 @@
+/* checks the radix sort used for depth sorting particles against
+ * std::stable_sort, with negative keys, signed zeros, duplicates, and key
+ * sets where some or all of the passes are skipped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "radix.h"
+
+using namespace henge;
+
+static bool check(const char *name, const std::vector<float> &keys);
+static bool key_less(float a, float b);
+static float frand(float lo, float hi);
+
+static const float *key_arr;
+
+struct IndexLess {
+	bool operator ()(unsigned int a, unsigned int b) const
+	{
+		return key_less(key_arr[a], key_arr[b]);
+	}
+};
+
+int main()
+{
+	int failed = 0;
+	std::vector<float> keys;
+
+	srand(0);
+
+	// random keys on both sides of zero
+	for(int i=0; i<5000; i++) {
+		keys.push_back(frand(-1000.0f, 1000.0f));
+	}
+	failed += !check("mixed signs", keys);
+
+	// only negative keys
+	keys.clear();
+	for(int i=0; i<5000; i++) {
+		keys.push_back(frand(-50.0f, -0.001f));
+	}
+	failed += !check("negative", keys);
+
+	// signed zeros and duplicates, in a jumbled order
+	keys.clear();
+	for(int i=0; i<300; i++) {
+		static const float vals[] = {0.0f, -0.0f, 1.0f, -1.0f, 0.5f, -0.5f};
+		keys.push_back(vals[rand() % 6]);
+	}
+	failed += !check("zeros and duplicates", keys);
+
+	// keys which only differ in the low bits: the upper passes are skipped
+	keys.clear();
+	for(int i=0; i<2000; i++) {
+		keys.push_back(1.0f + (float)(rand() % 1024) * 1e-7f);
+	}
+	failed += !check("low bits only", keys);
+
+	// all the same: every pass is skipped
+	keys.assign(1000, -3.25f);
+	failed += !check("all equal", keys);
+
+	keys.assign(1, 42.0f);
+	failed += !check("single key", keys);
+
+	// infinities sort to the ends
+	keys.clear();
+	for(int i=0; i<1000; i++) {
+		keys.push_back(frand(-1e30f, 1e30f));
+	}
+	keys[10] = 1e30f * 1e30f;
+	keys[20] = -1e30f * 1e30f;
+	failed += !check("infinities", keys);
+
+	if(failed) {
+		printf("%d test(s) failed\n", failed);
+		return 1;
+	}
+	printf("all tests passed\n");
+	return 0;
+}
+
+static bool check(const char *name, const std::vector<float> &keys)
+{
+	int count = (int)keys.size();
+
+	std::vector<unsigned int> expected(count);
+	for(int i=0; i<count; i++) {
+		expected[i] = i;
+	}
+	key_arr = &keys[0];
+	std::stable_sort(expected.begin(), expected.end(), IndexLess());
+
+	const unsigned int *order = radix_sort(&keys[0], count);
+
+	for(int i=0; i<count; i++) {
+		if(order[i] != expected[i]) {
+			printf("%s: FAILED at %d: got key %g (index %u), expected %g (index %u)\n", name, i,
+					keys[order[i]], order[i], keys[expected[i]], expected[i]);
+			return false;
+		}
+	}
+	printf("%s: ok\n", name);
+	return true;
+}
+
+// ascending order, with -0 before +0 like the radix sort keys
+static bool key_less(float a, float b)
+{
+	if(a == b) {
+		unsigned int ua, ub;
+		memcpy(&ua, &a, sizeof ua);
+		memcpy(&ub, &b, sizeof ub);
+		return (ua >> 31) > (ub >> 31);
+	}
+	return a < b;
+}
+
+static float frand(float lo, float hi)
+{
+	return lo + (hi - lo) * (float)rand() / (float)RAND_MAX;
+}